@@ -0,0 +1,89 @@
+#include "License.h"
+#include "SD_Misc.h"
+
+/*
+ * eMMC 5.1 Command Queuing Host Controller Interface (JESD84-B51 Annex B).
+ * The block sits in the vendor area of the SDHCI register space, CQHCI_OFFSET
+ * bytes after the standard registers.
+ */
+struct __attribute__ ((__packed__)) CQHCIRegMap_t {
+	volatile UInt32 CQVER;						//0x00
+	volatile UInt32 CQCAP;						//0x04
+	volatile UInt32 CQCFG;						//0x08
+	volatile UInt32 CQCTL;						//0x0C
+	volatile UInt32 CQIS;						//0x10
+	volatile UInt32 CQISTE;						//0x14
+	volatile UInt32 CQISGE;						//0x18
+	volatile UInt32 CQIC;						//0x1C
+	volatile UInt32 CQTDLBA;					//0x20
+	volatile UInt32 CQTDLBAU;					//0x24
+	volatile UInt32 CQTDBR;						//0x28
+	volatile UInt32 CQTCN;						//0x2C
+	volatile UInt32 CQDQS;						//0x30
+	volatile UInt32 CQDPT;						//0x34
+	volatile UInt32 CQTCLR;						//0x38
+	volatile UInt32 Reserved0;					//0x3C
+	volatile UInt32 CQSSC1;						//0x40
+	volatile UInt32 CQSSC2;						//0x44
+	volatile UInt32 CQCRDCT;					//0x48
+	volatile UInt32 Reserved1;					//0x4C
+	volatile UInt32 CQRMEM;						//0x50
+	volatile UInt32 CQTERRI;					//0x54
+	volatile UInt32 CQCRI;						//0x58
+	volatile UInt32 CQCRA;						//0x5C
+};
+
+#define CQHCI_OFFSET		0x200
+
+//CQVER
+#define CQVER_MAJOR(x)	(((x) >> 8) & 0xF)
+
+//CQCAP
+#define CQCAP_ITCFVAL(x)	((x) & 0x3FF)
+#define CQCAP_ITCFMUL(x)	(((x) >> 12) & 0xF)
+#define CQCAP_RESERVED	0x0FFF0C00
+
+//CQCFG
+#define CQDCMDEnable	BIT12
+#define CQTaskDesc128	BIT8
+#define CQEnable		BIT0
+
+//CQCTL
+#define CQClearAllTasks	BIT8
+#define CQHalt			BIT0
+
+//CQIS, CQISTE, CQISGE
+#define CQTaskCleared	BIT3
+#define CQRespErrDet	BIT2
+#define CQTaskComplete	BIT1
+#define CQHaltComplete	BIT0
+
+//CQIC
+#define CQICEnable		BIT31
+#define CQICCounterRst	BIT16
+#define CQICThreshWEn	BIT15
+#define CQICTimeoutWEn	BIT7
+#define CQIC_THRESH(x)	(((x) & 0x1F) << 8)
+#define CQIC_TIMEOUT(x)	((x) & 0x7F)
+
+//CQTERRI
+#define CQDataErrValid	BIT31
+#define CQRespErrValid	BIT15
+
+/*
+ * Task and transfer descriptors, 64 bit task descriptors with 32 bit
+ * (ADMA2) transfer descriptors.  Each slot of the task list holds a task
+ * descriptor followed by the transfer descriptor for its data.
+ */
+#define CQ_DESC_VALID		(1ULL << 0)
+#define CQ_DESC_END			(1ULL << 1)
+#define CQ_DESC_INT			(1ULL << 2)
+#define CQ_DESC_ACT_TASK	(5ULL << 3)
+#define CQ_DESC_ACT_TRAN	(4ULL << 3)
+#define CQ_TASK_READ		(1ULL << 12)
+#define CQ_TASK_BLKCNT(x)	(((UInt64)(x) & 0xFFFF) << 16)
+#define CQ_TASK_BLKADDR(x)	((UInt64)(x) << 32)
+#define CQ_TRAN_LEN(x)		(((UInt64)(x) & 0xFFFF) << 16)
+#define CQ_TRAN_ADDR(x)		((UInt64)(x) << 32)
+
+#define CQHCI_SLOT_SIZE		16
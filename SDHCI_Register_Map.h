@@ -2,7 +2,11 @@
 #include "SD_Misc.h"
 
 struct __attribute__ ((__packed__)) SDHCIRegMap_t {
-	volatile UInt32 SDMASysAddr;				//0x00
+	union {
+		volatile UInt32 SDMASysAddr;			//0x00
+		volatile UInt32 BlockCount32;			//0x00, Host Version 4 mode
+		volatile UInt32 Argument2;				//0x00, Auto CMD23 argument
+	};
 	volatile UInt16 BlockSize;					//0x04
 	volatile UInt16 BlockCount;					//0x06
 	volatile UInt32 Argument;					//0x08
@@ -25,7 +29,7 @@ struct __attribute__ ((__packed__)) SDHCIRegMap_t {
 	volatile UInt16 NormalIntSignalEn;			//0x38
 	volatile UInt16 ErrorIntSignalEn;			//0x3A
 	volatile UInt16 CMD12ErrorStatus;			//0x3C
-	volatile UInt16 Reserved0;					//0x3E
+	volatile UInt16 HostControl2;				//0x3E
 	volatile UInt32 Capabilities[2];			//0x40
 	volatile UInt32 MaxCurrentCap[2];			//0x48
 	volatile UInt16 ForceEventCMD12ErrStatus;	//0x50
@@ -34,7 +38,10 @@ struct __attribute__ ((__packed__)) SDHCIRegMap_t {
 	volatile UInt8  Reserved1;					//0x55
 	volatile UInt16 Reserved2;					//0x56
 	volatile UInt32 ADMASystemAddr[2];			//0x58
-	volatile UInt16 ReservedArray[78];			//0x60
+	volatile UInt16 PresetValue[8];				//0x60
+	volatile UInt32 Reserved3[2];				//0x70
+	volatile UInt32 ADMA3IntDescAddr[2];		//0x78
+	volatile UInt16 ReservedArray[62];			//0x80
 	volatile UInt16 SlotIntStatus;				//0xFC
 	volatile UInt16 HostControllerVer;			//0xFE
 };
@@ -64,9 +71,27 @@ struct __attribute__ ((__packed__)) SDHCIRegMap_t {
 #define DMASel32ADMA2	BIT3
 #define DMASel64ADMA2	BIT4|BIT3
 #define HighSpeedEn		BIT2
+#define DataXferWidth8	BIT5
 #define DataXferWidth	BIT1
 #define LedControl		BIT0
 
+//HostControl2 (SDHCI 3.0)
+#define SamplingClkSel	BIT7
+#define ExecuteTuning	BIT6
+#define Signal1v8En		BIT3
+#define UHSModeMask		BIT2|BIT1|BIT0
+#define UHSModeSDR12	0
+#define UHSModeSDR25	BIT0
+#define UHSModeSDR104	BIT1|BIT0
+#define UHSModeDDR50	BIT2
+//HostControl2 (SDHCI 4.0)
+#define PresetValueEn	BIT15
+#define AsyncIntEn		BIT14
+#define Addr64En		BIT13
+#define HostVer4En		BIT12
+#define CMD23En			BIT11
+#define ADMA2Len26En	BIT10
+
 //PowerControl
 #define HC3v3			0xE
 #define HC3v0			0xD
@@ -95,6 +120,7 @@ struct __attribute__ ((__packed__)) SDHCIRegMap_t {
 #define SDMASupport		BIT22
 #define HighSpSupport	BIT21
 #define ADMA2Support	BIT19
+#define CR8BitSupport	BIT18
 #define BlockLen512		0
 #define BlockLen1024	BIT16
 #define BlockLen2048	BIT17
@@ -102,6 +128,13 @@ struct __attribute__ ((__packed__)) SDHCIRegMap_t {
 #define TOutClockUnit	BIT7
 #define TOutClockMask	BIT5|BIT4|BIT3|BIT2|BIT1|BIT0
 
+//Capabilities[1] (SDHCI 3.0)
+#define CRDDR50Support	BIT2
+#define CRSDR104Support	BIT1
+#define CRSDR50Support	BIT0
+//Capabilities[1] (SDHCI 4.2)
+#define CRADMA3Support	BIT27
+
 //MaxCurrentCap
 #define MaxCur1v8Mask	BIT23|BIT22|BIT21|BIT20|BIT19|BIT18|BIT17|BIT16
 #define MaxCur3v0Mask	BIT15|BIT14|BIT13|BIT12|BIT11|BIT10|BIT9|BIT8
@@ -140,3 +173,21 @@ struct __attribute__ ((__packed__)) SDHCIRegMap_t {
 #define CmdCRCError		BIT1
 #define CmdTimeoutError	BIT0
 
+
+/*
+ * ADMA2 and ADMA3 descriptors, 32 bit addressing.  An ADMA3 command
+ * descriptor set is four entries loaded into 0x00, 0x04, 0x08 and 0x0C in
+ * that order, followed by the ADMA2 descriptors for its data.  The
+ * integrated descriptor table points at one command descriptor set per
+ * entry.
+ */
+#define ADMA_DESC_VALID		(1ULL << 0)
+#define ADMA_DESC_END		(1ULL << 1)
+#define ADMA_DESC_INT		(1ULL << 2)
+#define ADMA_ACT_TRAN		(4ULL << 3)
+#define ADMA_ACT_LINK		(6ULL << 3)
+#define ADMA3_ACT_CMD		(1ULL << 3)
+#define ADMA3_ACT_INTEGRATED	(7ULL << 3)
+#define ADMA_DESC_LEN(x)	(((UInt64)(x) & 0xFFFF) << 16)
+#define ADMA_DESC_ADDR(x)	((UInt64)(x) << 32)
+#define ADMA3_CMD_DATA(x)	((UInt64)(x) << 32)
@@ -10,11 +10,15 @@
 #define SD_SEND_RELATIVE_ADDR     3   /* bcr                     R6  */
 #define SD_SEND_IF_COND           8   /* bcr  [11:0] See below   R7  */
 
+#define SD_VOLTAGE_SWITCH        11   /* ac   [31:0] stuff bits  R1  */
+#define SD_SPEED_CLASS_CONTROL   20   /* ac   [31:28] control    R1b */
+
   /* class 10 */
 #define SD_SWITCH                 6   /* adtc [31:0] See below   R1  */
 
   /* Application commands */
 #define SD_APP_SET_BUS_WIDTH      6   /* ac   [1:0] bus width    R1  */
+#define SD_APP_SD_STATUS         13   /* adtc                    R1  */
 #define SD_APP_SEND_NUM_WR_BLKS  22   /* adtc                    R1  */
 #define SD_APP_SET_WR_BLK_ERASE_COUNT 23	/*		 R1 */
 #define SD_APP_OP_COND           41   /* bcr  [31:0] OCR         R3  */
@@ -43,6 +47,7 @@
 #define SD_SET_BLOCKLEN         16   /* ac   [31:0] block len   R1  */
 #define SD_READ_SINGLE_BLOCK    17   /* adtc [31:0] data addr   R1  */
 #define SD_READ_MULTIPLE_BLOCK  18   /* adtc [31:0] data addr   R1  */
+#define SD_SEND_TUNING_BLOCK_HS200 21 /* adtc                   R1  */
 
   /* class 3 */
 #define SD_WRITE_DAT_UNTIL_STOP 20   /* adtc [31:0] data addr   R1  */
@@ -71,6 +76,18 @@
   /* class 7 */
 #define SD_LOCK_UNLOCK          42   /* adtc                    R1b */
 
+  /* class 1 (SD 6.0 command queue) */
+#define SD_Q_MANAGEMENT         43   /* ac   [20:16] task, [3:0] op R1b */
+#define SD_Q_TASK_INFO_A        44   /* ac   See below          R1  */
+#define SD_Q_TASK_INFO_B        45   /* ac   [31:0] data addr   R1  */
+#define SD_Q_RD_TASK            46   /* adtc [20:16] task ID    R1  */
+#define SD_Q_WR_TASK            47   /* adtc [20:16] task ID    R1  */
+
+  /* class 11 (SD 4.0 extension registers) */
+#define SD_READ_EXTR_SINGLE     48   /* adtc See below          R1  */
+#define SD_WRITE_EXTR_SINGLE    49   /* adtc See below          R1b */
+#define MMC_CMDQ_TASK_MGMT      48   /* ac   [20:16] task, [3:0] op R1b */
+
   /* class 8 */
 #define SD_APP_CMD              55   /* ac   [31:16] RCA        R1  */
 #define SD_GEN_CMD              56   /* adtc [0] RD/WR          R1  */
@@ -123,6 +140,7 @@
 #define R1_STATUS(x)            (x & 0xFFFFE000)
 #define R1_CURRENT_STATE(x)	((x & 0x00001E00) >> 9)	/* sx, b (4 bits) */
 #define R1_READY_FOR_DATA	(1 << 8)	/* sx, a */
+#define R1_SWITCH_ERROR		(1 << 7)	/* sx, c (MMC) */
 #define R1_APP_CMD		(1 << 5)	/* sr, c */
 
 /*
@@ -196,6 +214,11 @@ struct _mmc_csd {
  * OCR bits are mostly in host.h
  */
 #define MMC_CARD_BUSY	0x80000000	/* Card Power up status bit */
+#define MMC_OCR_SECTOR_MODE	0x40000000	/* Access mode: sector addressing */
+#define MMC_OCR_VDD_27_36	0x00FF8000	/* 2.7V - 3.6V */
+
+/* Relative card address the host assigns to an MMC card */
+#define MMC_DEFAULT_RCA		1
 
 /*
  * Card Command Classes (CCC)
@@ -245,11 +268,16 @@ struct _mmc_csd {
  * EXT_CSD fields
  */
 
+#define EXT_CSD_CMDQ_MODE_EN	15	/* R/W */
 #define EXT_CSD_BUS_WIDTH	183	/* R/W */
 #define EXT_CSD_HS_TIMING	185	/* R/W */
 #define EXT_CSD_CARD_TYPE	196	/* RO */
 #define EXT_CSD_REV		192	/* RO */
 #define EXT_CSD_SEC_CNT		212	/* RO, 4 bytes */
+#define EXT_CSD_CMDQ_DEPTH	307	/* RO */
+#define EXT_CSD_CMDQ_SUPPORT	308	/* RO */
+
+#define EXT_CSD_SIZE		512
 
 /*
  * EXT_CSD field definitions
@@ -261,10 +289,23 @@ struct _mmc_csd {
 
 #define EXT_CSD_CARD_TYPE_26	(1<<0)	/* Card can run at 26MHz */
 #define EXT_CSD_CARD_TYPE_52	(1<<1)	/* Card can run at 52MHz */
+#define EXT_CSD_CARD_TYPE_DDR_1_8V	(1<<2)	/* Card can run at 52MHz DDR, 1.8V or 3V I/O */
+#define EXT_CSD_CARD_TYPE_DDR_1_2V	(1<<3)	/* Card can run at 52MHz DDR, 1.2V I/O */
+#define EXT_CSD_CARD_TYPE_HS200_1_8V	(1<<4)	/* Card can run at 200MHz SDR, 1.8V I/O */
+#define EXT_CSD_CARD_TYPE_HS200_1_2V	(1<<5)	/* Card can run at 200MHz SDR, 1.2V I/O */
+#define EXT_CSD_CARD_TYPE_HS400_1_8V	(1<<6)	/* Card can run at 200MHz DDR, 1.8V I/O */
+#define EXT_CSD_CARD_TYPE_HS400_1_2V	(1<<7)	/* Card can run at 200MHz DDR, 1.2V I/O */
 
 #define EXT_CSD_BUS_WIDTH_1	0	/* Card is in 1 bit mode */
 #define EXT_CSD_BUS_WIDTH_4	1	/* Card is in 4 bit mode */
 #define EXT_CSD_BUS_WIDTH_8	2	/* Card is in 8 bit mode */
+#define EXT_CSD_DDR_BUS_WIDTH_4	5	/* Card is in 4 bit DDR mode */
+#define EXT_CSD_DDR_BUS_WIDTH_8	6	/* Card is in 8 bit DDR mode */
+
+#define EXT_CSD_TIMING_BC	0	/* Backwards compatible timing */
+#define EXT_CSD_TIMING_HS	1	/* High speed timing */
+#define EXT_CSD_TIMING_HS200	2	/* HS200 timing */
+#define EXT_CSD_TIMING_HS400	3	/* HS400 timing */
 
 /*
  * MMC_SWITCH access modes
@@ -288,6 +329,64 @@ struct _mmc_csd {
  *      [3:0] Function group 1
  */
 
+/*
+ * SD_Q_TASK_INFO_A argument format:
+ *
+ *	[31]    Reserved (0)
+ *	[30]    Direction, 1 = read
+ *	[29:21] Reserved (0)
+ *	[20:16] Task ID
+ *	[15:0]  Number of blocks
+ *
+ * SD_SEND_STATUS with bit 15 set returns the Queue Status Register (one
+ * ready bit per task ID) in place of the card status.
+ */
+#define SD_Q_TASK_READ		(1 << 30)
+#define SD_Q_TASK_ID(x)		(((x) & 0x1F) << 16)
+#define SD_Q_SEND_QSR		(1 << 15)
+
+/*
+ * SD_Q_MANAGEMENT operation codes
+ */
+#define SD_Q_ABORT_QUEUE	0x1
+#define SD_Q_ABORT_TASK		0x2
+
+/*
+ * MMC_CMDQ_TASK_MGMT operation codes (eMMC 5.1)
+ */
+#define MMC_CMDQ_DISCARD_QUEUE	0x1
+#define MMC_CMDQ_DISCARD_TASK	0x2
+
+/*
+ * SD_READ_EXTR_SINGLE / SD_WRITE_EXTR_SINGLE argument format:
+ *
+ *	[31]    MIO (CMD48) / mask write mode (CMD49), always 0 here
+ *	[30:27] Function number
+ *	[26]    Reserved
+ *	[25:18] Page number
+ *	[17:9]  Offset within page
+ *	[8:0]   Length - 1
+ */
+#define SD_EXTR_ARG(fno, page, off, len) \
+	((((fno) & 0xF) << 27) | (((page) & 0xFF) << 18) | \
+	 (((off) & 0x1FF) << 9) | (((len) - 1) & 0x1FF))
+
+/*
+ * SD extension register standard function codes and the offsets used
+ * within the Performance Enhancement register page.
+ */
+#define SD_EXT_SFC_PERF		0x0002
+#define SD_EXT_PERF_CMDQ_SUPPORT	6	/* [4:0] queue depth - 1 */
+#define SD_EXT_PERF_CMDQ_ENABLE		262	/* [0] command queue mode */
+
+/*
+ * SD Status fields (byte offsets into the 64 byte ACMD13 response)
+ */
+#define SD_STATUS_AU_SIZE		10	/* [7:4] allocation unit size code */
+#define SD_STATUS_APP_PERF_CLASS	21	/* [3:0] 1 = A1, 2 = A2 */
+#define SD_STATUS_PERF_ENHANCE		22	/* [7:3] queue depth - 1 */
+#define SD_APP_PERF_CLASS_A2		2
+
 /*
  * SD_SEND_IF_COND argument format:
  *
@@ -304,6 +403,9 @@ struct _mmc_csd {
 #define SCR_SPEC_VER_1		1	/* Implements system specification 1.10 */
 #define SCR_SPEC_VER_2		2	/* Implements system specification 2.00 */
 
+#define SCR_CMD_SUPPORT		3	/* byte holding SCR[39:32] */
+#define SCR_CMD23_SUPPORT	0x02	/* SCR[33]: SET_BLOCK_COUNT */
+
 /*
  * SD bus widths
  */
@@ -340,9 +442,10 @@ struct _mmc_csd {
 #define R5b 7
 #define R6	8
 #define R7	9
+#define SD_RSP_ANY	0xff	/* response depends on the card or CMD55 */
 
 #define SDCR0	R0
-#define SDCR1	R0
+#define SDCR1	R3
 #define SDCR2	R2
 #define SDCR3	R6
 #define SDCR4	R0
@@ -360,14 +463,14 @@ struct _mmc_csd {
 #define SDCR16	R1
 #define SDCR17	R1
 #define SDCR18	R1
-#define SDCR19	R0
+#define SDCR19	R1
 #define SDCR20	R0
-#define SDCR21	R0
+#define SDCR21	R1
 #define SDCR22	R0
-#define SDCR23	R0
+#define SDCR23	R1
 #define SDCR24	R1
 #define SDCR25	R1
-#define SDCR26	R0
+#define SDCR26	R1
 #define SDCR27	R1
 #define SDCR28	R1b
 #define SDCR29	R1b
@@ -384,13 +487,13 @@ struct _mmc_csd {
 #define SDCR40	R0
 #define SDCR41	R0
 #define SDCR42	R1
-#define SDCR43	R0
-#define SDCR44	R0
-#define SDCR45	R0
-#define SDCR46	R0
-#define SDCR47	R0
-#define SDCR48	R0
-#define SDCR49	R0
+#define SDCR43	R1b
+#define SDCR44	R1
+#define SDCR45	R1
+#define SDCR46	R1
+#define SDCR47	R1
+#define SDCR48	R1
+#define SDCR49	R1b
 #define SDCR50	R0
 #define SDCR51	R0
 #define SDCR52	R0
@@ -429,7 +532,7 @@ struct _mmc_csd {
 #define SDACR20	R0
 #define SDACR21	R1
 #define SDACR22	R1
-#define SDACR23	R0
+#define SDACR23	R1
 #define SDACR24	R0
 #define SDACR25	R0
 #define SDACR26	R0
@@ -471,4 +574,17 @@ struct _mmc_csd {
 #define SDACR62	R0
 #define SDACR63	R0
 
+/*
+ * Command descriptor flags, for the commands whose use does not depend on
+ * the card type or a preceding CMD55.  Commands like CMD6, CMD8 and CMD13
+ * move data for some cards and not others; their callers say so.  CMD11
+ * and CMD20 carry their MMC flags; SD cards get theirs from commandFlags.
+ */
+#define SD_CMD_DATA	0x01	/* adtc: data on the DAT lines */
+#define SD_CMD_READ	0x02	/* the card sends the data */
+#define SD_CMD_MULTI	0x04	/* more than one block */
+#define SD_CMD_BUSY	0x08	/* R1b: the card holds DAT0 busy */
+#define SD_CMD_ACMD12	0x10	/* the host may end it with Auto CMD12 */
+#define SD_CMD_ACMD23	0x20	/* the host may lead it with Auto CMD23 */
+
 #endif  /* SD_H  */
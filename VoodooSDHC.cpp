@@ -12,10 +12,17 @@
 //#define READONLY_DRIVER	1
 
 /*
- * Builds the driver with High Speed Card support.
+ * Builds the driver with High Speed Card support on every controller, not
+ * just those with kSDQuirkHighSpeed in the quirks table.
  */
 //#define HIGHSPEED_CARD_MODE	1
 
+/*
+ * Builds the driver with eMMC HS400 support.  The SDHCI capabilities do not
+ * advertise HS400, so only turn this on for hosts known to handle it.
+ */
+//#define MMC_HS400_MODE	1
+
 /*
  * Builds the driver with 4-bit Bus support.
  */
@@ -32,22 +39,91 @@
 #define USE_SDMA 1
 
 /*
- * The Linux driver for this device claimed that the card needs to be reset
- * after every command.  That doesn't seem to be necessary so we turn on
- * NO_RESET_WAR.
+ * Use ADMA2 scatter/gather transfers on hosts that have it, straight to
+ * and from the client's memory.  Needs USE_SDMA.  Define to either 0 or 1
+ */
+#define USE_ADMA2 1
+
+/*
+ * Use SD command queueing (CMD44-CMD47) on A2 cards that support it.
+ * Define to either 0 or 1
+ */
+#define USE_CMDQ 1
+
+/*
+ * Use the host's eMMC command queue engine (CQHCI) with eMMC 5.1 cards that
+ * support command queueing.  Define to either 0 or 1
+ */
+#define USE_CQHCI 1
+
+/*
+ * Run SDHCI 4.x hosts in Host Version 4 mode (32 bit block count, ADMA3).
+ * Define to either 0 or 1
+ */
+#define USE_HOST_V4 1
+
+/*
+ * Keep a per-slot ring of every command, awaited status and interrupt,
+ * published as the CommandTrace property on request.  Costs a timestamp
+ * per event and a Response[0] read per command completion; compiles out
+ * at 0.  Define to either 0 or 1
+ */
+#define USE_CMD_TRACE 1
+
+/*
+ * Characterize each new card before its first I/O: time reads and writes
+ * across command sizes, SDMA boundaries and write alignments, and use the
+ * fastest settings.  Writes put back the data that was read, but the pass
+ * takes a second or two, so it is off by default.  Results are cached by
+ * CID.  Define to either 0 or 1
+ */
+#define USE_AUTOTUNE 0
+
+/*
+ * Copy the SDMA window and task bounce buffers with non-temporal stores,
+ * so that moving card data does not push everything else out of the CPU
+ * caches.  Used only when the CPU has SSE2.  Define to either 0 or 1
  */
-#define NO_RESET_WAR	1
+#define USE_NT_COPY 1
 
 #define SDMA_BUFFER_SIZE 32768
-#define SDMA_BUFFER_SIZE_IN_REG 0x3000 /* see def. of Block Size Register */
 #define SDMA_RETRY_COUNT 5
+#define CMDQ_MAX_DEPTH 32
+#define CQHCI_RETRY_COUNT 3	/* engine recoveries per batch before it is turned off */
+#define CMDQ_POLL_SPINS 8	/* back to back QSR polls before sleeping between them */
+#define CMDQ_POLL_TIMEOUT_MS 500	/* empty QSR polls before the queue is aborted */
+#define MAX_TUNING_LOOP 40
+#define TASK_BUFFER_SIZE 32768
+#define ADMA3_TIMEOUT_MS 5000
+#define ADMA2_TIMEOUT_MS 5000
+#define ADMA2_SEG_MAX 32768	/* bytes per descriptor, a multiple of 512 */
+#define IO_TRACE_ENTRIES 4096	/* power of 2 */
+#define CMD_TRACE_ENTRIES 1024	/* power of 2 */
+#define CQHCI_IC_THRESHOLD 4
+#define CQHCI_IC_TIMEOUT 0x10
+#define TUNE_BLOCKS 2048	/* blocks moved per measurement, power of 2 */
+#define TUNE_TOLERANCE 32	/* settings within 1/32 of the best count as ties */
+#define PRE_ERASE_BLOCKS 64	/* untuned SD cards get ACMD23 from this write size */
+#define CLEAN_RUN_STEP_UP 4096	/* clean transfers before a degraded bus steps back up */
+#define NT_COPY_MIN 4096	/* smaller bounce copies go through the cache */
+#define WAIT_SPINS 32		/* register reads before waitReg starts backing off */
+#define WAIT_BACKOFF_MAX_US 1000	/* longest delay between two reads in waitReg */
+#define RESET_TIMEOUT_US 100000	/* software reset */
+#define CLOCK_TIMEOUT_US 150000	/* internal clock stable */
+#define INHIBIT_TIMEOUT_US 1000000	/* CMD line free for the next command */
+#define INT_TIMEOUT_US 5000000	/* interrupt status bits and PIO buffer waits */
+#define OCR_TIMEOUT_LOOPS 1000	/* ACMD41 polls (about 1 ms each) before giving up */
 
 
 /*****************************************************************************/
 //#include <libkern/OSByteOrder.h>
 
+#include <kern/task.h>
+
 #include "VoodooSDHC.h"
 #include "SDHCI_Register_Map.h"
+#include "CQHCI_Register_Map.h"
+#include "VoodooSDHCUserClient.h"
 #include "SD_Commands.h"
 #include "sdhci.h"
 
@@ -58,21 +134,375 @@
 
 OSDefineMetaClassAndStructors ( VoodooSDHC, IOBlockStorageDevice );
 
+const VoodooSDHC::SDEngine_t VoodooSDHC::engines[kSDEngineCount] = {
+	{ "PIO", &VoodooSDHC::pio_access },
+	{ "SDMA", &VoodooSDHC::sdma_access },
+	{ "ADMA2-32", &VoodooSDHC::adma32_access },
+	{ "ADMA2-64", &VoodooSDHC::adma64_access }
+};
+
 /*****************************************************************************/
 /* Helper Functions */
+/*
+ * sdmaBoundaryBits:  SDMA Buffer Boundary field of the Block Size register
+ *		      for a boundary of 4K to 512K bytes.
+ *	UInt32 bytes:  Boundary, a power of 2
+ */
+static inline UInt16 sdmaBoundaryBits(UInt32 bytes) {
+	UInt16 bits = 0;
+
+	while ((4096U << bits) < bytes)
+		bits++;
+	return bits << 12;
+}
+
+/*
+ * pickBest:  Index of the fastest of several timings, preferring earlier
+ *	      entries that are within TUNE_TOLERANCE of it.
+ *	const UInt64 *t:  Elapsed times
+ *	unsigned n:  Number of timings
+ */
+static unsigned pickBest(const UInt64 *t, unsigned n) {
+	UInt64 best = t[0];
+	unsigned i;
+
+	for (i = 1; i < n; i++)
+		if (t[i] < best)
+			best = t[i];
+	for (i = 0; t[i] > best + best / TUNE_TOLERANCE; i++)
+		;
+	return i;
+}
+
+/*
+ * Controllers that need quirks, matched on PCI vendor and device ID (0xFFFF
+ * matches any device) and up to a PCI revision and SDHCI vendor version
+ * (0xFF matches any).  The Linux driver resets revision 0 JMicron hosts
+ * after every request; the Ricoh hosts this driver was written for do not
+ * need it.  Only the Ricoh IDs are in IOPCIMatch; the other entries take
+ * effect for hosts matched by a local Info.plist.
+ */
+static const struct {
+	UInt16		vendor;
+	UInt16		device;
+	UInt8		maxRevision;
+	UInt8		maxVendorVer;
+	UInt32		quirks;
+} hostQuirkTable[] = {
+	{ 0x1524, 0x0550, 0xFF, 0xFF, kSDQuirkBrokenDMA },		// ENE CB712
+	{ 0x1524, 0x0551, 0xFF, 0xFF, kSDQuirkBrokenDMA },		// ENE CB714
+	{ 0x197B, 0x2382, 0x00, 0xFF,					// JMicron JMB38x, rev 0
+	  kSDQuirkBrokenADMA | kSDQuirkResetPerCommand },
+	{ 0, 0, 0, 0, 0 }
+};
+
+/*
+ * Cards that need quirks, matched on CID manufacturer ID, OEM ID (0 matches
+ * any) and product name (NULL matches any).  The Toshiba eMMC parts get
+ * slower with CMD23, according to the Linux driver.
+ */
+static const struct {
+	UInt8		mid;
+	UInt16		oid;
+	const char	*pnm;
+	UInt32		quirks;
+} cardQuirkTable[] = {
+	{ 0x11, 0, "MMC08G", kSDQuirkBrokenCMD23 },		// Toshiba eMMC
+	{ 0x11, 0, "MMC16G", kSDQuirkBrokenCMD23 },
+	{ 0x11, 0, "MMC32G", kSDQuirkBrokenCMD23 },
+	{ 0, 0, NULL, 0 }
+};
+
+/*
+ * hostQuirkLookup:  Quirks of the first hostQuirkTable entry a controller
+ *		     matches, 0 if none does.
+ *	UInt16 vendor, device:  PCI IDs
+ *	UInt8 revision:  PCI revision
+ *	UInt8 vendorVer:  SDHCI vendor version
+ */
+static UInt32 hostQuirkLookup(UInt16 vendor, UInt16 device, UInt8 revision, UInt8 vendorVer) {
+	for (int i = 0; hostQuirkTable[i].vendor != 0; i++) {
+		if (hostQuirkTable[i].vendor == vendor &&
+		    (hostQuirkTable[i].device == 0xFFFF || hostQuirkTable[i].device == device) &&
+		    revision <= hostQuirkTable[i].maxRevision &&
+		    vendorVer <= hostQuirkTable[i].maxVendorVer)
+			return hostQuirkTable[i].quirks;
+	}
+	return 0;
+}
+
+/*
+ * cardQuirkLookup:  Quirks of the first cardQuirkTable entry a card
+ *		     matches, 0 if none does.
+ *	UInt8 mid:  CID manufacturer ID
+ *	UInt16 oid:  CID OEM ID
+ *	const char *pnm:  CID product name, pnmLen bytes, not terminated
+ *	size_t pnmLen:  Length of pnm
+ */
+static UInt32 cardQuirkLookup(UInt8 mid, UInt16 oid, const char *pnm, size_t pnmLen) {
+	for (int i = 0; cardQuirkTable[i].quirks != 0; i++) {
+		if (cardQuirkTable[i].mid == mid &&
+		    (cardQuirkTable[i].oid == 0 || cardQuirkTable[i].oid == oid) &&
+		    (cardQuirkTable[i].pnm == NULL ||
+		     strncmp(cardQuirkTable[i].pnm, pnm, pnmLen) == 0))
+			return cardQuirkTable[i].quirks;
+	}
+	return 0;
+}
+
+/*
+ * SD_COMPILE_CHECK:  Stop the build if cond is false.
+ */
+#define SD_COMPILE_CHECK(name, cond)	typedef char name[(cond) ? 1 : -1]
+
+/*
+ * Command register response bits for each response type, indexed by R0 to
+ * R7.  See SD Host Controller Spec Version 2.00 Page 30.
+ */
+static const UInt16 responseFlagTable[] = {
+	0,				// R0
+	BIT4|BIT3|BIT1,			// R1
+	BIT4|BIT3|BIT1|BIT0,		// R1b
+	BIT3|BIT0,			// R2
+	BIT1,				// R3
+	BIT1,				// R4
+	BIT4|BIT3|BIT1,			// R5
+	BIT4|BIT3|BIT1|BIT0,		// R5b
+	BIT4|BIT3|BIT1,			// R6
+	BIT4|BIT3|BIT1			// R7
+};
+SD_COMPILE_CHECK(responseFlagTableSize, sizeof(responseFlagTable) / sizeof(UInt16) == R7 + 1);
+
+/*
+ * SDCommandCheck:  Rejects, at compile time, a command descriptor with an
+ *		    index that does not fit in 6 bits, data flags on a
+ *		    command without data, Auto CMD12/CMD23 on a command
+ *		    that is not multi-block, a busy flag that disagrees with
+ *		    a fixed R1b/R5b response, or a data command whose fixed
+ *		    response is R0 or R2.  The division by zero stops the
+ *		    build.
+ */
+template <unsigned index, unsigned flags, unsigned response> struct SDCommandCheck {
+	enum {
+		ok = 1 / (index < 64 &&
+			  (! (flags & (SD_CMD_READ | SD_CMD_MULTI)) || (flags & SD_CMD_DATA)) &&
+			  (! (flags & (SD_CMD_ACMD12 | SD_CMD_ACMD23)) || (flags & SD_CMD_MULTI)) &&
+			  (response == SD_RSP_ANY || response <= R7) &&
+			  (response == SD_RSP_ANY ||
+			   ! (flags & SD_CMD_BUSY) == ! (response == R1b || response == R5b)) &&
+			  (response == SD_RSP_ANY || ! (flags & SD_CMD_DATA) ||
+			   (response != R0 && response != R2))),
+		value = flags + 0 * ok
+	};
+};
+
+#define SD_CMD(index, flags, response)	\
+		{ (UInt16)((index) << 8 | ((flags) & SD_CMD_DATA ? BIT5 : 0)), \
+		  (UInt8)SDCommandCheck<(index), (flags), (response)>::value, (UInt8)(response) }
+
+/*
+ * Descriptor for every command index, in order.  command is the Command
+ * register word without the response bits: the index and, for commands
+ * that always move data, the data present bit.  response is the response
+ * type the command always has, or SD_RSP_ANY where it depends on the card
+ * type or a preceding CMD55; SDCommand refuses a caller whose response
+ * disagrees.  Indexes with no fixed meaning are plain commands; callers
+ * pass data present and the response for them.
+ */
+static const struct {
+	UInt16		command;
+	UInt8		flags;
+	UInt8		response;
+} sdCommandTable[] = {
+	SD_CMD(SD_GO_IDLE_STATE, 0, R0),
+	SD_CMD(1, 0, R3),
+	SD_CMD(2, 0, R2),
+	SD_CMD(3, 0, SD_RSP_ANY),
+	SD_CMD(4, 0, R0),
+	SD_CMD(5, 0, SD_RSP_ANY),
+	SD_CMD(6, 0, SD_RSP_ANY),
+	SD_CMD(7, SD_CMD_BUSY, R1b),
+	SD_CMD(8, 0, SD_RSP_ANY),
+	SD_CMD(9, 0, R2),
+	SD_CMD(10, 0, R2),
+	SD_CMD(SD_READ_DAT_UNTIL_STOP, SD_CMD_DATA | SD_CMD_READ | SD_CMD_MULTI, SD_RSP_ANY),
+	SD_CMD(SD_STOP_TRANSMISSION, SD_CMD_BUSY, R1b),
+	SD_CMD(13, 0, R1),
+	SD_CMD(14, 0, SD_RSP_ANY),
+	SD_CMD(15, 0, R0),
+	SD_CMD(16, 0, R1),
+	SD_CMD(SD_READ_SINGLE_BLOCK, SD_CMD_DATA | SD_CMD_READ, R1),
+	SD_CMD(SD_READ_MULTIPLE_BLOCK, SD_CMD_DATA | SD_CMD_READ | SD_CMD_MULTI | SD_CMD_ACMD12 | SD_CMD_ACMD23, R1),
+	SD_CMD(19, 0, R1),
+	SD_CMD(SD_WRITE_DAT_UNTIL_STOP, SD_CMD_DATA | SD_CMD_MULTI, SD_RSP_ANY),
+	SD_CMD(SD_SEND_TUNING_BLOCK_HS200, SD_CMD_DATA | SD_CMD_READ, R1),
+	SD_CMD(22, 0, SD_RSP_ANY),
+	SD_CMD(23, 0, R1),
+	SD_CMD(SD_WRITE_BLOCK, SD_CMD_DATA, R1),
+	SD_CMD(SD_WRITE_MULTIPLE_BLOCK, SD_CMD_DATA | SD_CMD_MULTI | SD_CMD_ACMD12 | SD_CMD_ACMD23, R1),
+	SD_CMD(SD_PROGRAM_CID, SD_CMD_DATA, R1),
+	SD_CMD(SD_PROGRAM_CSD, SD_CMD_DATA, R1),
+	SD_CMD(SD_SET_WRITE_PROT, SD_CMD_BUSY, R1b),
+	SD_CMD(SD_CLR_WRITE_PROT, SD_CMD_BUSY, R1b),
+	SD_CMD(SD_SEND_WRITE_PROT, SD_CMD_DATA | SD_CMD_READ, R1),
+	SD_CMD(31, 0, SD_RSP_ANY),
+	SD_CMD(32, 0, R1),
+	SD_CMD(33, 0, R1),
+	SD_CMD(34, 0, SD_RSP_ANY),
+	SD_CMD(35, 0, SD_RSP_ANY),
+	SD_CMD(36, 0, SD_RSP_ANY),
+	SD_CMD(37, 0, SD_RSP_ANY),
+	SD_CMD(SD_ERASE, SD_CMD_BUSY, R1b),
+	SD_CMD(39, 0, SD_RSP_ANY),
+	SD_CMD(40, 0, SD_RSP_ANY),
+	SD_CMD(41, 0, SD_RSP_ANY),
+	SD_CMD(SD_LOCK_UNLOCK, SD_CMD_DATA, R1),
+	SD_CMD(SD_Q_MANAGEMENT, SD_CMD_BUSY, R1b),
+	SD_CMD(44, 0, R1),
+	SD_CMD(45, 0, R1),
+	SD_CMD(SD_Q_RD_TASK, SD_CMD_DATA | SD_CMD_READ | SD_CMD_MULTI, R1),
+	SD_CMD(SD_Q_WR_TASK, SD_CMD_DATA | SD_CMD_MULTI, R1),
+	SD_CMD(48, 0, SD_RSP_ANY),
+	SD_CMD(49, 0, SD_RSP_ANY),
+	SD_CMD(50, 0, SD_RSP_ANY),
+	SD_CMD(51, 0, SD_RSP_ANY),
+	SD_CMD(52, 0, SD_RSP_ANY),
+	SD_CMD(53, 0, SD_RSP_ANY),
+	SD_CMD(54, 0, SD_RSP_ANY),
+	SD_CMD(55, 0, R1),
+	SD_CMD(SD_GEN_CMD, SD_CMD_DATA, R1),
+	SD_CMD(57, 0, SD_RSP_ANY),
+	SD_CMD(58, 0, SD_RSP_ANY),
+	SD_CMD(59, 0, SD_RSP_ANY),
+	SD_CMD(60, 0, SD_RSP_ANY),
+	SD_CMD(61, 0, SD_RSP_ANY),
+	SD_CMD(62, 0, SD_RSP_ANY),
+	SD_CMD(63, 0, SD_RSP_ANY)
+};
+SD_COMPILE_CHECK(sdCommandTableSize, sizeof(sdCommandTable) / sizeof(sdCommandTable[0]) == 64);
+
+/*
+ * traceClock:  Nanoseconds since boot, for trace timestamps.
+ */
+static inline UInt64 traceClock(void) {
+	uint64_t now, ns;
+
+	clock_get_uptime(&now);
+	absolutetime_to_nanoseconds(now, &ns);
+	return ns;
+}
+
+/*
+ * copyTraceRing:  Copy the valid part of a trace ring, oldest record
+ *		   first, into a new OSData.  Returns NULL if out of memory.
+ *	const void *ring:  First record of the ring
+ *	UInt64 next:  Number of records ever written to the ring
+ *	UInt32 entries:  Ring size in records, a power of 2
+ *	UInt32 size:  Record size in bytes
+ */
+static OSData *copyTraceRing(const void *ring, UInt64 next, UInt32 entries, UInt32 size) {
+	UInt64 first = next > entries ? next - entries : 0;
+	OSData *data;
+
+	if ((data = OSData::withCapacity((UInt32)(next - first) * size)) == NULL)
+		return NULL;
+	for (; first < next; first++)
+		data->appendBytes((const UInt8 *)ring + (first % entries) * size, size);
+	return data;
+}
+
+/*
+ * The 128 port accesses of one block, written out in full so the data
+ * moves have no loop around them.
+ */
+#define PIO_RD(n)	buf[n] = *reg_addr
+#define PIO_RD4(n)	PIO_RD(n); PIO_RD(n + 1); PIO_RD(n + 2); PIO_RD(n + 3)
+#define PIO_RD16(n)	PIO_RD4(n); PIO_RD4(n + 4); PIO_RD4(n + 8); PIO_RD4(n + 12)
+#define PIO_RD64(n)	PIO_RD16(n); PIO_RD16(n + 16); PIO_RD16(n + 32); PIO_RD16(n + 48)
+#define PIO_WR(n)	*reg_addr = buf[n]
+#define PIO_WR4(n)	PIO_WR(n); PIO_WR(n + 1); PIO_WR(n + 2); PIO_WR(n + 3)
+#define PIO_WR16(n)	PIO_WR4(n); PIO_WR4(n + 4); PIO_WR4(n + 8); PIO_WR4(n + 12)
+#define PIO_WR64(n)	PIO_WR16(n); PIO_WR16(n + 16); PIO_WR16(n + 32); PIO_WR16(n + 48)
+
 /*
  * read_block_pio:  Read a single 512 byte  block of data with no error
  *		    checking from a PIO address to memory.
  *	volatile UInt32 *reg_addr:  Address of card's PIO register
- *	UInt8 *buf:  Buffer in which to place data - m
+ *	UInt32 *buf:  Buffer in which to place data
  */
 static inline void read_block_pio(volatile UInt32 *reg_addr, UInt32 *buf) {
-	UInt32 *bufp = buf;
+	PIO_RD64(0);
+	PIO_RD64(64);
+}
+
+/*
+ * write_block_pio:  Write a single 512 byte block of data with no error
+ *		     checking from memory to a PIO address.
+ *	volatile UInt32 *reg_addr:  Address of card's PIO register
+ *	const UInt32 *buf:  Data to write
+ */
+static inline void write_block_pio(volatile UInt32 *reg_addr, const UInt32 *buf) {
+	PIO_WR64(0);
+	PIO_WR64(64);
+}
+
+/*
+ * Bounce buffer copy, picked in init: copy_nt where the CPU has SSE2,
+ * plain bcopy otherwise.
+ */
+typedef void (*SDCopyFn)(void *dst, const void *src, IOByteCount len);
 
-	for (int i = 0; i < 512 / sizeof(UInt32); i++) {
-		*bufp++ =  *reg_addr;
+static void copy_plain(void *dst, const void *src, IOByteCount len) {
+	bcopy(src, dst, len);
+}
+
+#if defined(__i386__) || defined(__x86_64__)
+#define NT_STORE(p, v)	__asm__ volatile("movnti %1, %0" : "=m" (p) : "r" (v))
+
+/*
+ * copy_nt:  Copy with MOVNTI stores, which write around the caches.  Works
+ *	     on general purpose registers, so it needs no FPU state in the
+ *	     kernel.  The tail that does not fill a pass of 8 words goes
+ *	     through bcopy; SFENCE comes last so the whole copy is visible
+ *	     before the caller starts DMA.
+ *	void *dst:  Destination
+ *	const void *src:  Source
+ *	IOByteCount len:  Byte count
+ */
+static void copy_nt(void *dst, const void *src, IOByteCount len) {
+	unsigned long *d = (unsigned long *)dst;
+	const unsigned long *s = (const unsigned long *)src;
+	IOByteCount n = len / (8 * sizeof(unsigned long));
+
+	for (; n; n--, d += 8, s += 8) {
+		unsigned long w0 = s[0], w1 = s[1], w2 = s[2], w3 = s[3];
+		unsigned long w4 = s[4], w5 = s[5], w6 = s[6], w7 = s[7];
+
+		NT_STORE(d[0], w0);
+		NT_STORE(d[1], w1);
+		NT_STORE(d[2], w2);
+		NT_STORE(d[3], w3);
+		NT_STORE(d[4], w4);
+		NT_STORE(d[5], w5);
+		NT_STORE(d[6], w6);
+		NT_STORE(d[7], w7);
 	}
+	bcopy(s, d, len % (8 * sizeof(unsigned long)));
+	__asm__ volatile("sfence" : : : "memory");
+}
+
+/*
+ * cpu_has_sse2:  CPUID leaf 1, EDX bit 26.
+ */
+static bool cpu_has_sse2(void) {
+	UInt32 a = 1, b, c = 0, d;
+
+	__asm__ volatile("cpuid" : "+a" (a), "=b" (b), "+c" (c), "=d" (d));
+	return (d & (1 << 26)) != 0;
 }
+#endif
+
+static SDCopyFn copy_bounce = copy_plain;
 
 /*****************************************************************************/
 /* Main Driver Code */
@@ -90,6 +520,12 @@ bool VoodooSDHC::init ( OSDictionary * properties )
 	{
 		return false;
 	}	
+
+#if USE_NT_COPY && (defined(__i386__) || defined(__x86_64__))
+	if (cpu_has_sse2())
+		copy_bounce = copy_nt;
+#endif
+	setProperty(kVoodooSDHCBounceCopyKey, copy_bounce == copy_plain ? "bcopy" : "movnti");
 	
 #ifdef USE_SDMA
 	if ((workLoop = IOWorkLoop::workLoop()) == NULL)
@@ -123,6 +559,25 @@ bool VoodooSDHC::start ( IOService * provider )
 #endif
 	super::start ( provider );
 	lock.init();
+	reqQueueLock = IOLockAlloc();
+	reqHead = reqTail = NULL;
+	ioTrace = NULL;
+	ioTraceNext = 0;
+	ioTraceOn = false;
+	for (int i = 0; i < 6; i++) {
+		cmdTrace[i] = NULL;
+		cmdTraceNext[i] = 0;
+		lastCommand[i] = 0;
+	}
+	bzero(stats, sizeof(stats));
+	slotCount = 0;
+	statsPublished = -1;
+	bzero(cardCache, sizeof(cardCache));
+	cardCacheEntry = NULL;
+	cardCacheNext = 0;
+	auSize = 0;
+	tunePending = false;
+	tuneDefaults();
 #ifdef USE_SDMA
 	sdmaCond = IOLockAlloc();
 	mediaStateLock = IOLockAlloc();
@@ -146,6 +601,17 @@ bool VoodooSDHC::start ( IOService * provider )
 	physSdmaBuff = sdmaBuffDesc->getPhysicalAddress();
 	virtSdmaBuff = (char*)sdmaBuffDesc->getBytesNoCopy() + SDMA_BUFFER_SIZE - physSdmaBuff % SDMA_BUFFER_SIZE;
 	physSdmaBuff += SDMA_BUFFER_SIZE - physSdmaBuff % SDMA_BUFFER_SIZE;
+	taskBuffDesc = NULL;	// allocated when a queueing engine is first used
+	admaDescDesc = IOBufferMemoryDescriptor::withCapacity(PAGE_SIZE, kIODirectionInOut, true);
+	if (admaDescDesc != NULL) {
+		physAdmaDesc = admaDescDesc->getPhysicalAddress();
+		virtAdmaDesc = (UInt8 *)admaDescDesc->getBytesNoCopy();
+	}
+	// Mapped through the IOMMU where there is one, bounced where the engine cannot reach
+	admaCmd[0] = IODMACommand::withSpecification(IODMACommand::OutputHost32, 32,
+		ADMA2_SEG_MAX, IODMACommand::kMapped, 0, 4);
+	admaCmd[1] = IODMACommand::withSpecification(IODMACommand::OutputHost64, 64,
+		ADMA2_SEG_MAX, IODMACommand::kMapped, 0, 4);
 #endif
 	
 	cardPresence = kCardNotPresent;
@@ -201,6 +667,7 @@ bool VoodooSDHC::setup(IOService * provider)
 	IODeviceMemory *	pMem;
 	UInt8 slot = 0;
 
+	slotCount = MIN(provider->getDeviceMemoryCount(), 6);
 	for (slot=0; slot<provider->getDeviceMemoryCount(); slot++) {
 		pMem = provider->getDeviceMemoryWithIndex(0);
 		this->PCIRegMap = provider->mapDeviceMemoryWithIndex(0);
@@ -211,16 +678,28 @@ bool VoodooSDHC::setup(IOService * provider)
 
 		this->PCIRegP[slot] =
 				(SDHCIRegMap_t *)PCIRegMap->getVirtualAddress();
+		hostQuirksInit(provider, slot);
+		if (USE_CMD_TRACE && cmdTrace[slot] == NULL) {
+			cmdTrace[slot] = (SDCmdTraceRecord_t *)
+				IOMalloc(CMD_TRACE_ENTRIES * sizeof(SDCmdTraceRecord_t));
+			if (cmdTrace[slot] != NULL)
+				bzero(cmdTrace[slot], CMD_TRACE_ENTRIES * sizeof(SDCmdTraceRecord_t));
+		}
+		cqhciProbe(slot);
 #ifdef __DEBUG__
 		IOLog("VoodooSDHCI: controller slot == %d\n", slot);
 		IOLog("VoodooSDHCI: unit memory (pMem) == %d\n", pMem->getLength());
 #endif
-		this->PCIRegP[slot]->PowerControl = 0;
+		shadowLoad(slot);
+		setPowerControl(slot, 0);
 		Reset(slot, FULL_RESET);
 		IODelay(10000);
 		if (cardPresence == kCardIsPresent && isCardPresent(slot)) {
 			SDCIDReg_t oldCID = SDCIDReg[slot];
+			UInt64 start = traceClock();
 			cardInit(slot);
+			statTime(slot, kSDStatReinit, start);
+			OSIncrementAtomic(&stats[slot].reinits);
 			if (memcmp(&oldCID, SDCIDReg + slot, sizeof(oldCID)) != 0) {
 				IOLog("VoodooSDHCI: oops! we found a different card :: remount?\n");
 				cardPresence = kCardRemount;
@@ -256,6 +735,20 @@ void VoodooSDHC::stop(IOService *provider)
 		interruptSrc = NULL;
 	}
 	sdmaBuffDesc->release();
+	if (admaDescDesc != NULL) {
+		admaDescDesc->release();
+		admaDescDesc = NULL;
+	}
+	for (int i = 0; i < 2; i++) {
+		if (admaCmd[i] != NULL) {
+			admaCmd[i]->release();
+			admaCmd[i] = NULL;
+		}
+	}
+	if (taskBuffDesc != NULL) {
+		taskBuffDesc->release();
+		taskBuffDesc = NULL;
+	}
 #endif
 	
 	PMstop();
@@ -263,7 +756,19 @@ void VoodooSDHC::stop(IOService *provider)
 	IOLockFree(sdmaCond);
 	IOLockFree(mediaStateLock);
 #endif
+	IOLockFree(reqQueueLock);
 	lock.free();
+	ioTraceOn = false;
+	if (ioTrace != NULL) {
+		IOFree(ioTrace, IO_TRACE_ENTRIES * sizeof(SDIOTraceRecord_t));
+		ioTrace = NULL;
+	}
+	for (int i = 0; i < 6; i++) {
+		if (cmdTrace[i] != NULL) {
+			IOFree(cmdTrace[i], CMD_TRACE_ENTRIES * sizeof(SDCmdTraceRecord_t));
+			cmdTrace[i] = NULL;
+		}
+	}
 	
 	// Call our superclass
 	super::stop ( provider );
@@ -323,11 +828,24 @@ void VoodooSDHC::dumpRegs(UInt8 slot) {
  */
 bool VoodooSDHC::cardInit(UInt8 slot)
 {
+	quirks = hostQuirks;
 	isHighCapacity = false;
+	isMMC = false;
+	cmd23 = false;
+	cmdqDepth = 0;
+	// A queue engine left running for the last card would take its commands
+	if (cqeDepth != 0)
+		this->CQHCIRegP->CQCFG = 0;
+	cqeDepth = 0;
 	calcClock(slot, 400000);
 	powerSD(slot);
+	/* A full reset clears these; status bits are needed by waitIntStatus */
+	this->PCIRegP[slot]->NormalIntStatusEn = -1;
+	this->PCIRegP[slot]->ErrorIntStatusEn = -1;
+	hostV4Init(slot);
 	SDCommand(slot, SD_GO_IDLE_STATE, SDCR0, 0);
 	IODelay(30000);
+	this->PCIRegP[slot]->ErrorIntStatus = 0xf3ff;
 	SDCommand(slot, SD_SEND_IF_COND, SDCR8, 0x000001AA);
 	for (int i = 0; i < 100; i++) {
 		IODelay(10000);
@@ -336,12 +854,32 @@ bool VoodooSDHC::cardInit(UInt8 slot)
 		}
 	}
 	
-	if(this->PCIRegP[slot]->PresentState & ComInhibitCMD) {
+	if((this->PCIRegP[slot]->PresentState & ComInhibitCMD) ||
+	   (this->PCIRegP[slot]->ErrorIntStatus & CmdTimeoutError)) {
 		IOLog("VoodooSDHCI: no response from CMD_8 -- ComInhibitCMD\n");
-		Reset(slot, CMD_RESET);
-		Reset(slot, DAT_RESET);
+		if (! Reset(slot, CMD_RESET) || ! Reset(slot, DAT_RESET))
+			return false;
 		SDCommand(slot, SD_GO_IDLE_STATE, SDCR0, 0);
+		IODelay(1000);
+		// MMC cards do not know CMD_55 either
+		this->PCIRegP[slot]->ErrorIntStatus = 0xf3ff;
+		SDCommand(slot, SD_APP_CMD, SDCR55, 0);
+		IODelay(1000);
+		if (this->PCIRegP[slot]->ErrorIntStatus & CmdTimeoutError) {
+			IOLog("VoodooSDHCI: no response from CMD_55 -- trying MMC\n");
+			if (! Reset(slot, CMD_RESET))
+				return false;
+			SDCommand(slot, SD_GO_IDLE_STATE, SDCR0, 0);
+			IODelay(1000);
+			return mmcInit(slot);
+		}
+		int polls = 0;
 		do {
+			if (polls++ == OCR_TIMEOUT_LOOPS) {
+				IOLog("VoodooSDHCI: card never left the busy state\n");
+				OSIncrementAtomic(&stats[slot].stalls);
+				return false;
+			}
 			SDCommand(slot, SD_APP_CMD, SDCR55, 0);
 			SDCommand(slot, SD_APP_OP_COND, SDACR41, 0x00FF8000);
 			IODelay(1000);
@@ -383,6 +921,8 @@ bool VoodooSDHC::cardInit(UInt8 slot)
 	SDCommand(slot, SD_ALL_SEND_CID, SDCR2, 0);
 	IODelay(1000);
 	parseCID(slot);
+	cardQuirksInit(slot);
+	cardCacheFind(slot);
 	SDCommand(slot, SD_SET_RELATIVE_ADDR, SDCR3, 0);
 	IODelay(1000);
 	calcClock(slot, 25000000);
@@ -391,8 +931,10 @@ bool VoodooSDHC::cardInit(UInt8 slot)
 	IOLog("VoodooSDHCI: RCA == 0x%08X\n", this->RCA);
 #endif//me
 	SDCommand(slot, SD_SEND_CSD, SDCR9, this->RCA << 16);
-	IODelay(2000000);
+	// A card brought up before does not need the long settling time
+	IODelay(cardCacheEntry != NULL ? 10000 : 2000000);
 	parseCSD(slot);
+	cardCacheCheck(slot);
 #ifdef __DEBUG__
 	IOLog("VoodooSDHCI: PCIRegP response order (3,2,1,0) :: 0x%08X 0x%08X 0x%08X 0x%08X\n", 
 			this->PCIRegP[slot]->Response[3],
@@ -419,7 +961,7 @@ bool VoodooSDHC::cardInit(UInt8 slot)
 			this->PCIRegP[slot]->Response[0]);
 #endif//me
 	if (!(this->PCIRegP[slot]->Response[0] & 0x480000)) { /* check ERROR and ILLEGAL COMMAND */
-		this->PCIRegP[slot]->HostControl |= SDHCI_CTRL_4BITBUS;
+		setHostControl(slot, 0, SDHCI_CTRL_4BITBUS);
 #ifdef __DEBUG__
 		IOLog("VoodooSDHCI: properly switched to 4 bit mode\n");
 #endif//me
@@ -427,31 +969,37 @@ bool VoodooSDHC::cardInit(UInt8 slot)
 #ifdef __DEBUG__
 		IOLog("VoodooSDHCI: unable to switch to 4 bit mode -- calling Reset(slot, {CMD,DAT}_RESET)\n");
 #endif//me
-		Reset(slot, CMD_RESET);
-		Reset(slot, DAT_RESET);
+		if (! Reset(slot, CMD_RESET) || ! Reset(slot, DAT_RESET))
+			return false;
 	}
 	IODelay(30000);
 #endif /* WIDE_BUS_MODE */
-#ifdef HIGHSPEED_CARD_MODE
-	/* XXX - Need to check whether the card is capable before enabiling this */
+	if (quirks & kSDQuirkHighSpeed) {
+		/* XXX - Need to check whether the card is capable before enabiling this */
 #ifdef __DEBUG__
-	IOLog("VoodooSDHCI: HIGHSPEED_CARD_MODE \n");
+		IOLog("VoodooSDHCI: HIGHSPEED_CARD_MODE \n");
 #endif //me
-	SDCommand(slot, SD_SWITCH, SDCR6, 0x01fffff1);
-	IODelay(10000);
-	calcClock(slot, 50000000);
-	this->PCIRegP[slot]->HostControl |= SDHCI_CTRL_HISPD;
-#endif /* HIGHSPEED_CARD_MODE */
+		SDCommand(slot, SD_SWITCH, SDCR6, 0x01fffff1);
+		IODelay(10000);
+		calcClock(slot, 50000000);
+		setHostControl(slot, 0, SDHCI_CTRL_HISPD);
+	}
 
 	this->PCIRegP[slot]->BlockSize = 512;
 	this->PCIRegP[slot]->BlockCount = 1;
 #ifdef __DEBUG__
 	IOLog("VoodooSDHCI: Card Init:  Host Control = 0x%x\n", this->PCIRegP[slot]->HostControl);
 #endif
-	this->PCIRegP[slot]->HostControl |= 0x1;
+	LEDControl(slot, true);
 #ifdef __DEBUG__
 	IOLog("VoodooSDHCI: Card Init:  Host Control = 0x%x\n", this->PCIRegP[slot]->HostControl);
 #endif
+	readSCR(slot);
+	// Cards known to have no command queue are not asked again
+	if (USE_CMDQ && USE_SDMA && ! (quirks & (kSDQuirkBrokenDMA | kSDQuirkBrokenMultiBlock)) &&
+	    (cardCacheEntry == NULL || cardCacheEntry->cmdqDepth != 0))
+		cmdqInit(slot);
+	cardCacheStore(slot);
 	return true;
 }
 
@@ -502,10 +1050,79 @@ IOReturn VoodooSDHC::setPowerState ( unsigned long state, IOService * provider )
  *	bool state:  True for on, false for off
  */
 void VoodooSDHC::LEDControl(UInt8 slot, bool state) {
-	if (state) {
-		this->PCIRegP[slot]->HostControl |= LedControl;
-	} else {
-		this->PCIRegP[slot]->HostControl &= ~LedControl;
+	setHostControl(slot, LedControl, state ? LedControl : 0);
+}
+
+/*
+ * shadowLoad:  Refill the slot's control register shadow from the host.
+ *		Needed after anything that changes those registers behind
+ *		the driver's back: a full reset, tuning, or a mode switch
+ *		the host refused.  Also caches the host's spec version.
+ *	UInt8 slot:  Host controller/slot number
+ */
+void VoodooSDHC::shadowLoad(UInt8 slot) {
+	shadow[slot].hostControl = this->PCIRegP[slot]->HostControl;
+	shadow[slot].powerControl = this->PCIRegP[slot]->PowerControl;
+	shadow[slot].clockControl = this->PCIRegP[slot]->ClockControl & ~(BIT1);
+	shadow[slot].hostControl2 = this->PCIRegP[slot]->HostControl2;
+	hostSpec[slot] = this->PCIRegP[slot]->HostControllerVer & SDHCI_SPEC_VER_MASK;
+}
+
+/*
+ * setHostControl:  Change bits in Host Control, writing the register only
+ *		    if its value changes.
+ *	UInt8 slot:  Host controller/slot number
+ *	UInt8 clear:  Bits to clear
+ *	UInt8 set:  Bits to set, after clearing
+ */
+void VoodooSDHC::setHostControl(UInt8 slot, UInt8 clear, UInt8 set) {
+	UInt8 value = (shadow[slot].hostControl & ~clear) | set;
+
+	if (value != shadow[slot].hostControl) {
+		shadow[slot].hostControl = value;
+		this->PCIRegP[slot]->HostControl = value;
+	}
+}
+
+/*
+ * setHostControl2:  Change bits in Host Control 2, writing the register
+ *		     only if its value changes.
+ *	UInt8 slot:  Host controller/slot number
+ *	UInt16 clear:  Bits to clear
+ *	UInt16 set:  Bits to set, after clearing
+ */
+void VoodooSDHC::setHostControl2(UInt8 slot, UInt16 clear, UInt16 set) {
+	UInt16 value = (shadow[slot].hostControl2 & ~clear) | set;
+
+	if (value != shadow[slot].hostControl2) {
+		shadow[slot].hostControl2 = value;
+		this->PCIRegP[slot]->HostControl2 = value;
+	}
+}
+
+/*
+ * setPowerControl:  Write Power Control if the value changes.
+ *	UInt8 slot:  Host controller/slot number
+ *	UInt8 value:  New register value
+ */
+void VoodooSDHC::setPowerControl(UInt8 slot, UInt8 value) {
+	if (value != shadow[slot].powerControl) {
+		shadow[slot].powerControl = value;
+		this->PCIRegP[slot]->PowerControl = value;
+	}
+}
+
+/*
+ * setClockControl:  Write Clock Control if the value changes.  The
+ *		     internal clock stable bit is the host's and is not kept.
+ *	UInt8 slot:  Host controller/slot number
+ *	UInt16 value:  New register value
+ */
+void VoodooSDHC::setClockControl(UInt8 slot, UInt16 value) {
+	value &= ~(BIT1);
+	if (value != shadow[slot].clockControl) {
+		shadow[slot].clockControl = value;
+		this->PCIRegP[slot]->ClockControl = value;
 	}
 }
 
@@ -514,9 +1131,12 @@ void VoodooSDHC::LEDControl(UInt8 slot, bool state) {
  *		   standard.
  *	UInt8 slot:  Which host controller to reset
  *	UInt8 type:  Reset type (Command, Data, or Full)
+ *	Returns false if the controller did not finish the reset in time.
  */
-void VoodooSDHC::Reset(UInt8 slot, UInt8 type)
+bool VoodooSDHC::Reset(UInt8 slot, UInt8 type)
 {
+	bool ok;
+
 	switch(type) {
 		case CMD_RESET:
 			this->PCIRegP[slot]->SoftwareReset = CMD_RESET;
@@ -528,948 +1148,3600 @@ void VoodooSDHC::Reset(UInt8 slot, UInt8 type)
 			this->PCIRegP[slot]->SoftwareReset = FULL_RESET;
 			break;
 	}
-	while(this->PCIRegP[slot]->SoftwareReset);
+	ok = waitReg<UInt8>(slot, &this->PCIRegP[slot]->SoftwareReset, 0xFF, false,
+				RESET_TIMEOUT_US, "software reset");
+	// A full reset puts the control registers back to their defaults
+	if (type != CMD_RESET && type != DAT_RESET)
+		shadowLoad(slot);
+	return ok;
+}
+
+/*
+ * waitReg:  Wait for a host register to change, either until any of the
+ *	     mask bits is set or until all of them are clear.  The first
+ *	     WAIT_SPINS reads go back to back; after that the delay between
+ *	     reads doubles up to WAIT_BACKOFF_MAX_US.  Time spent backing off
+ *	     goes into the RegWaitLatency histogram and a wait that reaches
+ *	     its deadline is counted in Stalls.  Returns false on a stall.
+ *	UInt8 slot:  Slot whose statistics the wait counts in
+ *	const volatile T *reg:  Register to poll
+ *	T mask:  Bits to look at
+ *	bool set:  Wait for a bit to be set rather than for all to clear
+ *	UInt32 timeoutUS:  Deadline in microseconds
+ *	const char *what:  Name for the stall message, NULL to stay quiet
+ */
+template <typename T>
+bool VoodooSDHC::waitReg(UInt8 slot, const volatile T *reg, T mask, bool set,
+			 UInt32 timeoutUS, const char *what) {
+	UInt64 start, limit = (UInt64)timeoutUS * 1000;
+	UInt32 delay = 1;
+
+	for (int i = 0; i < WAIT_SPINS; i++)
+		if (((*reg & mask) != 0) == set)
+			return true;
+	start = traceClock();
+	do {
+		::IODelay(delay);
+		if (((*reg & mask) != 0) == set) {
+			statTime(slot, kSDStatRegWait, start);
+			return true;
+		}
+		if (delay < WAIT_BACKOFF_MAX_US)
+			delay <<= 1;
+	} while (traceClock() - start < limit);
+	OSIncrementAtomic(&stats[slot].stalls);
+	if (what != NULL)
+		IOLog("VoodooSDHCI: %s timed out after %d ms: register 0x%x\n",
+			what, (int)(timeoutUS / 1000), (UInt32)*reg);
+	return false;
+}
+
+/*
+ * commandFlags:  SD_CMD_* flags of a command for the card in use.  On SD
+ *		  cards CMD11 is VOLTAGE_SWITCH and CMD20 SPEED_CLASS_CONTROL,
+ *		  neither of which moves data, rather than the MMC stream
+ *		  commands the table describes.
+ *	UInt8 command:  Command index
+ */
+UInt8 VoodooSDHC::commandFlags(UInt8 command) {
+	if (! isMMC && command == SD_VOLTAGE_SWITCH)
+		return 0;
+	if (! isMMC && command == SD_SPEED_CLASS_CONTROL)
+		return SD_CMD_BUSY;
+	return sdCommandTable[command & 63].flags;
 }
 
 /*
  * SDCommand:  Send a single command to the SDHCI Host controller.  Return true on
- *			   success, false on failure.  Will spin wait indefinitely if device is
- *			   busy.
+ *			   success, false on failure.  Fails without sending anything if
+ *			   the CMD line stays busy for INHIBIT_TIMEOUT_US, or if
+ *			   response is not the one sdCommandTable fixes for command.
  *		UInt8 slot:  Which slot the card to send to is in
  *		UInt8 command:  SDHC command as defined in SDHC Physical Interface
  *		UInt16 response:  Response type to expect for command passed in
  *		UInt32 arg:  Command argument as defined in SDHC Physical Interface
+ *		bool data:  Command transfers data on the DAT lines
  */
 bool VoodooSDHC::SDCommand(UInt8 slot, UInt8 command, UInt16 response,
-								UInt32 arg) {
-	if (command != 0) {
-		while(this->PCIRegP[slot]->PresentState & ComInhibitCMD);
+								UInt32 arg, bool data) {
+	UInt16 word = sdCommandTable[command & 63].command;
+	UInt8 fixed = sdCommandTable[command & 63].response;
+
+	if (fixed != SD_RSP_ANY && response != fixed) {
+		IOLog("VoodooSDHCI: command %d sent with response type %d, not %d\n",
+			command, response, fixed);
+		return false;
 	}
 
+	// SD CMD11 and CMD20 are not the MMC stream commands the table describes
+	if (! (commandFlags(command) & SD_CMD_DATA))
+		word &= ~BIT5;
+	if (command != 0 &&
+	    ! waitReg<UInt32>(slot, &this->PCIRegP[slot]->PresentState, ComInhibitCMD, false,
+				INHIBIT_TIMEOUT_US, "command inhibit"))
+		return false;
+
 	//if(command 1= COMMANDS?)
 	//{
 		//Wait for DAT to free up
 		//while(this->PCIRegP[slot]->PresentState & ComInhibitDAT);
 	//}
 	
-	switch(response) { //See SD Host Controller Spec Version 2.00 Page 30
-		case R0: 
-			response = 0;
-			break;
-		case R1: 
-			response = BIT4|BIT3|BIT1;
-			break;
-		case R1b: 
-			response = BIT4|BIT3|BIT1|BIT0;
-			break;
-		case R2: 
-			response = BIT3|BIT0;
-			break;
-		case R3: 
-			response = BIT1;
-			break;
-		case R4: 
-			response = BIT1;
-			break;
-		case R5: 
-			response = BIT4|BIT3|BIT1;
-			break;
-		case R5b: 
-			response = BIT4|BIT3|BIT1|BIT0;
-			break;
-		case R6: 
-			response = BIT4|BIT3|BIT1;
-			break;
-		case R7: 
-			response = BIT4|BIT3|BIT1;
-			break;
-	}
 	this->PCIRegP[slot]->Argument = arg;
-
-	if (command == 17 || command == 24)
-		response |= BIT5;
-
-	if (command == SD_READ_MULTIPLE_BLOCK) {
-		response |= BIT5;
-		this->PCIRegP[0]->TransferMode =
-			SDHCI_TRNS_READ | SDHCI_TRNS_MULTI |
-			SDHCI_TRNS_BLK_CNT_EN | SDHCI_TRNS_ACMD12
-#ifdef USE_SDMA
-			| SDHCI_TRNS_DMA
-#endif
-		;
-	}
-
-	if (command == SD_WRITE_MULTIPLE_BLOCK) {
-		response |= BIT5;
-		this->PCIRegP[0]->TransferMode = SDHCI_TRNS_MULTI |
-			SDHCI_TRNS_BLK_CNT_EN | SDHCI_TRNS_ACMD12
-#ifdef USE_SDMA
-			| SDHCI_TRNS_DMA
+	// The transfer engine has set up Transfer Mode for data commands
+	this->PCIRegP[slot]->Command = word | responseFlagTable[response] | (data ? BIT5 : 0);
+	lastCommand[slot] = command;
+#if USE_CMD_TRACE
+	traceCmd(slot, kSDTraceCommand, command, arg, 0, 0, 0);
 #endif
-		;
-	}
-
-	this->PCIRegP[slot]->Command = (command << 8) | response;
 
 //	IOLog("Command: %d", (command << 8) | response);
 	return true;
 }
 
 /*
- * calcClock:  Calculate card clock rate.  See SDHCI Host Controller spec
- *	       for details on calculation.  Must be called after cardInit.
+ * stopTransmission:  End a multi-block transfer with CMD12, for hosts whose
+ *		      Auto CMD12 cannot be trusted.  Returns true if the card
+ *		      has left the data state.
+ *		UInt8 slot:  Which slot the card is in
+ */
+bool VoodooSDHC::stopTransmission(UInt8 slot) {
+	this->PCIRegP[slot]->NormalIntStatus = CmdComplete | XferComplete;
+	this->PCIRegP[slot]->ErrorIntStatus = 0xf3ff;
+	SDCommand(slot, SD_STOP_TRANSMISSION, R1b, 0);
+	// The end of the R1b busy period shows up as transfer complete
+	if (! waitIntStatus(slot, CmdComplete) || ! waitIntStatus(slot, XferComplete)) {
+		IOLog("VoodooSDHCI: CMD12 failed: Status: 0x%x, Error: 0x%x\n",
+			PCIRegP[slot]->NormalIntStatus, PCIRegP[slot]->ErrorIntStatus);
+		Reset(slot, CMD_RESET);
+		Reset(slot, DAT_RESET);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * hostQuirksInit:  Look the controller up in the quirks table by its PCI
+ *		    ID and version.  HIGHSPEED_CARD_MODE adds
+ *		    kSDQuirkHighSpeed for every controller.
+ *	IOService *provider:  Our PCI device
  *	UInt8 slot:  Host controller/slot number
- *	UInt32 clockspeed:  Maximum desired clock speed
  */
-bool VoodooSDHC::calcClock(UInt8 slot, UInt32 clockspeed) {
-	UInt32 baseClock;
-	UInt32 div;
+void VoodooSDHC::hostQuirksInit(IOService *provider, UInt8 slot) {
+	IOPCIDevice *pci = OSDynamicCast(IOPCIDevice, provider);
+	UInt16 vendor, device;
+	UInt8 revision, vendorVer;
 
-	this->PCIRegP[slot]->ClockControl = 0;
-	this->PCIRegP[slot]->ClockControl = 0;
-	this->PCIRegP[slot]->ClockControl |= BIT0;
-	while(!this->PCIRegP[slot]->ClockControl & BIT1);
-	baseClock = ((this->PCIRegP[slot]->Capabilities[0] & 0x3F00) >> 8);
-	baseClock *= 1000000;
+	hostQuirks = 0;
+#ifdef HIGHSPEED_CARD_MODE
+	hostQuirks |= kSDQuirkHighSpeed;
+#endif
+	if (pci == NULL)
+		return;
+	vendor = pci->configRead16(kIOPCIConfigVendorID);
+	device = pci->configRead16(kIOPCIConfigDeviceID);
+	revision = pci->configRead8(kIOPCIConfigRevisionID);
+	vendorVer = this->PCIRegP[slot]->HostControllerVer >> 8;
+	hostQuirks |= hostQuirkLookup(vendor, device, revision, vendorVer);
+	quirks = hostQuirks;
+	engine = bestEngine();
+	if (hostQuirks != 0)
+		IOLog("VoodooSDHCI: controller %04x:%04x rev %d, quirks 0x%x\n",
+			vendor, device, revision, (unsigned)hostQuirks);
+}
 
-#ifdef __DEBUG__
-	IOLog("VoodooSDHCI: BaseClock :: %dMHz\n", baseClock/1000000);
-#endif //me
+/*
+ * cardQuirksInit:  Add the card's quirks, looked up by the CID just read,
+ *		    to the controller's, and publish the result in the
+ *		    Quirks property.
+ *	UInt8 slot:  Which slot the card is in
+ */
+void VoodooSDHC::cardQuirksInit(UInt8 slot) {
+	const SDCIDReg_t *cid = &SDCIDReg[slot];
 
-	for(div=1;(baseClock / div) > clockspeed;div <<= 1);
+	quirks = hostQuirks | cardQuirkLookup(cid->MID, cid->OID, cid->PNM, sizeof(cid->PNM));
+	setProperty(kVoodooSDHCQuirksKey, quirks, 32);
+	engine = bestEngine();
+	setProperty(kVoodooSDHCEngineKey, engines[engine].name);
+}
 
-#ifdef __DEBUG__
-	IOLog("VoodooSDHCI: SD Clock :: %dKHz\n", (baseClock/div)/1000);
-#endif //me
+/*
+ * bestEngine:  The fastest transfer engine the controller, its quirks and
+ *		the build allow.  64 bit ADMA2 is only used in the version 3
+ *		register layout, where its descriptors are 96 bits.
+ */
+UInt8 VoodooSDHC::bestEngine(void) {
+	UInt32 caps = this->PCIRegP[0]->Capabilities[0];
+
+	if (! USE_SDMA || (quirks & (kSDQuirkBrokenDMA | kSDQuirkBrokenMultiBlock)))
+		return kSDEnginePIO;
+	if (USE_ADMA2 && admaDescDesc != NULL && admaCmd[0] != NULL &&
+	    (caps & SDHCI_CAN_DO_ADMA2) && ! (quirks & kSDQuirkBrokenADMA)) {
+		if (! hostV4 && (caps & SDHCI_CAN_64BIT) && admaCmd[1] != NULL)
+			return kSDEngineADMA64;
+		return kSDEngineADMA32;
+	}
+	return kSDEngineSDMA;
+}
 
-	div = (div<<7) & 0xFF000;
-	this->PCIRegP[slot]->ClockControl |= div;
-	this->PCIRegP[slot]->ClockControl |= BIT2;
-	return true;
+/*
+ * multiBlockMode:  Transfer Mode for a CMD18/CMD25 transfer, without the
+ *		    bits that end it; see transferEnd.
+ *	bool read:  true if the card sends data
+ *	bool dma:  true if the data moves by DMA
+ */
+UInt16 VoodooSDHC::multiBlockMode(bool read, bool dma) {
+	return (read ? SDHCI_TRNS_READ : 0) | SDHCI_TRNS_MULTI | SDHCI_TRNS_BLK_CNT_EN |
+		(dma ? SDHCI_TRNS_DMA : 0);
 }
 
 /*
- * powerSD:  Turn on power to SD Card.  Must pay attention to voltage
- *	     level supported.  This is determined from the Host capability
- *	     register.
- *	UInt8 slot:  Slot the card is in.
+ * transferEnd:  Decide how the next CMD18/CMD25 ends and return the Transfer
+ *		 Mode bits for it.  Cards that take CMD23 are told the block
+ *		 count up front, by Auto CMD23 on version 3 hosts when Argument
+ *		 2 is free, or else by a CMD23 sent here, and leave the data
+ *		 state by themselves.  Other transfers are open-ended and end
+ *		 with Auto CMD12, or with a CMD12 from the caller when
+ *		 stopNeeded is set.  Must be called before the Transfer Mode
+ *		 register is written.
+ *	UInt32 nblks:  Block count of the transfer
+ *	bool arg2:  The Argument 2 register is not holding an SDMA address
  */
-bool VoodooSDHC::powerSD(UInt8 slot) {
-	this->PCIRegP[slot]->PowerControl = 0;
+UInt16 VoodooSDHC::transferEnd(UInt32 nblks, bool arg2) {
+	stopNeeded = false;
+	if (cmd23 && nblks <= 0xFFFF && ! (quirks & kSDQuirkBrokenCMD23)) {
+		if (arg2 && hostSpec[0] >= SDHCI_SPEC_300) {
+			this->PCIRegP[0]->Argument2 = nblks;
+			return SDHCI_TRNS_AUTO_CMD23;
+		}
+		this->PCIRegP[0]->NormalIntStatus = CmdComplete;
+		this->PCIRegP[0]->ErrorIntStatus = 0xf3ff;
+		SDCommand(0, SD_SET_BLOCK_COUNT, R1, nblks);
+		if (waitIntStatus(0, CmdComplete) &&
+		    ! (this->PCIRegP[0]->Response[0] & (R1_ILLEGAL_COMMAND | R1_ERROR))) {
+			this->PCIRegP[0]->NormalIntStatus = CmdComplete;
+			return 0;
+		}
+		// Stay open-ended with this card from now on
+		IOLog("VoodooSDHCI: CMD23 failed: Status: 0x%x, Error: 0x%x, Response: 0x%x\n",
+			PCIRegP[0]->NormalIntStatus, PCIRegP[0]->ErrorIntStatus, PCIRegP[0]->Response[0]);
+		Reset(0, CMD_RESET);
+		cmd23 = false;
+	}
+	if (quirks & kSDQuirkBrokenACMD12) {
+		stopNeeded = true;
+		return 0;
+	}
+	return SDHCI_TRNS_ACMD12;
+}
+
+/*
+ * readSCR:  Read the SD Configuration Register with ACMD51 and note which
+ *	     optional commands the card supports.  The card must be in the
+ *	     transfer state.  Returns true if the SCR was read.
+ *	UInt8 slot:  Which slot the card is in
+ */
+bool VoodooSDHC::readSCR(UInt8 slot) {
+	UInt32 buff[2];
+	UInt8 *p = (UInt8 *)buff;
+
+	cmd23 = false;
+	this->PCIRegP[slot]->NormalIntStatus = CmdComplete;
+	this->PCIRegP[slot]->ErrorIntStatus = 0xf3ff;
+	SDCommand(slot, SD_APP_CMD, SDCR55, this->RCA << 16);
+	if (! waitIntStatus(slot, CmdComplete))
+		return false;
+	if (dataCommand_pio(slot, SD_APP_SEND_SCR, SDACR51, 0, buff, 8, true) != kIOReturnSuccess)
+		return false;
+	cmd23 = (p[SCR_CMD_SUPPORT] & SCR_CMD23_SUPPORT) != 0;
 #ifdef __DEBUG__
-	IOLog("VoodooSDHCI: in power_sd(slot) function ::  0x%x\n", this->PCIRegP[slot]->Capabilities[0]);
+	IOLog("VoodooSDHCI: SCR 0x%02x%02x%02x%02x%02x%02x%02x%02x, CMD23 %s\n",
+		p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7], cmd23 ? "yes" : "no");
 #endif
-	if(this->PCIRegP[slot]->Capabilities[0] & CR3v3Support) {
-		this->PCIRegP[slot]->PowerControl |= HC3v3;
-	} else if(this->PCIRegP[slot]->Capabilities[0] & CR3v0Support) {
-		this->PCIRegP[slot]->PowerControl |= HC3v0;
-	} else if(this->PCIRegP[slot]->Capabilities[0] & CR1v8Support) {
-		this->PCIRegP[slot]->PowerControl |= HC1v8;
-	}
-	this->PCIRegP[slot]->PowerControl |= SDPower;
-		
 	return true;
 }
 
 /*
- * parseCID:  Parse Card Idenitification information
- *		UInt8 slot:  slot the card is in
+ * preErase:  Tell an SD card how many blocks the next CMD25 writes
+ *	      (ACMD23), so that it can erase them ahead of the data.  Only
+ *	      sent for writes of at least tuning.preEraseBlocks.  The hint is
+ *	      optional, so a card that fails it still gets the write.
+ *	UInt32 nblks:  Block count of the write
  */
-void VoodooSDHC::parseCID(UInt8 slot) {
-	this->SDCIDReg[slot].MID = (UInt8)(this->PCIRegP[slot]->Response[3] & 0xFF000000) >> 24;
-	this->SDCIDReg[slot].OID = (UInt16)(this->PCIRegP[slot]->Response[3] & 0xFFFF00) >> 8;
-	this->SDCIDReg[slot].PNM[0] = (UInt8)(this->PCIRegP[slot]->Response[3] & 0xFF);
-	this->SDCIDReg[slot].PNM[1] = (UInt8)((this->PCIRegP[slot]->Response[2] & 0xFF000000) >> 24);
-	this->SDCIDReg[slot].PNM[2] = (UInt8)((this->PCIRegP[slot]->Response[2] & 0xFF0000) >> 16);
-	this->SDCIDReg[slot].PNM[3] = (UInt8)((this->PCIRegP[slot]->Response[2] & 0xFF00) >> 8);
-	this->SDCIDReg[slot].PNM[4] = (UInt8)(this->PCIRegP[slot]->Response[2] & 0xFF);
-	this->SDCIDReg[slot].PNM[5] = 0;
-	this->SDCIDReg[slot].PRV[0] = (UInt8)(this->PCIRegP[slot]->Response[1] & 0xF0000000) >> 28;
-	this->SDCIDReg[slot].PRV[1] = (UInt8)(this->PCIRegP[slot]->Response[1] & 0xF000000) >> 24;
-	this->SDCIDReg[slot].PSN = (this->PCIRegP[slot]->Response[1] & 0xFFFFFF) << 8;
-	this->SDCIDReg[slot].PSN |= (this->PCIRegP[slot]->Response[0] & 0xFF000000) >> 24;
-	this->SDCIDReg[slot].MDT[0] = (UInt8)(this->PCIRegP[slot]->Response[0] & 0xFF000) >> 12;
-	this->SDCIDReg[slot].MDT[1] = (UInt8)(this->PCIRegP[slot]->Response[1] & 0xF00) >> 8;
+void VoodooSDHC::preErase(UInt32 nblks) {
+	if (isMMC || tuning.preEraseBlocks == 0 || nblks < tuning.preEraseBlocks)
+		return;
+	this->PCIRegP[0]->NormalIntStatus = CmdComplete;
+	this->PCIRegP[0]->ErrorIntStatus = 0xf3ff;
+	SDCommand(0, SD_APP_CMD, SDCR55, this->RCA << 16);
+	if (waitIntStatus(0, CmdComplete)) {
+		SDCommand(0, SD_APP_SET_WR_BLK_ERASE_COUNT, R1, nblks & 0x7FFFFF);
+		if (waitIntStatus(0, CmdComplete))
+			return;
+	}
+	IOLog("VoodooSDHCI: ACMD23 failed: Status: 0x%x, Error: 0x%x\n",
+		PCIRegP[0]->NormalIntStatus, PCIRegP[0]->ErrorIntStatus);
+	Reset(0, CMD_RESET);
+	this->PCIRegP[0]->ErrorIntStatus = 0xf3ff;
 }
 
 /*
- * parseCSD:  Parse CSD information
- *		UInt8 slot:  slot the card is in
+ * partialBlocks:  After a CMD18/CMD25 has timed out, stop the card and work
+ *		   out how many blocks from the start of the transfer are
+ *		   known to have made it, so that a retry can carry on from
+ *		   there.  Reads go by the Block Count register, but no
+ *		   further than what has reached the client's buffer.  SD
+ *		   writes ask the card with ACMD22; MMC writes start over.
+ *	bool read:  true if the card was sending data
+ *	UInt32 nblks:  Block count of the transfer
+ *	UInt32 copied:  Blocks of a read already in the client's buffer
  */
-void VoodooSDHC::parseCSD(UInt8 slot) {
-	switch ((UInt8)((this->PCIRegP[slot]->Response[3] & 0xC00000) >> 22)) {
-		case 0: // version 1
-		{
-			UInt8 blLen = (UInt8)((PCIRegP[slot]->Response[2] & 0xF00) >> 8);
-			UInt16 cSize = (UInt16)((PCIRegP[slot]->Response[2] & 0x3) << 10);
-			cSize |= (UInt16)((PCIRegP[slot]->Response[1] & 0xFFC00000) >> 22);
-			UInt8 cSizeMult = (UInt8)((PCIRegP[slot]->Response[1] & 0x000380) >> 7);
-			int large_to_small = (1 << (blLen)) / 512;
-			maxBlock = (cSize+1) * large_to_small *
-			(1 << (cSizeMult+2)) - 1;
-		}
-			break;
-		case 1: // version 2
-		{
-			int units = (UInt16)(PCIRegP[slot]->Response[1] >> 24);
-			units |= (PCIRegP[slot]->Response[1] & 0x00ff0000) >> 8;
-			units |= (PCIRegP[slot]->Response[2] & 0x3f) << 16;
-			maxBlock = (units + 1) * 1024;
-		}
-			break;
-		default:
-			// donno how to bail out...
-			;
+UInt32 VoodooSDHC::partialBlocks(bool read, UInt32 nblks, UInt32 copied) {
+	UInt32 buff[1], left, done = 0;
+	UInt8 *p = (UInt8 *)buff;
+
+	left = (hostV4 && hostSpec[0] >= SDHCI_SPEC_410) ?
+		this->PCIRegP[0]->BlockCount32 : this->PCIRegP[0]->BlockCount;
+	Reset(0, CMD_RESET);
+	Reset(0, DAT_RESET);
+	// The card may still be in the data state; a card that is not fails CMD12
+	stopTransmission(0);
+	stopNeeded = false;
+	if (read) {
+		done = MIN(left < nblks ? nblks - left : 0, copied);
+	} else if (! isMMC) {
+		this->PCIRegP[0]->NormalIntStatus = CmdComplete;
+		this->PCIRegP[0]->ErrorIntStatus = 0xf3ff;
+		SDCommand(0, SD_APP_CMD, SDCR55, this->RCA << 16);
+		if (waitIntStatus(0, CmdComplete) &&
+		    dataCommand_pio(0, SD_APP_SEND_NUM_WR_BLKS, SDACR22, 0, buff, 4, true) == kIOReturnSuccess)
+			done = MIN((UInt32)(p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3]), nblks);
 	}
+	IOLog("VoodooSDHCI: %d of %d blocks got through before the timeout\n", (int)done, (int)nblks);
+	return done;
 }
 
 /*
- * reportRemovability:  Apple API function.  An SD Card is a removeable
- *		        device.  Returns an I/O success.
- *	bool *isRemovable:  Passed back.  Always return true.
+ * recover:  Take one step up the error recovery ladder after the attempt-th
+ *	     failure of the same transfer.  Every step resets the CMD and DAT
+ *	     lines; the second also slows the bus down, the third also drops
+ *	     it to 1 bit, and the last brings the card up again from scratch,
+ *	     keeping the slower settings.  A step with nothing left to give
+ *	     up moves on to the next one, and a failed line reset goes
+ *	     straight to the last step.  Returns false if the card could
+ *	     not be brought back.  The host controller must be locked when
+ *	     this function is called.
+ *	UInt8 slot:  Which slot the card is in
+ *	int attempt:  Failures so far, less one
  */
-IOReturn VoodooSDHC::reportRemovability(bool *isRemovable) {
-	*isRemovable = true;
-#ifdef __DEBUG__
-	IOLog("VoodooSDHCI: reportRemovability\n");
-#endif
-	return kIOReturnSuccess;
+bool VoodooSDHC::recover(UInt8 slot, int attempt) {
+	SDCIDReg_t oldCID = SDCIDReg[slot];
+	UInt8 was = degrade;
+	UInt64 start;
+	bool lines;
+
+	cleanRun = 0;
+	// Lines that will not come out of reset leave only the full bring-up
+	lines = Reset(slot, CMD_RESET) && Reset(slot, DAT_RESET);
+	this->PCIRegP[slot]->NormalIntStatus = 0xffff;
+	this->PCIRegP[slot]->ErrorIntStatus = 0xf3ff;
+	if (lines && attempt == 0)
+		return true;
+	if (lines && attempt == 1 && busSlowDown(slot))
+		return true;
+	if (lines && attempt <= 2 && busNarrow(slot))
+		return true;
+
+	IOLog("VoodooSDHCI: bringing the card up again\n");
+	start = traceClock();
+	if (! Reset(slot, FULL_RESET) || ! cardInit(slot) || memcmp(&oldCID, SDCIDReg + slot, sizeof(oldCID)) != 0) {
+		IOLog("VoodooSDHCI: reset failed, disabling access\n");
+		cardPresence = kCardRemount;
+		return false;
+	}
+	statTime(slot, kSDStatReinit, start);
+	OSIncrementAtomic(&stats[slot].reinits);
+	// cardInit went back to full speed and width
+	degrade = 0;
+	if (was & kSDDegradeSlow)
+		busSlowDown(slot);
+	if (was & kSDDegradeNarrow)
+		busNarrow(slot);
+	setProperty(kVoodooSDHCDegradeKey, degrade, 8);
+	return true;
 }
 
 /*
- * reportWriteProtection:  Apple API function.  Returns whether the card is
- *		write protected.  Returns an I/O success.
- *	bool *isWriteProtected:  Passed back.  Always return true.
+ * busSlowDown:  Give up bus speed after errors: SD high speed drops to
+ *		 default speed, and MMC moves one timing down, to HS or from
+ *		 HS to legacy.  Returns false if there was nothing to give up
+ *		 or the card would not change.
+ *	UInt8 slot:  Which slot the card is in
  */
-IOReturn VoodooSDHC::reportWriteProtection(bool *isWriteProtected) {
-// XXX - how is this supposed to work for multi-slot???
-	*isWriteProtected = isCardWP( 0 );
-	//*isWriteProtected = true;
-#ifdef __DEBUG__
-	IOLog("VoodooSDHCI: reportWriteProtection\n");
-#endif
-	return kIOReturnSuccess;
+bool VoodooSDHC::busSlowDown(UInt8 slot) {
+	if (degrade & kSDDegradeSlow)
+		return false;
+	if (isMMC) {
+		if (mmcTiming == kMMCTimingLegacy)
+			return false;
+		slowFrom = mmcTiming;
+		if (! mmcSetTiming(slot, mmcTiming == kMMCTimingHS ? kMMCTimingLegacy : kMMCTimingHS))
+			return false;
+		// The sampling point was found for 200MHz
+		mmcTuned = false;
+	} else {
+		if (! (shadow[slot].hostControl & SDHCI_CTRL_HISPD))
+			return false;
+		setHostControl(slot, SDHCI_CTRL_HISPD, 0);
+		calcClock(slot, 25000000);
+	}
+	degrade |= kSDDegradeSlow;
+	setProperty(kVoodooSDHCDegradeKey, degrade, 8);
+	IOLog("VoodooSDHCI: slowing the bus down after errors\n");
+	return true;
 }
 
 /*
- * setWriteCacheState:  Apple API function.  This driver does not support
- *			write cacheing.	 Returns an I/O success.
- *		bool enabled:  Enable/disable cache
+ * busNarrow:  Give up bus width after errors, going to 1 bit.  MMC DDR and
+ *	       HS200/HS400 timings need the wide bus, so cards in them keep
+ *	       it.  Returns false if there was nothing to give up or the card
+ *	       would not change.
+ *	UInt8 slot:  Which slot the card is in
  */
-IOReturn VoodooSDHC::setWriteCacheState(bool enabled) {
-#ifdef __DEBUG__
-	IOLog("VoodooSDHCI: setWriteCacheState\n");
-#endif
-	return kIOReturnSuccess;
+bool VoodooSDHC::busNarrow(UInt8 slot) {
+	UInt8 width = shadow[slot].hostControl & (SDHCI_CTRL_4BITBUS | SDHCI_CTRL_8BITBUS);
+
+	if ((degrade & kSDDegradeNarrow) || width == 0)
+		return false;
+	if (isMMC) {
+		if (mmcTiming != kMMCTimingLegacy && mmcTiming != kMMCTimingHS)
+			return false;
+		if (! mmcSwitch(slot, EXT_CSD_BUS_WIDTH, EXT_CSD_BUS_WIDTH_1))
+			return false;
+	} else {
+		this->PCIRegP[slot]->NormalIntStatus = CmdComplete;
+		this->PCIRegP[slot]->ErrorIntStatus = 0xf3ff;
+		SDCommand(slot, SD_APP_CMD, SDCR55, this->RCA << 16);
+		if (! waitIntStatus(slot, CmdComplete))
+			goto fail;
+		SDCommand(slot, SD_APP_SET_BUS_WIDTH, SDCR6, SD_BUS_WIDTH_1);
+		if (! waitIntStatus(slot, CmdComplete))
+			goto fail;
+	}
+	setHostControl(slot, SDHCI_CTRL_4BITBUS | SDHCI_CTRL_8BITBUS, 0);
+	narrowFrom = width;
+	degrade |= kSDDegradeNarrow;
+	setProperty(kVoodooSDHCDegradeKey, degrade, 8);
+	IOLog("VoodooSDHCI: dropping to a 1 bit bus after errors\n");
+	return true;
+fail:
+	Reset(slot, CMD_RESET);
+	this->PCIRegP[slot]->ErrorIntStatus = 0xf3ff;
+	return false;
 }
 
 /*
- * reportPollRequirements:  Apple API function.  Report back requirements for
- *                          polling.  This driver must be polled, but the poll
- *			    is cheap.
- *	bool *pollRequired:  This is a return value from this function
- *	bool *pollIsExpensive:  This is a return value from this function
+ * busStepUp:  Win back the last bus setting error recovery gave up, after
+ *	       CLEAN_RUN_STEP_UP transfers without error.  MMC HS200 and
+ *	       HS400 are tuned again on the way back; if that fails the card
+ *	       stays at HS and the bus stays marked slow.
+ *	UInt8 slot:  Which slot the card is in
  */
-IOReturn VoodooSDHC::reportPollRequirements(bool *pollRequired, bool *pollIsExpensive)
-{
-	*pollRequired = false;
-	*pollIsExpensive = false;
-	return kIOReturnSuccess;
-}
-
-IOReturn VoodooSDHC::reportMediaState(bool *mediaPresent, bool *changedState)
-{
-	IOLockLock(mediaStateLock);
-	
-	bool presence = isCardPresent(0);
-	if (cardPresence == kCardRemount) {
-		*changedState = true;
-		cardPresence = kCardNotPresent;
-	} else if ((cardPresence == kCardIsPresent) == presence) {
-		*changedState = false;
-	} else {
-		*changedState = true;
-		if (presence) {
-			Reset(0, FULL_RESET);
-			cardInit(0);
-			::OSSynchronizeIO();
-			cardPresence = kCardIsPresent;
+void VoodooSDHC::busStepUp(UInt8 slot) {
+	bool ok = true;
+
+	cleanRun = 0;
+	if (degrade & kSDDegradeNarrow) {
+		if (isMMC) {
+			ok = mmcSwitch(slot, EXT_CSD_BUS_WIDTH,
+				(narrowFrom & SDHCI_CTRL_8BITBUS) ? EXT_CSD_BUS_WIDTH_8 : EXT_CSD_BUS_WIDTH_4);
 		} else {
-			cardPresence = kCardNotPresent;
+			this->PCIRegP[slot]->NormalIntStatus = CmdComplete;
+			this->PCIRegP[slot]->ErrorIntStatus = 0xf3ff;
+			SDCommand(slot, SD_APP_CMD, SDCR55, this->RCA << 16);
+			ok = waitIntStatus(slot, CmdComplete);
+			if (ok) {
+				SDCommand(slot, SD_APP_SET_BUS_WIDTH, SDCR6, SD_BUS_WIDTH_4);
+				ok = waitIntStatus(slot, CmdComplete);
+			}
+		}
+		if (ok) {
+			setHostControl(slot, 0, narrowFrom);
+			degrade &= ~kSDDegradeNarrow;
 		}
+	} else if (degrade & kSDDegradeSlow) {
+		if (isMMC && mmcTiming == kMMCTimingLegacy)
+			ok = mmcSetTiming(slot, kMMCTimingHS);
+		else if (isMMC && slowFrom == kMMCTimingDDR52)
+			ok = mmcSetTiming(slot, kMMCTimingDDR52);
+		else if (isMMC && slowFrom >= kMMCTimingHS200) {
+			mmcTuned = mmcSetTiming(slot, kMMCTimingHS200) &&
+				executeTuning(slot, SD_SEND_TUNING_BLOCK_HS200,
+					(shadow[slot].hostControl & SDHCI_CTRL_8BITBUS) ? 128 : 64);
+			if (mmcTuned && slowFrom == kMMCTimingHS400)
+				mmcSelectHS400(slot);
+			// mmcSelectHS400 may have ended up back at HS
+			ok = mmcTiming >= kMMCTimingHS200;
+			if (! ok && mmcTiming != kMMCTimingHS)
+				mmcSetTiming(slot, kMMCTimingHS);
+		} else if (! isMMC) {
+			setHostControl(slot, 0, SDHCI_CTRL_HISPD);
+			calcClock(slot, 50000000);
+		}
+		if (ok)
+			degrade &= ~kSDDegradeSlow;
 	}
-	*mediaPresent = cardPresence == kCardIsPresent;
-
-	IOLockUnlock(mediaStateLock);
-	return kIOReturnSuccess;
-}
-
-#ifndef __LP64__
-IOReturn VoodooSDHC::reportMaxWriteTransfer(UInt64 blockSize,
-								UInt64 *max) {
-	//Max blocks we can read at once (see Block Count Register)
-	*max = 64 * blockSize;
-
-#ifdef __DEBUG__
-	IOLog("VoodooSDHCI: reportMaxWriteTransfer\n");
-#endif /* end DEBUG */
-
-	return kIOReturnSuccess;
+	if (! ok) {
+		Reset(slot, CMD_RESET);
+		this->PCIRegP[slot]->ErrorIntStatus = 0xf3ff;
+		return;
+	}
+	setProperty(kVoodooSDHCDegradeKey, degrade, 8);
+	IOLog("VoodooSDHCI: bus back up a step after %d clean transfers\n", CLEAN_RUN_STEP_UP);
 }
 
-IOReturn VoodooSDHC::reportMaxReadTransfer (UInt64 blockSize,
-											UInt64 *max) {
-	//Max blocks we can read at once (see Block Count Register)
-	*max = 65536 * blockSize;
-	
-#ifdef __DEBUG__
-	IOLog("VoodooSDHCI: reportMaxReadTransfer\n");
-#endif /* end DEBUG */
-	
-	return kIOReturnSuccess;
-}
-#endif /* !__LP64__ */
+/*
+ * calcClock:  Calculate card clock rate.  See SDHCI Host Controller spec
+ *	       for details on calculation.  Must be called after cardInit.
+ *	UInt8 slot:  Host controller/slot number
+ *	UInt32 clockspeed:  Maximum desired clock speed
+ */
+bool VoodooSDHC::calcClock(UInt8 slot, UInt32 clockspeed) {
+	UInt32 baseClock;
+	UInt32 div;
+	UInt16 clk;
 
-IOReturn VoodooSDHC::reportMaxValidBlock(UInt64 *maxBlock) {
-	*maxBlock = this->maxBlock;
+	// SDHCI 3.0 widened the base clock field to 8 bits for 200MHz hosts
+	if (hostSpec[slot] >= SDHCI_SPEC_300)
+		baseClock = ((this->PCIRegP[slot]->Capabilities[0] & 0xFF00) >> 8);
+	else
+		baseClock = ((this->PCIRegP[slot]->Capabilities[0] & 0x3F00) >> 8);
+	baseClock *= 1000000;
 
 #ifdef __DEBUG__
-	IOLog("VoodooSDHCI: reportMaxValidBlock\n");
-#endif
-
-	return kIOReturnSuccess;
-}
+	IOLog("VoodooSDHCI: BaseClock :: %dMHz\n", baseClock/1000000);
+#endif //me
 
-IOReturn VoodooSDHC::reportLockability(bool *isLockable) {
-	*isLockable = false;
-#ifdef __DEBUG__
-	IOLog("VoodooSDHCI: reportLockability\n");
-#endif
-	return kIOReturnSuccess;
-}
+	if (hostSpec[slot] >= SDHCI_SPEC_300) {
+		// 10 bit divided clock mode: SDCLK is base / 2N, N = 0 is the base
+		div = baseClock <= clockspeed ? 0 :
+			(baseClock + 2 * clockspeed - 1) / (2 * clockspeed);
+		if (div > 0x3FF)
+			div = 0x3FF;
+		clk = (UInt16)(((div & 0xFF) << 8) | ((div & 0x300) >> 2));
+		div = div ? div * 2 : 1;
+	} else {
+		// Power of two divisor up to 256; the register holds half of it
+		for (div = 1; div < 256 && (baseClock / div) > clockspeed; div <<= 1);
+		clk = (UInt16)((div >> 1) << 8);
+	}
 
-IOReturn VoodooSDHC::reportEjectability(bool *isEjectable) {
-	*isEjectable = false;
 #ifdef __DEBUG__
-	IOLog("VoodooSDHCI: reportEjectability\n");
-#endif
-	return kIOReturnSuccess;
-}
-
+	IOLog("VoodooSDHCI: SD Clock :: %dKHz\n", (baseClock/div)/1000);
+#endif //me
 
-IOReturn VoodooSDHC::reportBlockSize(UInt64 *blockSize) {
-	// Read/write block size is always 512 bytes.  Card's block size
-	// is reported but only used in computations of size, not access.
-	*blockSize = 512;
-#ifdef __DEBUG__
-	IOLog("VoodooSDHCI: reportBlockSize:  %d\n", *blockSize);
-#endif
-	return kIOReturnSuccess;
+	// The divider may only change with the SD clock stopped
+	setClockControl(slot, 0);
+	setClockControl(slot, clk | BIT0);
+	if (! waitReg<UInt16>(slot, &this->PCIRegP[slot]->ClockControl, BIT1, true,
+				CLOCK_TIMEOUT_US, "internal clock"))
+		return false;
+	setClockControl(slot, clk | BIT0 | BIT2);
+	return true;
 }
 
-IOReturn VoodooSDHC::getWriteCacheState(bool *enabled) {
-	*enabled = false;
+/*
+ * hostV4Init:  Put an SDHCI 4.x host into Host Version 4 mode.  This moves
+ *		the SDMA address to 0x58 and makes 0x00 the 32 bit block count
+ *		(4.10) and enables ADMA3 (4.20).  A host that does not keep the
+ *		enable bit stays in the version 3 register layout.  Must be
+ *		called after every full reset.
+ *	UInt8 slot:  Host controller/slot number
+ */
+void VoodooSDHC::hostV4Init(UInt8 slot) {
+	hostV4 = false;
+	hostADMA3 = false;
+	if (! USE_HOST_V4 || hostSpec[slot] < SDHCI_SPEC_400)
+		return;
+	setHostControl2(slot, 0, SDHCI_CTRL_V4_MODE);
+	if (! (this->PCIRegP[slot]->HostControl2 & SDHCI_CTRL_V4_MODE)) {
+		shadowLoad(slot);
+		IOLog("VoodooSDHCI: host would not enter version 4 mode\n");
+		return;
+	}
+	hostV4 = true;
+	hostADMA3 = hostSpec[slot] >= SDHCI_SPEC_420 &&
+		(this->PCIRegP[slot]->Capabilities[1] & SDHCI_CAN_DO_ADMA3) &&
+		! (hostQuirks & (kSDQuirkBrokenDMA | kSDQuirkBrokenADMA |
+				kSDQuirkBrokenMultiBlock | kSDQuirkBrokenACMD12));
 #ifdef __DEBUG__
-	IOLog("VoodooSDHCI: getWriteCacheState\n");
+	IOLog("VoodooSDHCI: host version 4 mode%s\n", hostADMA3 ? " with ADMA3" : "");
 #endif
-	return kIOReturnSuccess;
 }
 
-char * VoodooSDHC::getVendorString(void) {
-#ifdef __DEBUG__
-	IOLog("VoodooSDHCI: getVendorString\n");
-#endif
-	return("Generic");
+/*
+ * setDMAAddress:  Point the SDMA engine at a buffer.  Version 4 mode moved
+ *		   the SDMA address to the ADMA System Address register.
+ *	UInt8 slot:  Host controller/slot number
+ *	UInt32 addr:  Physical address of the buffer
+ */
+void VoodooSDHC::setDMAAddress(UInt8 slot, UInt32 addr) {
+	if (hostV4) {
+		this->PCIRegP[slot]->ADMASystemAddr[0] = addr;
+		this->PCIRegP[slot]->ADMASystemAddr[1] = 0;
+	} else {
+		this->PCIRegP[slot]->SDMASysAddr = addr;
+	}
 }
 
-char * VoodooSDHC::getRevisionString(void) {
-#ifdef __DEBUG__
-	IOLog("VoodooSDHCI: getRevisionString\n");
-#endif
-	return("2");
+/*
+ * setBlockCount:  Set the block count for the next data command, using the
+ *		   32 bit register when the host has one.  The 16 bit register
+ *		   must be zero for the 32 bit one to take effect.
+ *	UInt8 slot:  Host controller/slot number
+ *	UInt32 nblks:  Block count, at most maxBlockCount()
+ */
+void VoodooSDHC::setBlockCount(UInt8 slot, UInt32 nblks) {
+	if (hostV4 && hostSpec[slot] >= SDHCI_SPEC_410) {
+		this->PCIRegP[slot]->BlockCount = 0;
+		this->PCIRegP[slot]->BlockCount32 = nblks;
+	} else {
+		this->PCIRegP[slot]->BlockCount = (UInt16)nblks;
+	}
 }
 
-char * VoodooSDHC::getProductString(void) {
-#ifdef __DEBUG__
-	IOLog("VoodooSDHCI: getProductString\n");
-#endif
-	return("SDHCI Controller");
+/*
+ * maxBlockCount:  Largest block count a single data command can carry.
+ */
+UInt32 VoodooSDHC::maxBlockCount(void) {
+	return (hostV4 && hostSpec[0] >= SDHCI_SPEC_410) ? 0xFFFFFFFF : 0xFFFF;
 }
 
-char * VoodooSDHC::getAdditionalDeviceInfoString(void) {
-#ifdef __DEBUG__
-	IOLog("VoodooSDHCI: getAdditionalDeviceInfoString\n");
-#endif
-	return("VoodooSDHCI:getAdditionalDeviceInfoString");
-}
+/*
+ * powerSD:  Turn on power to SD Card.  Must pay attention to voltage
+ *	     level supported.  This is determined from the Host capability
+ *	     register.
+ *	UInt8 slot:  Slot the card is in.
+ */
+bool VoodooSDHC::powerSD(UInt8 slot) {
+	UInt32 caps = this->PCIRegP[slot]->Capabilities[0];
+	UInt8 power = 0;
 
-IOReturn VoodooSDHC::doSynchronizeCache(void) {
+	setPowerControl(slot, 0);
 #ifdef __DEBUG__
-	IOLog("VoodooSDHCI: doSynchronizeCache\n");
+	IOLog("VoodooSDHCI: in power_sd(slot) function ::  0x%x\n", caps);
 #endif
-	return kIOReturnSuccess;
+	if(caps & CR3v3Support) {
+		power = HC3v3;
+	} else if(caps & CR3v0Support) {
+		power = HC3v0;
+	} else if(caps & CR1v8Support) {
+		power = HC1v8;
+	}
+	setPowerControl(slot, power);
+	setPowerControl(slot, power | SDPower);
+		
+	return true;
 }
 
-IOReturn VoodooSDHC::doLockUnlockMedia(bool doLock) {
-#ifdef __DEBUG__
-	IOLog("VoodooSDHCI: doLockUnlockMedia\n");
-#endif
-	return kIOReturnUnsupported;
+/*
+ * parseCID:  Parse Card Idenitification information.  The host drops the
+ *	      CRC byte, so CID bit n is bit n - 8 of the response.  MMC has
+ *	      an 8 bit OEM ID and a 6 character product name.
+ *		UInt8 slot:  slot the card is in
+ */
+void VoodooSDHC::parseCID(UInt8 slot) {
+	volatile UInt32 *r = this->PCIRegP[slot]->Response;
+
+	this->SDCIDReg[slot].MID = (UInt8)(r[3] >> 16);
+	this->SDCIDReg[slot].PNM[0] = (char)(r[2] >> 24);
+	this->SDCIDReg[slot].PNM[1] = (char)(r[2] >> 16);
+	this->SDCIDReg[slot].PNM[2] = (char)(r[2] >> 8);
+	this->SDCIDReg[slot].PNM[3] = (char)r[2];
+	this->SDCIDReg[slot].PNM[4] = (char)(r[1] >> 24);
+	if (isMMC) {
+		this->SDCIDReg[slot].OID = (UInt8)r[3];
+		this->SDCIDReg[slot].PNM[5] = (char)(r[1] >> 16);
+		this->SDCIDReg[slot].PRV[0] = (UInt8)(r[1] >> 12) & 0xF;
+		this->SDCIDReg[slot].PRV[1] = (UInt8)(r[1] >> 8) & 0xF;
+		this->SDCIDReg[slot].PSN = (r[1] << 24) | (r[0] >> 8);
+		this->SDCIDReg[slot].MDT[0] = (UInt8)r[0] & 0xF;
+		this->SDCIDReg[slot].MDT[1] = (UInt8)(r[0] >> 4) & 0xF;
+	} else {
+		this->SDCIDReg[slot].OID = (UInt16)r[3];
+		this->SDCIDReg[slot].PNM[5] = 0;
+		this->SDCIDReg[slot].PRV[0] = (UInt8)(r[1] >> 20) & 0xF;
+		this->SDCIDReg[slot].PRV[1] = (UInt8)(r[1] >> 16) & 0xF;
+		this->SDCIDReg[slot].PSN = (r[1] << 16) | (r[0] >> 16);
+		this->SDCIDReg[slot].MDT[0] = (UInt8)(r[0] >> 4);
+		this->SDCIDReg[slot].MDT[1] = (UInt8)r[0] & 0xF;
+	}
 }
 
-UInt32 VoodooSDHC::doGetFormatCapacities(UInt64 *capacities, UInt32 capacitiesMaxCount) const {
+/*
+ * parseCSD:  Parse CSD information
+ *		UInt8 slot:  slot the card is in
+ */
+void VoodooSDHC::parseCSD(UInt8 slot) {
+	// MMC keeps the version 1 layout; large cards report size in EXT_CSD
+	switch (isMMC ? 0 : (UInt8)((this->PCIRegP[slot]->Response[3] & 0xC00000) >> 22)) {
+		case 0: // version 1
+		{
+			UInt8 blLen = (UInt8)((PCIRegP[slot]->Response[2] & 0xF00) >> 8);
+			UInt16 cSize = (UInt16)((PCIRegP[slot]->Response[2] & 0x3) << 10);
+			cSize |= (UInt16)((PCIRegP[slot]->Response[1] & 0xFFC00000) >> 22);
+			UInt8 cSizeMult = (UInt8)((PCIRegP[slot]->Response[1] & 0x000380) >> 7);
+			int large_to_small = (1 << (blLen)) / 512;
+			maxBlock = (cSize+1) * large_to_small *
+			(1 << (cSizeMult+2)) - 1;
+		}
+			break;
+		case 1: // version 2
+		{
+			int units = (UInt16)(PCIRegP[slot]->Response[1] >> 24);
+			units |= (PCIRegP[slot]->Response[1] & 0x00ff0000) >> 8;
+			units |= (PCIRegP[slot]->Response[2] & 0x3f) << 16;
+			maxBlock = (units + 1) * 1024;
+		}
+			break;
+		default:
+			// donno how to bail out...
+			;
+	}
+}
+
+/*
+ * dataCommand_pio:  Issue a command with a single short data block (card
+ *		     registers such as SD Status or extension registers) and
+ *		     move the data through the PIO buffer port.  The host
+ *		     controller must be locked when this function is called.
+ *		UInt8 slot:  slot the card is in
+ *		UInt8 command:  SDHC command as defined in SDHC Physical Interface
+ *		UInt16 response:  Response type to expect for command passed in
+ *		UInt32 arg:  Command argument
+ *		UInt32 *buff:  Data buffer, at least len bytes
+ *		UInt16 len:  Data block length in bytes, a multiple of 4
+ *		bool read:  true if the card sends data, false if it receives
+ */
+IOReturn VoodooSDHC::dataCommand_pio(UInt8 slot, UInt8 command, UInt16 response,
+					UInt32 arg, UInt32 *buff, UInt16 len, bool read) {
+	IOReturn ret = kIOReturnError;
+
+	this->PCIRegP[slot]->NormalIntStatusEn = -1;
+	this->PCIRegP[slot]->ErrorIntStatusEn = -1;
+	this->PCIRegP[slot]->NormalIntStatus =
+			BuffReadReady | BuffWriteReady | XferComplete | CmdComplete;
+	this->PCIRegP[slot]->ErrorIntStatus = 0xf3ff;
+	this->PCIRegP[slot]->TimeoutControl = 0xe;
+
+	this->PCIRegP[slot]->BlockSize = len;
+	this->PCIRegP[slot]->BlockCount = 1;
+	this->PCIRegP[slot]->TransferMode = read ? SDHCI_TRNS_READ : 0;
+
+	SDCommand(slot, command, response, arg, true);
+
+	if (! waitIntStatus(slot, CmdComplete)) {
+		IOLog("VoodooSDHCI: I/O error after command %d (PIO): Status: 0x%x, Error: 0x%x\n",
+			command, PCIRegP[slot]->NormalIntStatus, PCIRegP[slot]->ErrorIntStatus);
+		goto out;
+	}
+	if (! waitIntStatus(slot, read ? BuffReadReady : BuffWriteReady)) {
+		IOLog("VoodooSDHCI: I/O timeout while waiting for data (command %d)\n", command);
+		goto out;
+	}
+	for (int i = 0; i < len / sizeof(UInt32); i++) {
+		if (read)
+			buff[i] = this->PCIRegP[slot]->BufferDataPort;
+		else
+			this->PCIRegP[slot]->BufferDataPort = buff[i];
+	}
+	if (! waitIntStatus(slot, XferComplete)) {
+		IOLog("VoodooSDHCI: I/O timeout during completion (command %d)\n", command);
+		goto out;
+	}
+	ret = kIOReturnSuccess;
+out:
+	if (ret != kIOReturnSuccess) {
+		Reset(slot, CMD_RESET);
+		Reset(slot, DAT_RESET);
+	}
+	return ret;
+}
+
+/*
+ * cmdqInit:  Enable the SD command queue on cards that advertise one.  The
+ *	      card must be in the transfer state.  Leaves cmdqDepth at 0 (no
+ *	      queueing) when the card is not A2, has no queue, or refuses to
+ *	      enable it.  Returns true if the queue is enabled.
+ *		UInt8 slot:  slot the card is in
+ */
+bool VoodooSDHC::cmdqInit(UInt8 slot) {
+	static const UInt32 auSizeKB[16] = {
+		0, 16, 32, 64, 128, 256, 512, 1024,
+		2048, 4096, 8192, 12288, 16384, 24576, 32768, 65536
+	};
+	UInt32 buff[512 / sizeof(UInt32)];
+	UInt8 *p = (UInt8 *)buff;
+	UInt8 depth, fno = 0;
+	UInt16 page = 0, off = 0, next;
+	bool found = false;
+
+	cmdqDepth = 0;
+
+	/* Clear whatever the init sequence left behind */
+	this->PCIRegP[slot]->NormalIntStatus = 0xffff;
+	this->PCIRegP[slot]->ErrorIntStatus = 0xf3ff;
+
+	/* SD Status tells us the application performance class and queue depth */
+	SDCommand(slot, SD_APP_CMD, SDCR55, this->RCA << 16);
+	if (! waitIntStatus(slot, CmdComplete))
+		return false;
+	if (dataCommand_pio(slot, SD_APP_SD_STATUS, SDACR13, 0, buff, 64, true) != kIOReturnSuccess)
+		return false;
+	auSize = auSizeKB[p[SD_STATUS_AU_SIZE] >> 4];
+	if ((p[SD_STATUS_APP_PERF_CLASS] & 0xF) < SD_APP_PERF_CLASS_A2 ||
+	    (p[SD_STATUS_PERF_ENHANCE] >> 3) == 0) {
 #ifdef __DEBUG__
-	IOLog("VoodooSDHCI: doGetFormatCapacities\n");
+		IOLog("VoodooSDHCI: card has no command queue (class A%d)\n",
+			p[SD_STATUS_APP_PERF_CLASS] & 0xF);
 #endif
-	return kIOReturnSuccess;
+		return false;
+	}
+	depth = (p[SD_STATUS_PERF_ENHANCE] >> 3) + 1;
+
+	/* Walk the general information page for the performance enhancement function */
+	if (dataCommand_pio(slot, SD_READ_EXTR_SINGLE, SDCR48,
+			SD_EXTR_ARG(0, 0, 0, 512), buff, 512, true) != kIOReturnSuccess)
+		return false;
+	next = 16;
+	for (int i = 0; i < p[4] && next + 48 <= 512; i++) {
+		UInt16 sfc = p[next] | (p[next + 1] << 8);
+		UInt32 regAddr = p[next + 44] | (p[next + 45] << 8) |
+				(p[next + 46] << 16) | (p[next + 47] << 24);
+		if (sfc == SD_EXT_SFC_PERF) {
+			fno = (regAddr >> 18) & 0xF;
+			page = (regAddr >> 9) & 0xFF;
+			off = regAddr & 0x1FF;
+			found = true;
+			break;
+		}
+		next = p[next + 40] | (p[next + 41] << 8);
+		if (next == 0)
+			break;
+	}
+	if (! found)
+		return false;
+
+	/* Enable the queue and read it back */
+	bzero(buff, sizeof(buff));
+	p[0] = 1;
+	if (dataCommand_pio(slot, SD_WRITE_EXTR_SINGLE, SDCR49,
+			SD_EXTR_ARG(fno, page, off + SD_EXT_PERF_CMDQ_ENABLE, 1),
+			buff, 512, false) != kIOReturnSuccess)
+		return false;
+	if (dataCommand_pio(slot, SD_READ_EXTR_SINGLE, SDCR48,
+			SD_EXTR_ARG(fno, page, off, 512), buff, 512, true) != kIOReturnSuccess)
+		return false;
+	if (! (p[SD_EXT_PERF_CMDQ_ENABLE] & 1)) {
+		IOLog("VoodooSDHCI: card refused command queue enable\n");
+		return false;
+	}
+	cmdqDepth = MIN(depth, MIN((p[SD_EXT_PERF_CMDQ_SUPPORT] & 0x1F) + 1, CMDQ_MAX_DEPTH));
+	IOLog("VoodooSDHCI: A2 command queue enabled, depth %d\n", cmdqDepth);
+	return true;
 }
 
-IOReturn VoodooSDHC::doFormatMedia(UInt64 byteCapacity) {
+/*
+ * mmcInit:  Initialize an MMC or eMMC card.  Called from cardInit once the
+ *	     card has failed to answer the SD commands and has been put back
+ *	     in the idle state.  On MMC 4.x cards, reads EXT_CSD for the
+ *	     capacity and switches to the fastest timing and widest bus both
+ *	     sides support.
+ *	UInt8 slot:  Which slot the card is in.
+ */
+bool VoodooSDHC::mmcInit(UInt8 slot)
+{
+	UInt32 ext[EXT_CSD_SIZE / sizeof(UInt32)];
+	UInt8 *p = (UInt8 *)ext;
+	UInt8 specVers, best;
+	UInt32 sectors;
+	int i;
+
+	isMMC = true;
+	mmcCardType = 0;
+	mmcTiming = kMMCTimingLegacy;
+	mmcTuned = false;
+	mmcBusDDR = false;
+	this->PCIRegP[slot]->ErrorIntStatus = 0xf3ff;
+	for (i = 0; i < 100; i++) {
+		SDCommand(slot, SD_SEND_OP_COND, R3, MMC_OCR_SECTOR_MODE | MMC_OCR_VDD_27_36);
+		if (! waitIntStatus(slot, CmdComplete)) {
+			IOLog("VoodooSDHCI: no response from CMD_1 -- no card?\n");
+			return false;
+		}
+		if (this->PCIRegP[slot]->Response[0] & MMC_CARD_BUSY)
+			break;
+		IODelay(10000);
+	}
+	if (i == 100) {
+		IOLog("VoodooSDHCI: MMC card did not finish power up: 0x%08x\n", PCIRegP[slot]->Response[0]);
+		return false;
+	}
+	isHighCapacity = (this->PCIRegP[slot]->Response[0] & MMC_OCR_SECTOR_MODE) != 0;
+	IOLog("VoodooSDHCI: initializing MMC card%s\n", isHighCapacity ? " (sector addressed)" : "");
+
+	SDCommand(slot, SD_ALL_SEND_CID, SDCR2, 0);
+	IODelay(1000);
+	parseCID(slot);
+	cardQuirksInit(slot);
+	cardCacheFind(slot);
+	// MMC cards take their address from the host
+	this->RCA = MMC_DEFAULT_RCA;
+	SDCommand(slot, SD_SET_RELATIVE_ADDR, R1, this->RCA << 16);
+	IODelay(1000);
+	calcClock(slot, 20000000);
+	SDCommand(slot, SD_SEND_CSD, SDCR9, this->RCA << 16);
+	IODelay(10000);
+	parseCSD(slot);
+	specVers = (UInt8)((this->PCIRegP[slot]->Response[3] >> 18) & 0xF);
+	// SET_BLOCK_COUNT came with MMC 3.1
+	cmd23 = specVers >= CSD_SPEC_VER_3;
+	if (specVers < CSD_SPEC_VER_4)
+		cardCacheCheck(slot);
+	SDCommand(slot, SD_SELECT_CARD, SDCR7, this->RCA << 16);
+	IODelay(10000);
+
+	if (specVers >= CSD_SPEC_VER_4) {
+		if (! mmcReadExtCSD(slot, p))
+			return false;
+		mmcCardType = p[EXT_CSD_CARD_TYPE];
+		sectors = p[EXT_CSD_SEC_CNT] | (p[EXT_CSD_SEC_CNT + 1] << 8) |
+			(p[EXT_CSD_SEC_CNT + 2] << 16) | (p[EXT_CSD_SEC_CNT + 3] << 24);
+		if (sectors != 0)
+			maxBlock = sectors - 1;
+		cardCacheCheck(slot);
+		IOLog("VoodooSDHCI: EXT_CSD rev %d, card type 0x%02x, %u sectors\n",
+			p[EXT_CSD_REV], mmcCardType, (unsigned)(maxBlock + 1));
+
+		// Do not try again for a timing this card has failed to reach
+		best = mmcBestTiming(slot);
+		if (cardCacheEntry != NULL && cardCacheEntry->timing < best)
+			best = cardCacheEntry->timing;
+		if (best >= kMMCTimingHS200 && mmcSelectHS200(slot, p)) {
+			if (best == kMMCTimingHS400 && ! mmcSelectHS400(slot))
+				IOLog("VoodooSDHCI: staying in HS200\n");
+		} else {
+			if (best < kMMCTimingHS || ! mmcSetTiming(slot, kMMCTimingHS))
+				calcClock(slot, 26000000);
+			if (! mmcSetBusWidth(slot, p))
+				IOLog("VoodooSDHCI: staying in 1 bit mode\n");
+		}
+	}
+
+	this->PCIRegP[slot]->BlockSize = 512;
+	this->PCIRegP[slot]->BlockCount = 1;
+	LEDControl(slot, true);
+	if (USE_CQHCI && USE_SDMA && specVers >= CSD_SPEC_VER_4)
+		cqhciInit(slot, p);
+	cardCacheStore(slot);
+	return true;
+}
+
+/*
+ * mmcSwitch:  Write one byte of an MMC card's EXT_CSD with CMD6 and wait
+ *	       for the card to finish.  Returns true if the card took it.
+ *	UInt8 slot:  Which slot the card is in.
+ *	UInt8 index:  EXT_CSD byte to write
+ *	UInt8 value:  Value to write
+ */
+bool VoodooSDHC::mmcSwitch(UInt8 slot, UInt8 index, UInt8 value)
+{
+	this->PCIRegP[slot]->NormalIntStatus = CmdComplete | XferComplete;
+	this->PCIRegP[slot]->ErrorIntStatus = 0xf3ff;
+	SDCommand(slot, SD_SWITCH, R1b, (MMC_SWITCH_MODE_WRITE_BYTE << 24) |
+		(index << 16) | (value << 8) | EXT_CSD_CMD_SET_NORMAL);
+	// The end of the R1b busy period shows up as transfer complete
+	if (! waitIntStatus(slot, CmdComplete) || ! waitIntStatus(slot, XferComplete))
+		goto fail;
+	SDCommand(slot, SD_SEND_STATUS, SDCR13, this->RCA << 16);
+	if (! waitIntStatus(slot, CmdComplete))
+		goto fail;
+	if (this->PCIRegP[slot]->Response[0] & R1_SWITCH_ERROR) {
+		IOLog("VoodooSDHCI: MMC switch of EXT_CSD[%d] to %d refused\n", index, value);
+		return false;
+	}
+	return true;
+fail:
+	IOLog("VoodooSDHCI: MMC switch of EXT_CSD[%d] to %d failed: Error: 0x%x\n",
+		index, value, PCIRegP[slot]->ErrorIntStatus);
+	Reset(slot, CMD_RESET);
+	Reset(slot, DAT_RESET);
+	return false;
+}
+
+/*
+ * mmcReadExtCSD:  Read an MMC card's 512 byte EXT_CSD register.
+ *	UInt8 slot:  Which slot the card is in.
+ *	UInt8 *ext:  EXT_CSD_SIZE bytes, 4 byte aligned
+ */
+bool VoodooSDHC::mmcReadExtCSD(UInt8 slot, UInt8 *ext)
+{
+	return dataCommand_pio(slot, SD_SEND_EXT_CSD, R1, 0, (UInt32 *)ext,
+			EXT_CSD_SIZE, true) == kIOReturnSuccess;
+}
+
+/*
+ * mmcSetBusWidth:  Switch an MMC card to the widest bus the host has, 8
+ *		    then 4 bits, and to DDR on top of high speed timing when
+ *		    both sides can do it.  Each width is checked by reading
+ *		    EXT_CSD back over the new bus, as MMC has no bus test
+ *		    result we could trust on every card.
+ *	UInt8 slot:  Which slot the card is in.
+ *	const UInt8 *ext:  EXT_CSD as read in 1 bit mode
+ */
+bool VoodooSDHC::mmcSetBusWidth(UInt8 slot, const UInt8 *ext)
+{
+	static const UInt8 widths[] = { EXT_CSD_BUS_WIDTH_8, EXT_CSD_BUS_WIDTH_4 };
+	UInt32 check[EXT_CSD_SIZE / sizeof(UInt32)];
+	UInt8 *p = (UInt8 *)check;
+	bool ddr;
+
+	ddr = (mmcCardType & EXT_CSD_CARD_TYPE_DDR_1_8V) &&
+		mmcTiming == kMMCTimingHS &&
+		hostSpec[slot] >= SDHCI_SPEC_300 &&
+		(this->PCIRegP[slot]->Capabilities[1] & SDHCI_SUPPORT_DDR50);
+
+	for (int i = 0; i < sizeof(widths); i++) {
+		UInt8 width = widths[i];
+		UInt8 ctrl = width == EXT_CSD_BUS_WIDTH_8 ? SDHCI_CTRL_8BITBUS : SDHCI_CTRL_4BITBUS;
+
+		if (width == EXT_CSD_BUS_WIDTH_8 &&
+		    ! (this->PCIRegP[slot]->Capabilities[0] & CR8BitSupport))
+			continue;
+		if (! mmcSwitch(slot, EXT_CSD_BUS_WIDTH, width))
+			continue;
+		setHostControl(slot, SDHCI_CTRL_4BITBUS | SDHCI_CTRL_8BITBUS, ctrl);
+		if (mmcReadExtCSD(slot, p) &&
+		    memcmp(p + EXT_CSD_SEC_CNT, ext + EXT_CSD_SEC_CNT, 4) == 0 &&
+		    p[EXT_CSD_CARD_TYPE] == ext[EXT_CSD_CARD_TYPE] &&
+		    p[EXT_CSD_REV] == ext[EXT_CSD_REV]) {
+			IOLog("VoodooSDHCI: MMC bus is %d bits wide\n", width == EXT_CSD_BUS_WIDTH_8 ? 8 : 4);
+			if (ddr && mmcSetTiming(slot, kMMCTimingDDR52))
+				IOLog("VoodooSDHCI: MMC running DDR52\n");
+			return true;
+		}
+		// Did not survive the switch; back to 1 bit and try the next one
+		mmcSwitch(slot, EXT_CSD_BUS_WIDTH, EXT_CSD_BUS_WIDTH_1);
+		setHostControl(slot, SDHCI_CTRL_4BITBUS | SDHCI_CTRL_8BITBUS, 0);
+	}
+	return false;
+}
+
+/*
+ * Timing changes an MMC card accepts (JESD84-B51 6.6.2).  DDR52 is entered
+ * from HS, HS400 only from HS after HS200 tuning, and every timing may
+ * drop back to legacy or HS.
+ */
+static const UInt8 mmcTimingNext[] = {
+	/* kMMCTimingLegacy */	(1 << kMMCTimingHS) | (1 << kMMCTimingHS200),
+	/* kMMCTimingHS */	(1 << kMMCTimingLegacy) | (1 << kMMCTimingDDR52) |
+				(1 << kMMCTimingHS200) | (1 << kMMCTimingHS400),
+	/* kMMCTimingDDR52 */	(1 << kMMCTimingLegacy) | (1 << kMMCTimingHS),
+	/* kMMCTimingHS200 */	(1 << kMMCTimingLegacy) | (1 << kMMCTimingHS),
+	/* kMMCTimingHS400 */	(1 << kMMCTimingLegacy) | (1 << kMMCTimingHS),
+};
+
+/*
+ * mmcBestTiming:  Pick the fastest timing both the card (EXT_CSD card type)
+ *		   and the host (SDHCI 3.0 capabilities) support.  DDR52 is
+ *		   not returned; mmcSetBusWidth adds it on top of HS.
+ *	UInt8 slot:  Which slot the card is in.
+ */
+UInt8 VoodooSDHC::mmcBestTiming(UInt8 slot)
+{
+	bool uhs = hostSpec[slot] >= SDHCI_SPEC_300 &&
+		(this->PCIRegP[slot]->Capabilities[1] & SDHCI_SUPPORT_SDR104);
+
+#ifdef MMC_HS400_MODE
+	if (uhs && (mmcCardType & EXT_CSD_CARD_TYPE_HS400_1_8V) &&
+	    (this->PCIRegP[slot]->Capabilities[0] & CR8BitSupport))
+		return kMMCTimingHS400;
+#endif
+	if (uhs && (mmcCardType & EXT_CSD_CARD_TYPE_HS200_1_8V))
+		return kMMCTimingHS200;
+	if ((mmcCardType & EXT_CSD_CARD_TYPE_52) &&
+	    (this->PCIRegP[slot]->Capabilities[0] & HighSpSupport))
+		return kMMCTimingHS;
+	return kMMCTimingLegacy;
+}
+
+/*
+ * mmcSetTiming:  Move an MMC card and the host to a new bus timing.  Refuses
+ *		  changes the card would not accept from its current timing.
+ *		  DDR timings switch the bus width to its DDR encoding; leaving
+ *		  them switches it back.  Dropping out of HS200/HS400 first
+ *		  takes the host down to HS at 52MHz.
+ *	UInt8 slot:  Which slot the card is in.
+ *	UInt8 timing:  kMMCTiming* to move to
+ */
+bool VoodooSDHC::mmcSetTiming(UInt8 slot, UInt8 timing)
+{
+	static const UInt8 hsTiming[] = {
+		EXT_CSD_TIMING_BC, EXT_CSD_TIMING_HS, EXT_CSD_TIMING_HS,
+		EXT_CSD_TIMING_HS200, EXT_CSD_TIMING_HS400
+	};
+	bool wide8 = shadow[slot].hostControl & SDHCI_CTRL_8BITBUS;
+	bool ddr = timing == kMMCTimingDDR52 || timing == kMMCTimingHS400;
+
+	if (! (mmcTimingNext[mmcTiming] & (1 << timing)) ||
+	    (timing == kMMCTimingHS400 && (! mmcTuned || ! wide8))) {
+		IOLog("VoodooSDHCI: illegal MMC timing change %d -> %d\n", mmcTiming, timing);
+		return false;
+	}
+	// The CMD6s below must not go out at 200MHz once the card leaves HS200
+	if (mmcTiming >= kMMCTimingHS200 && timing < kMMCTimingHS200)
+		mmcSetHostTiming(slot, kMMCTimingHS);
+	if (ddr) {
+		if (! mmcSwitch(slot, EXT_CSD_BUS_WIDTH,
+				wide8 ? EXT_CSD_DDR_BUS_WIDTH_8 : EXT_CSD_DDR_BUS_WIDTH_4))
+			return false;
+		// Tracked apart from mmcTiming: the HS_TIMING switch may still fail
+		mmcBusDDR = true;
+	}
+	if (timing != kMMCTimingDDR52 && ! mmcSwitch(slot, EXT_CSD_HS_TIMING, hsTiming[timing]))
+		return false;
+	if (mmcBusDDR && ! ddr &&
+	    (shadow[slot].hostControl & (SDHCI_CTRL_4BITBUS | SDHCI_CTRL_8BITBUS))) {
+		if (! mmcSwitch(slot, EXT_CSD_BUS_WIDTH,
+				wide8 ? EXT_CSD_BUS_WIDTH_8 : EXT_CSD_BUS_WIDTH_4))
+			return false;
+		mmcBusDDR = false;
+	}
+	mmcSetHostTiming(slot, timing);
+	mmcTiming = timing;
+	return true;
+}
+
+/*
+ * mmcSetHostTiming:  Program the host side of an MMC bus timing: high speed
+ *		      enable, the SDHCI 3.0 UHS mode and the card clock.
+ *	UInt8 slot:  Which slot the card is in.
+ *	UInt8 timing:  kMMCTiming* to program
+ */
+void VoodooSDHC::mmcSetHostTiming(UInt8 slot, UInt8 timing)
+{
+	static const UInt16 uhsMode[] = {
+		SDHCI_CTRL_UHS_SDR12, SDHCI_CTRL_UHS_SDR12, SDHCI_CTRL_UHS_DDR50,
+		SDHCI_CTRL_UHS_SDR104, SDHCI_CTRL_HS400
+	};
+	static const UInt32 clock[] = {
+		26000000, 52000000, 52000000, 200000000, 200000000
+	};
+
+	setHostControl(slot, SDHCI_CTRL_HISPD, timing == kMMCTimingLegacy ? 0 : SDHCI_CTRL_HISPD);
+	if (hostSpec[slot] >= SDHCI_SPEC_300)
+		setHostControl2(slot, SDHCI_CTRL_UHS_MASK, uhsMode[timing]);
+	calcClock(slot, clock[timing]);
+}
+
+/*
+ * mmcSelectHS200:  Bring an MMC card to HS200: widest SDR bus, 1.8V
+ *		    signalling, HS200 timing at 200MHz, then sampling point
+ *		    tuning with CMD21.  Leaves the card in legacy timing and
+ *		    the host at 3.3V signalling if any step fails.
+ *	UInt8 slot:  Which slot the card is in.
+ *	const UInt8 *ext:  EXT_CSD as read in 1 bit mode
+ */
+bool VoodooSDHC::mmcSelectHS200(UInt8 slot, const UInt8 *ext)
+{
+	mmcTuned = false;
+	// HS200 needs a 4 or 8 bit bus
+	if (! mmcSetBusWidth(slot, ext))
+		return false;
+	setHostControl2(slot, 0, SDHCI_CTRL_VDD_180);
+	IODelay(5000);
+	if (! (this->PCIRegP[slot]->HostControl2 & SDHCI_CTRL_VDD_180)) {
+		shadowLoad(slot);
+		IOLog("VoodooSDHCI: host would not switch to 1.8V signalling\n");
+		return false;
+	}
+	if (! mmcSetTiming(slot, kMMCTimingHS200)) {
+		// Legacy timing runs at 3.3V signalling
+		setHostControl2(slot, SDHCI_CTRL_VDD_180, 0);
+		return false;
+	}
+	if (! executeTuning(slot, SD_SEND_TUNING_BLOCK_HS200,
+			(shadow[slot].hostControl & SDHCI_CTRL_8BITBUS) ? 128 : 64)) {
+		IOLog("VoodooSDHCI: HS200 tuning failed\n");
+		mmcSetTiming(slot, kMMCTimingLegacy);
+		setHostControl2(slot, SDHCI_CTRL_VDD_180, 0);
+		return false;
+	}
+	mmcTuned = true;
+	IOLog("VoodooSDHCI: MMC running HS200\n");
+	return true;
+}
+
+/*
+ * mmcSelectHS400:  Move a tuned HS200 card to HS400.  The card has to pass
+ *		    through HS at 52MHz to change to the 8 bit DDR bus before
+ *		    HS400 timing may be selected.  Goes back to HS200 if the
+ *		    card will not take it.
+ *	UInt8 slot:  Which slot the card is in.
+ */
+bool VoodooSDHC::mmcSelectHS400(UInt8 slot)
+{
+	if (mmcTiming != kMMCTimingHS200)
+		return false;
+	if (mmcSetTiming(slot, kMMCTimingHS)) {
+		if (mmcSetTiming(slot, kMMCTimingHS400)) {
+			IOLog("VoodooSDHCI: MMC running HS400\n");
+			return true;
+		}
+		if (mmcSetTiming(slot, kMMCTimingHS200) &&
+		    executeTuning(slot, SD_SEND_TUNING_BLOCK_HS200, 128))
+			return false;
+	}
+	IOLog("VoodooSDHCI: HS400 switch failed, falling back to HS\n");
+	mmcTuned = false;
+	if (mmcTiming != kMMCTimingHS)
+		mmcSetTiming(slot, kMMCTimingHS);
+	return false;
+}
+
+/*
+ * executeTuning:  Run the SDHCI 3.0 sampling clock tuning procedure.  The
+ *		   host swallows each tuning block and only flags Buffer Read
+ *		   Ready; it clears Execute Tuning once it has found a sampling
+ *		   point.  Returns true if the tuned clock is in use.
+ *	UInt8 slot:  Which slot the card is in.
+ *	UInt8 command:  Tuning command (CMD21 for HS200)
+ *	UInt16 blkSize:  Tuning block size for the current bus width
+ */
+bool VoodooSDHC::executeTuning(UInt8 slot, UInt8 command, UInt16 blkSize)
+{
+	int i;
+
+	this->PCIRegP[slot]->BlockSize = blkSize;
+	this->PCIRegP[slot]->BlockCount = 1;
+	this->PCIRegP[slot]->TransferMode = SDHCI_TRNS_READ;
+	setHostControl2(slot, 0, SDHCI_CTRL_EXEC_TUNING);
+	for (i = 0; i < MAX_TUNING_LOOP; i++) {
+		// A CRC error on one tuning block must not fail the next
+		this->PCIRegP[slot]->NormalIntStatus = BuffReadReady | XferComplete | CmdComplete;
+		this->PCIRegP[slot]->ErrorIntStatus = 0xf3ff;
+		SDCommand(slot, command, R1, 0, true);
+		if (! waitIntStatus(slot, BuffReadReady))
+			break;
+		if (! (this->PCIRegP[slot]->HostControl2 & SDHCI_CTRL_EXEC_TUNING))
+			break;
+	}
+	if (! (this->PCIRegP[slot]->HostControl2 & SDHCI_CTRL_EXEC_TUNING) &&
+	    (this->PCIRegP[slot]->HostControl2 & SDHCI_CTRL_TUNED_CLK)) {
 #ifdef __DEBUG__
-	IOLog("VoodooSDHCI: doFormatMedia\n");
+		IOLog("VoodooSDHCI: tuned after %d blocks\n", i + 1);
 #endif
-	return kIOReturnUnsupported;
+		shadowLoad(slot);
+		return true;
+	}
+	// The host may have ended tuning by itself
+	shadowLoad(slot);
+	setHostControl2(slot, SDHCI_CTRL_EXEC_TUNING | SDHCI_CTRL_TUNED_CLK, 0);
+	Reset(slot, CMD_RESET);
+	Reset(slot, DAT_RESET);
+	return false;
 }
 
-IOReturn VoodooSDHC::doEjectMedia(void) {
+/*
+ * allocTaskBuffers:  Allocate the memory shared by the queueing engines: a
+ *		      page of descriptors followed by one bounce buffer per
+ *		      task slot, all physically contiguous.  Returns true if
+ *		      the buffers are there.
+ */
+bool VoodooSDHC::allocTaskBuffers(void)
+{
+	if (taskBuffDesc != NULL)
+		return true;
+	taskBuffDesc = IOBufferMemoryDescriptor::withCapacity(
+		PAGE_SIZE + CMDQ_MAX_DEPTH * TASK_BUFFER_SIZE, kIODirectionInOut, true);
+	if (taskBuffDesc == NULL) {
+		IOLog("VoodooSDHCI: no memory for task buffers\n");
+		return false;
+	}
+	physTaskBuff = taskBuffDesc->getPhysicalAddress();
+	virtTaskBuff = (UInt8 *)taskBuffDesc->getBytesNoCopy();
+	return true;
+}
+
+/*
+ * cqhciProbe:  Look for a command queue engine in the vendor area.  Nothing
+ *		there is written to, and CQHCIRegP is only set, once the host
+ *		has ADMA2 and the block reads back as a CQHCI: an eMMC 5.x
+ *		version, a valid interrupt coalescing timer clock and no
+ *		reserved capability bits.
+ *	UInt8 slot:  Host controller/slot number
+ */
+void VoodooSDHC::cqhciProbe(UInt8 slot)
+{
+	CQHCIRegMap_t *regs;
+	UInt32 ver, cap;
+
+	this->CQHCIRegP = NULL;
+	if (PCIRegMap->getLength() < CQHCI_OFFSET + sizeof(CQHCIRegMap_t) ||
+	    ! (this->PCIRegP[slot]->Capabilities[0] & SDHCI_CAN_DO_ADMA2))
+		return;
+	regs = (CQHCIRegMap_t *)((UInt8 *)PCIRegMap->getVirtualAddress() + CQHCI_OFFSET);
+	ver = regs->CQVER;
+	cap = regs->CQCAP;
+	if (ver == 0xFFFFFFFF || CQVER_MAJOR(ver) != 5 || (cap & CQCAP_RESERVED) ||
+	    CQCAP_ITCFVAL(cap) == 0 || CQCAP_ITCFMUL(cap) > 4)
+		return;
+	this->CQHCIRegP = regs;
 #ifdef __DEBUG__
-	IOLog("VoodooSDHCI: doEjectMedia\n");
+	IOLog("VoodooSDHCI: command queue engine version 0x%x\n", (int)ver);
 #endif
-	return kIOReturnUnsupported;
 }
 
-bool VoodooSDHC::waitIntStatus(UInt32 maskBits)
+/*
+ * cqhciInit:  Turn on command queueing in an eMMC 5.1 card and hand block
+ *	       I/O over to the host's command queue engine.  The card has to
+ *	       advertise CMDQ_SUPPORT and the host has to have a CQHCI block
+ *	       with ADMA2, since the engine fetches data through ADMA2
+ *	       descriptors.  Each task slot gets its own bounce buffer.
+ *	       Returns true if the engine is running.
+ *	UInt8 slot:  Which slot the card is in.
+ *	const UInt8 *ext:  The card's EXT_CSD
+ */
+bool VoodooSDHC::cqhciInit(UInt8 slot, const UInt8 *ext)
 {
-	// roughly 5 seconds before timeout
-	for (int cnt = 0; cnt < 500000; cnt++) {
-		while (1) {
-			UInt32 nis = PCIRegP[0]->NormalIntStatus;
-			if (nis & ErrorInterrupt) {
-				return false;
+	UInt8 depth;
+
+	cqeDepth = 0;
+	if (this->CQHCIRegP == NULL || ext[EXT_CSD_REV] < 8 ||
+	    ! (ext[EXT_CSD_CMDQ_SUPPORT] & 0x1) ||
+	    (quirks & (kSDQuirkBrokenDMA | kSDQuirkBrokenADMA | kSDQuirkBrokenMultiBlock)))
+		return false;
+	if (! allocTaskBuffers())
+		return false;
+	if (! mmcSwitch(slot, EXT_CSD_CMDQ_MODE_EN, 1)) {
+		IOLog("VoodooSDHCI: card refused command queueing\n");
+		return false;
+	}
+	depth = MIN((ext[EXT_CSD_CMDQ_DEPTH] & 0x1F) + 1, CMDQ_MAX_DEPTH);
+
+	setHostControl(slot, SDHCI_CTRL_DMA_MASK, SDHCI_CTRL_ADMA32);
+	this->PCIRegP[slot]->BlockSize = 512;
+	this->PCIRegP[slot]->TimeoutControl = 0xe;
+
+	this->CQHCIRegP->CQCFG = 0;
+	bzero(virtTaskBuff, PAGE_SIZE);
+	::OSSynchronizeIO();
+	this->CQHCIRegP->CQTDLBA = physTaskBuff;
+	this->CQHCIRegP->CQTDLBAU = 0;
+	this->CQHCIRegP->CQSSC2 = this->RCA;
+	// Let completions pile up a little before interrupting
+	this->CQHCIRegP->CQIC = CQICEnable | CQICCounterRst |
+		CQICThreshWEn | CQIC_THRESH(CQHCI_IC_THRESHOLD) |
+		CQICTimeoutWEn | CQIC_TIMEOUT(CQHCI_IC_TIMEOUT);
+	this->CQHCIRegP->CQIS = this->CQHCIRegP->CQIS;
+	this->CQHCIRegP->CQISTE = CQTaskCleared | CQRespErrDet | CQTaskComplete | CQHaltComplete;
+	this->CQHCIRegP->CQISGE = 0;
+	this->CQHCIRegP->CQCFG = CQEnable;
+	this->CQHCIRegP->CQCTL = 0;
+
+	cqeDepth = depth;
+	IOLog("VoodooSDHCI: command queue engine v%x.%02x enabled, depth %d\n",
+		(int)CQVER_MAJOR(this->CQHCIRegP->CQVER), (int)(this->CQHCIRegP->CQVER & 0xFF), depth);
+	return true;
+}
+
+/*
+ * cqhciDisable:  Stop the command queue engine and take the card out of
+ *		  command queueing so that plain CMD18/CMD25 work again.
+ *	UInt8 slot:  Which slot the card is in.
+ */
+void VoodooSDHC::cqhciDisable(UInt8 slot)
+{
+	if (cqeDepth == 0)
+		return;
+	cqeDepth = 0;
+	this->CQHCIRegP->CQCTL = CQHalt;
+	waitReg<UInt32>(slot, &this->CQHCIRegP->CQCTL, CQHalt, true, 100000, "command queue halt");
+	this->CQHCIRegP->CQCFG = 0;
+	this->CQHCIRegP->CQIS = this->CQHCIRegP->CQIS;
+	setHostControl(slot, SDHCI_CTRL_DMA_MASK, SDHCI_CTRL_SDMA);
+	if (! mmcSwitch(slot, EXT_CSD_CMDQ_MODE_EN, 0))
+		IOLog("VoodooSDHCI: card would not leave command queueing\n");
+	else
+		IOLog("VoodooSDHCI: command queue engine disabled\n");
+}
+
+/*
+ * cqhciPause:  Halt the command queue engine so that legacy commands go
+ *		straight to the card.  The card leaves command queueing too
+ *		if the command moves data, since it will not take CMD17/18 or
+ *		CMD24/25 while queueing.  Returns false, with the engine
+ *		running again, if the card would not leave queueing.
+ *	UInt8 slot:  Which slot the card is in.
+ *	bool data:  The commands to come move data
+ */
+bool VoodooSDHC::cqhciPause(UInt8 slot, bool data)
+{
+	this->CQHCIRegP->CQCTL = CQHalt;
+	waitReg<UInt32>(slot, &this->CQHCIRegP->CQCTL, CQHalt, true, 100000, "command queue halt");
+	if (data && ! mmcSwitch(slot, EXT_CSD_CMDQ_MODE_EN, 0)) {
+		this->CQHCIRegP->CQCTL = 0;
+		return false;
+	}
+	return true;
+}
+
+/*
+ * cqhciResume:  Undo cqhciPause and let the engine run again.
+ *	UInt8 slot:  Which slot the card is in.
+ *	bool data:  The card was taken out of command queueing
+ */
+void VoodooSDHC::cqhciResume(UInt8 slot, bool data)
+{
+	if (data && ! mmcSwitch(slot, EXT_CSD_CMDQ_MODE_EN, 1)) {
+		IOLog("VoodooSDHCI: card would not go back to command queueing\n");
+		cqeDepth = 0;
+		this->CQHCIRegP->CQCFG = 0;
+		setHostControl(slot, SDHCI_CTRL_DMA_MASK, SDHCI_CTRL_SDMA);
+		return;
+	}
+	// Raw transfers may have left the host in another DMA mode
+	setHostControl(slot, SDHCI_CTRL_DMA_MASK, SDHCI_CTRL_ADMA32);
+	this->PCIRegP[slot]->BlockSize = 512;
+	this->CQHCIRegP->CQCTL = 0;
+}
+
+/*
+ * cqhciRecover:  Error recovery for the command queue engine.  Halts the
+ *		  engine, clears every task in the host, discards the card's
+ *		  queue and lets the engine run again with an empty task list.
+ *	UInt8 slot:  Which slot the card is in.
+ */
+void VoodooSDHC::cqhciRecover(UInt8 slot)
+{
+	this->CQHCIRegP->CQCTL = CQHalt;
+	waitReg<UInt32>(slot, &this->CQHCIRegP->CQCTL, CQHalt, true, 100000, "command queue halt");
+	this->CQHCIRegP->CQCTL = CQHalt | CQClearAllTasks;
+	waitReg<UInt32>(slot, &this->CQHCIRegP->CQTDBR, 0xFFFFFFFF, false, 100000, "command queue clear");
+	this->CQHCIRegP->CQTCN = this->CQHCIRegP->CQTCN;
+	this->CQHCIRegP->CQIS = this->CQHCIRegP->CQIS;
+	Reset(slot, CMD_RESET);
+	Reset(slot, DAT_RESET);
+
+	// The engine is halted, so legacy commands go straight to the card
+	this->PCIRegP[slot]->NormalIntStatus = CmdComplete | XferComplete;
+	this->PCIRegP[slot]->ErrorIntStatus = 0xf3ff;
+	SDCommand(slot, MMC_CMDQ_TASK_MGMT, R1b, MMC_CMDQ_DISCARD_QUEUE);
+	// R1b: the discard is done when the card lets go of DAT0
+	if (! waitIntStatus(slot, CmdComplete) || ! waitIntStatus(slot, XferComplete)) {
+		IOLog("VoodooSDHCI: card did not discard its queue\n");
+		Reset(slot, CMD_RESET);
+		Reset(slot, DAT_RESET);
+	}
+
+	this->CQHCIRegP->CQCTL = 0;
+}
+
+/*
+ * reportRemovability:  Apple API function.  An SD Card is a removeable
+ *		        device.  Returns an I/O success.
+ *	bool *isRemovable:  Passed back.  Always return true.
+ */
+IOReturn VoodooSDHC::reportRemovability(bool *isRemovable) {
+	*isRemovable = true;
+#ifdef __DEBUG__
+	IOLog("VoodooSDHCI: reportRemovability\n");
+#endif
+	return kIOReturnSuccess;
+}
+
+/*
+ * reportWriteProtection:  Apple API function.  Returns whether the card is
+ *		write protected.  Returns an I/O success.
+ *	bool *isWriteProtected:  Passed back.  Always return true.
+ */
+IOReturn VoodooSDHC::reportWriteProtection(bool *isWriteProtected) {
+// XXX - how is this supposed to work for multi-slot???
+	*isWriteProtected = isCardWP( 0 );
+	//*isWriteProtected = true;
+#ifdef __DEBUG__
+	IOLog("VoodooSDHCI: reportWriteProtection\n");
+#endif
+	return kIOReturnSuccess;
+}
+
+/*
+ * setWriteCacheState:  Apple API function.  This driver does not support
+ *			write cacheing.	 Returns an I/O success.
+ *		bool enabled:  Enable/disable cache
+ */
+IOReturn VoodooSDHC::setWriteCacheState(bool enabled) {
+#ifdef __DEBUG__
+	IOLog("VoodooSDHCI: setWriteCacheState\n");
+#endif
+	return kIOReturnSuccess;
+}
+
+/*
+ * reportPollRequirements:  Apple API function.  Report back requirements for
+ *                          polling.  This driver must be polled, but the poll
+ *			    is cheap.
+ *	bool *pollRequired:  This is a return value from this function
+ *	bool *pollIsExpensive:  This is a return value from this function
+ */
+IOReturn VoodooSDHC::reportPollRequirements(bool *pollRequired, bool *pollIsExpensive)
+{
+	*pollRequired = false;
+	*pollIsExpensive = false;
+	return kIOReturnSuccess;
+}
+
+IOReturn VoodooSDHC::reportMediaState(bool *mediaPresent, bool *changedState)
+{
+	IOLockLock(mediaStateLock);
+	
+	bool presence = isCardPresent(0);
+	if (cardPresence == kCardRemount) {
+		*changedState = true;
+		cardPresence = kCardNotPresent;
+	} else if ((cardPresence == kCardIsPresent) == presence) {
+		*changedState = false;
+	} else {
+		*changedState = true;
+		if (presence) {
+			degrade = 0;
+			cleanRun = 0;
+			setProperty(kVoodooSDHCDegradeKey, degrade, 8);
+			Reset(0, FULL_RESET);
+			cardInit(0);
+			tuneCard(0);
+			::OSSynchronizeIO();
+			cardPresence = kCardIsPresent;
+		} else {
+			cardPresence = kCardNotPresent;
+		}
+	}
+	*mediaPresent = cardPresence == kCardIsPresent;
+
+	IOLockUnlock(mediaStateLock);
+	return kIOReturnSuccess;
+}
+
+#ifndef __LP64__
+IOReturn VoodooSDHC::reportMaxWriteTransfer(UInt64 blockSize,
+								UInt64 *max) {
+	//Max blocks we can read at once (see Block Count Register)
+	*max = (tuning.writeBlocks ? tuning.writeBlocks : 64) * blockSize;
+
+#ifdef __DEBUG__
+	IOLog("VoodooSDHCI: reportMaxWriteTransfer\n");
+#endif /* end DEBUG */
+
+	return kIOReturnSuccess;
+}
+
+IOReturn VoodooSDHC::reportMaxReadTransfer (UInt64 blockSize,
+											UInt64 *max) {
+	//Max blocks we can read at once (see Block Count Register)
+	*max = 65536 * blockSize;
+	
+#ifdef __DEBUG__
+	IOLog("VoodooSDHCI: reportMaxReadTransfer\n");
+#endif /* end DEBUG */
+	
+	return kIOReturnSuccess;
+}
+#endif /* !__LP64__ */
+
+IOReturn VoodooSDHC::reportMaxValidBlock(UInt64 *maxBlock) {
+	*maxBlock = this->maxBlock;
+
+#ifdef __DEBUG__
+	IOLog("VoodooSDHCI: reportMaxValidBlock\n");
+#endif
+
+	return kIOReturnSuccess;
+}
+
+IOReturn VoodooSDHC::reportLockability(bool *isLockable) {
+	*isLockable = false;
+#ifdef __DEBUG__
+	IOLog("VoodooSDHCI: reportLockability\n");
+#endif
+	return kIOReturnSuccess;
+}
+
+IOReturn VoodooSDHC::reportEjectability(bool *isEjectable) {
+	*isEjectable = false;
+#ifdef __DEBUG__
+	IOLog("VoodooSDHCI: reportEjectability\n");
+#endif
+	return kIOReturnSuccess;
+}
+
+
+IOReturn VoodooSDHC::reportBlockSize(UInt64 *blockSize) {
+	// Read/write block size is always 512 bytes.  Card's block size
+	// is reported but only used in computations of size, not access.
+	*blockSize = 512;
+#ifdef __DEBUG__
+	IOLog("VoodooSDHCI: reportBlockSize:  %d\n", *blockSize);
+#endif
+	return kIOReturnSuccess;
+}
+
+IOReturn VoodooSDHC::getWriteCacheState(bool *enabled) {
+	*enabled = false;
+#ifdef __DEBUG__
+	IOLog("VoodooSDHCI: getWriteCacheState\n");
+#endif
+	return kIOReturnSuccess;
+}
+
+char * VoodooSDHC::getVendorString(void) {
+#ifdef __DEBUG__
+	IOLog("VoodooSDHCI: getVendorString\n");
+#endif
+	return("Generic");
+}
+
+char * VoodooSDHC::getRevisionString(void) {
+#ifdef __DEBUG__
+	IOLog("VoodooSDHCI: getRevisionString\n");
+#endif
+	return("2");
+}
+
+char * VoodooSDHC::getProductString(void) {
+#ifdef __DEBUG__
+	IOLog("VoodooSDHCI: getProductString\n");
+#endif
+	return("SDHCI Controller");
+}
+
+char * VoodooSDHC::getAdditionalDeviceInfoString(void) {
+#ifdef __DEBUG__
+	IOLog("VoodooSDHCI: getAdditionalDeviceInfoString\n");
+#endif
+	return("VoodooSDHCI:getAdditionalDeviceInfoString");
+}
+
+IOReturn VoodooSDHC::doSynchronizeCache(void) {
+#ifdef __DEBUG__
+	IOLog("VoodooSDHCI: doSynchronizeCache\n");
+#endif
+	return kIOReturnSuccess;
+}
+
+IOReturn VoodooSDHC::doLockUnlockMedia(bool doLock) {
+#ifdef __DEBUG__
+	IOLog("VoodooSDHCI: doLockUnlockMedia\n");
+#endif
+	return kIOReturnUnsupported;
+}
+
+UInt32 VoodooSDHC::doGetFormatCapacities(UInt64 *capacities, UInt32 capacitiesMaxCount) const {
+#ifdef __DEBUG__
+	IOLog("VoodooSDHCI: doGetFormatCapacities\n");
+#endif
+	return kIOReturnSuccess;
+}
+
+IOReturn VoodooSDHC::doFormatMedia(UInt64 byteCapacity) {
+#ifdef __DEBUG__
+	IOLog("VoodooSDHCI: doFormatMedia\n");
+#endif
+	return kIOReturnUnsupported;
+}
+
+IOReturn VoodooSDHC::doEjectMedia(void) {
+#ifdef __DEBUG__
+	IOLog("VoodooSDHCI: doEjectMedia\n");
+#endif
+	return kIOReturnUnsupported;
+}
+
+bool VoodooSDHC::waitIntStatus(UInt8 slot, UInt32 maskBits)
+{
+	UInt64 start = (maskBits & XferComplete) ? traceClock() : 0;
+	UInt32 nis;
+
+	if (! waitReg<UInt16>(slot, &PCIRegP[slot]->NormalIntStatus, maskBits | ErrorInterrupt, true,
+				INT_TIMEOUT_US, NULL)) {
+		OSIncrementAtomic(&stats[slot].timeouts);
+		return false;
+	}
+	nis = PCIRegP[slot]->NormalIntStatus;
+	if (nis & ErrorInterrupt) {
+#if USE_CMD_TRACE
+		// Error path only; the callers go on to reset the lines
+		traceCmd(slot, kSDTraceError, lastCommand[slot], maskBits, nis, 0, PCIRegP[slot]->ErrorIntStatus);
+#endif
+		return false;
+	}
+#if USE_CMD_TRACE
+	traceCmd(slot, kSDTraceStatus, lastCommand[slot], maskBits, nis,
+		(maskBits & CmdComplete) ? PCIRegP[slot]->Response[0] : 0, 0);
+#endif
+	if (start != 0)
+		statTime(slot, kSDStatBusyWait, start);
+	PCIRegP[slot]->NormalIntStatus = nis | maskBits;
+	return true;
+}
+
+/*
+ * readBlockMulti_pio:  Read a set of blocks using multi-block reads and PIO
+ *                      not DMA mode.  The host controller must be locked when
+ *			this function is called.
+ *		IOMemoryDescriptor *buffer:  Buffer operation class.  Defines
+ *				read/write, address of operation, etc.
+ *		UInt32 block:  Block offset to read/write
+ *		UInt32 nblks:  Block count to read/write
+ *		UInt32 offset:  Offset from beginning of transfer - where in
+ *				final buffer we should begin placing data
+ *		UInt8 *mapped:  buffer mapped into the kernel, or NULL to
+ *				copy through a bounce block
+ */
+IOReturn VoodooSDHC::readBlockMulti_pio(IOMemoryDescriptor *buffer,
+					UInt32 block, UInt32 nblks,
+					UInt32 offset, UInt8 *mapped) {
+	UInt8 buff[512];	// Temporary storage for one block
+	UInt32 *pBuff;
+	IOReturn ret = kIOReturnError;
+
+#ifdef __DEBUG__
+	IOLog("VoodooSDHCI: readBlockMulti_pio:  block = %d, nblks = %d\n", block, nblks);
+#endif /* __DEBUG__ */
+
+	pBuff = (UInt32*)buff;
+
+	if (quirks & kSDQuirkResetPerCommand) {
+		Reset(0, CMD_RESET);
+		Reset(0, DAT_RESET);
+	}
+
+	/* Enable all interrupts */
+	this->PCIRegP[0]->NormalIntStatusEn = -1;
+	this->PCIRegP[0]->ErrorIntStatusEn = -1;
+
+	/* Clear pending interrupts */
+	this->PCIRegP[0]->NormalIntStatus = 
+			(BuffReadReady | XferComplete | CmdComplete);
+
+	/* Set maximum timeout value */
+	this->PCIRegP[0]->TimeoutControl = 0xe;
+
+	*(volatile UInt32 *)&(this->PCIRegP[0]->NormalIntStatus) =
+		*(volatile UInt32 *)&(this->PCIRegP[0]->NormalIntStatus);
+
+	this->PCIRegP[0]->BlockSize = 512;
+	this->PCIRegP[0]->BlockCount = nblks;
+
+	this->PCIRegP[0]->TransferMode = multiBlockMode(true, false) | transferEnd(nblks, true);
+
+	
+	// Issue read command to host controller
+	SDCommand(0, SD_READ_MULTIPLE_BLOCK, SDCR18, isHighCapacity ? block : block * 512);
+	
+	// wait for CmdComplete
+	if (! waitIntStatus(0, CmdComplete)) {
+		IOLog("VoodooSDHCI: I/O error after command 18: It Status: 0x%x\n", PCIRegP[0]->NormalIntStatus);
+		goto out;
+	}
+	
+	for (int i = 0; i < nblks; i++) {
+		// wait for BufferReadReady
+		if (! waitIntStatus(0, BuffReadReady)) {
+			IOLog("VoodooSDHCI: I/O timeout while waiting for data, Status: 0x%0x\n", PCIRegP[0]->NormalIntStatus);
+			goto out;
+			
+		}
+		/* Read block from card, straight into the client's pages if mapped */
+		if (mapped != NULL) {
+			read_block_pio(&this->PCIRegP[0]->BufferDataPort,
+				(UInt32 *)(mapped + (i + offset) * 512));
+		} else {
+			read_block_pio(&this->PCIRegP[0]->BufferDataPort, pBuff);
+			buffer->writeBytes((i + offset) * 512, buff, 1 * 512);
+		}
+	}
+	
+	// wait for transfer complete
+	if (! waitIntStatus(0, XferComplete)) {
+		IOLog("VoodooSDHCI: I/O timeout during completion... status == 0x%x\n", PCIRegP[0]->NormalIntStatus);
+	}
+	ret = kIOReturnSuccess;
+out:
+	if (stopNeeded && ! stopTransmission(0))
+		ret = kIOReturnError;
+	return ret;
+}
+
+/*
+ * sdma_access:  Read / write a set of blocks using multi-block reads in SDMA mode.
+ *                       The host controller must be locked when this function is called.
+ *		IOMemoryDescriptor *buffer:  Buffer operation class.  Defines
+ *				read/write, address of operation, etc.
+ *		UInt32 block:  Block offset to read/write
+ *		UInt32 nblks:  Block count to read/write
+ *      bool   read: true if read, false if write
+ *		UInt32 base:  Block offset of the transfer within buffer
+ */
+IOReturn VoodooSDHC::sdma_access(IOMemoryDescriptor *buffer,
+					UInt32 block, UInt32 nblks, bool read, UInt32 base) {
+#ifdef __DEBUG__
+IOLog("VoodooSDHCI readBlockMulti_sdma:  block = %d, nblks = %d\n", block, nblks);
+#endif /* __DEBUG__ */
+	if (quirks & kSDQuirkResetPerCommand) {
+		Reset(0, CMD_RESET);
+		Reset(0, DAT_RESET);
+	}
+
+	return sdma_transfer(buffer,
+		read ? SD_READ_MULTIPLE_BLOCK : SD_WRITE_MULTIPLE_BLOCK,
+		isHighCapacity ? block : block * 512, nblks, read, base);
+}
+
+/*
+ * sdma_transfer:  Issue a multi-block data command and run its data phase
+ *		   through the SDMA bounce buffer.  The host controller must
+ *		   be locked when this function is called.
+ *		IOMemoryDescriptor *buffer:  Client buffer, starting at the
+ *				first block of the transfer
+ *		UInt8 command:  SD_READ/WRITE_MULTIPLE_BLOCK or SD_Q_RD/WR_TASK
+ *		UInt32 arg:  Command argument
+ *		UInt32 nblks:  Block count to read/write
+ *      bool   read: true if read, false if write
+ *		UInt32 base:  Block offset of the transfer within buffer
+ */
+IOReturn VoodooSDHC::sdma_transfer(IOMemoryDescriptor *buffer, UInt8 command,
+					UInt32 arg, UInt32 nblks, bool read, UInt32 base) {
+	IOReturn ret = kIOReturnError;
+	IOMemoryMap *map = bounceMap(buffer, min(tuning.sdmaBoundary, nblks * 512));
+	UInt32 nis, offset = 0;
+	AbsoluteTime deadline;
+	UInt64 start;
+	UInt16 end = 0;
+
+	/* write: fill in data */
+	if (! read) {
+		bounceIn(buffer, map, (base + offset) * 512, virtSdmaBuff, min(tuning.sdmaBoundary, nblks * 512));
+		offset += min(tuning.sdmaBoundary / 512, nblks);
+	}
+	
+	/* Set maximum timeout value */
+	this->PCIRegP[0]->TimeoutControl = 0xe; // 2^27clks / 50MHz = 2.7 seconds
+
+	// A CMD23 goes out before interrupts are enabled for the transfer
+	stopNeeded = false;
+	if (command == SD_WRITE_MULTIPLE_BLOCK)
+		preErase(nblks);
+	if (command == SD_READ_MULTIPLE_BLOCK || command == SD_WRITE_MULTIPLE_BLOCK)
+		end = transferEnd(nblks, hostV4);
+
+	/* Enable all interrupts */
+	this->PCIRegP[0]->NormalIntSignalEn = 0x01ff;
+	this->PCIRegP[0]->NormalIntStatusEn = -1;
+	this->PCIRegP[0]->ErrorIntSignalEn = 0x01ff;
+	this->PCIRegP[0]->ErrorIntStatusEn = -1;
+
+	/* Clear pending interrupts */
+	this->PCIRegP[0]->NormalIntStatus = 
+			(BuffReadReady | XferComplete | CmdComplete);
+	this->PCIRegP[0]->ErrorIntStatus = 0xf3ff;
+
+	::OSSynchronizeIO();
+	setDMAAddress(0, physSdmaBuff);
+	::OSSynchronizeIO();
+	this->PCIRegP[0]->BlockSize = 512 | sdmaBoundaryBits(tuning.sdmaBoundary);
+	setBlockCount(0, nblks);
+	::OSSynchronizeIO();
+	
+	// Queued tasks carry no CMD12; the card ends them on its own
+	if (command == SD_Q_RD_TASK || command == SD_Q_WR_TASK) {
+		this->PCIRegP[0]->TransferMode =
+			(read ? SDHCI_TRNS_READ : 0) | SDHCI_TRNS_MULTI |
+			SDHCI_TRNS_BLK_CNT_EN | SDHCI_TRNS_DMA;
+	} else {
+		this->PCIRegP[0]->TransferMode = multiBlockMode(read, true) | end;
+	}
+
+	// Issue read command to host controller
+	SDCommand(0, command, SDCR18, arg, true);
+	::OSSynchronizeIO();
+	
+	// wait for CmdComplete
+	if (! waitIntStatus(0, CmdComplete)) {
+		IOLog("VoodooSDHCI: I/O error after command %d (SDMA): Status: 0x%x, Error: 0x%x\n",
+			command, PCIRegP[0]->NormalIntStatus, PCIRegP[0]->ErrorIntStatus);
+		// The caller's recovery decides how far to go from here; waitIntStatus counted a timeout
+		Reset(0, CMD_RESET);
+		Reset(0, DAT_RESET);
+		ret = kIOReturnTimeout;
+		goto out;
+	}
+	// check response
+	if (PCIRegP[0]->Response[0] & (read ? 0xcff80000 : 0xeff80000)) {
+		IOLog("VoodooSDHCI: Unexpected response from command %d (SDMA): Response: 0x%x\n",
+			command, PCIRegP[0]->Response[0]);
+		goto out;
+	}
+	
+	clock_interval_to_deadline(5000, kMillisecondScale, (uint64_t*)&deadline);
+	start = traceClock();
+	IOLockLock(sdmaCond);
+	while ((PCIRegP[0]->NormalIntStatus & ErrorInterrupt) == 0) {
+		if (IOLockSleepDeadline(sdmaCond, sdmaCond, deadline, THREAD_UNINT) == THREAD_TIMED_OUT) {
+			IOLockUnlock(sdmaCond);
+			// timeout
+			OSIncrementAtomic(&stats[0].timeouts);
+			IOLog("VoodooSDHCI: I/O timeout during SDMA transfer: Status: 0x%x, Error: 0x%x, Arg: 0x%x, Offset: %d, Blocks: %d\n",
+				PCIRegP[0]->NormalIntStatus, PCIRegP[0]->ErrorIntStatus, arg, (int)offset, (int)nblks);
+			ret = kIOReturnTimeout;
+			// Reads have handed offset blocks over, and nblks are left
+			if (command == SD_READ_MULTIPLE_BLOCK)
+				xferDone = partialBlocks(true, offset + nblks, offset);
+			else if (command == SD_WRITE_MULTIPLE_BLOCK)
+				xferDone = partialBlocks(false, nblks, 0);
+			goto out;
+		}
+		nis = PCIRegP[0]->NormalIntStatus;
+		if (nis & XferComplete) {
+			IOLockUnlock(sdmaCond);
+			statTime(0, kSDStatBusyWait, start);
+			if (read) {
+				bounceOut(buffer, map, (base + offset) * 512, virtSdmaBuff, nblks * 512);
+			}
+			PCIRegP[0]->NormalIntStatus = XferComplete | DMAInterrupt;
+			ret = kIOReturnSuccess;
+			goto out;
+		} else if (nis & DMAInterrupt) {
+			IOLockUnlock(sdmaCond);
+			statTime(0, kSDStatDMAWait, start);
+			start = traceClock();
+			if (read) {
+				bounceOut(buffer, map, (base + offset) * 512, virtSdmaBuff, tuning.sdmaBoundary);
+				offset += tuning.sdmaBoundary / 512;
+				nblks -= tuning.sdmaBoundary / 512;
+			} else {
+				bounceIn(buffer, map, (base + offset) * 512, virtSdmaBuff, min(tuning.sdmaBoundary, (nblks - offset) * 512));
+				offset += min(tuning.sdmaBoundary / 512, nblks - offset);
+			}
+			IOLockLock(sdmaCond);
+			PCIRegP[0]->NormalIntStatus = DMAInterrupt;
+			::OSSynchronizeIO();
+			setDMAAddress(0, physSdmaBuff);
+		}
+	}
+	IOLockUnlock(sdmaCond);
+	// error
+	IOLog("VoodooSDHCI: I/O error during SDMA transfer: Status: 0x%x, Error: 0x%x, Arg: 0x%x, Offset: %d, Blocks: %d\n",
+		PCIRegP[0]->NormalIntStatus, PCIRegP[0]->ErrorIntStatus, arg, (int)offset, (int)nblks);
+	goto out;
+
+	ret = kIOReturnSuccess;
+out:
+	PCIRegP[0]->NormalIntSignalEn = 0;
+	PCIRegP[0]->ErrorIntSignalEn = 0;
+	unmapClient(buffer, map);
+	if (stopNeeded && ! stopTransmission(0))
+		ret = kIOReturnError;
+	return ret;
+}		
+	
+
+	
+/*
+ * readBlockSingle_pio:  Read a single block from the card using PIO not DMA
+ *			 mode.  The host controller must be locked when this
+ *			 function is called.
+ *		UInt8 *buff:  Temporary buffer for data
+ *		UInt32 block:  Block offset to read/write
+ */
+IOReturn VoodooSDHC::readBlockSingle_pio(UInt8 *buff, UInt32 block) {
+	UInt32 *pBuff;
+	IOReturn ret;
+
+	if (quirks & kSDQuirkResetPerCommand) {
+		Reset(0, CMD_RESET);
+		Reset(0, DAT_RESET);
+	}
+
+	pBuff = (UInt32*)buff;
+
+	/* Set transfer mode to single block */
+	this->PCIRegP[0]->TransferMode = BIT4;
+
+	/* Enable interrupt flags */
+	this->PCIRegP[0]->NormalIntStatusEn = -1;
+	this->PCIRegP[0]->ErrorIntStatusEn = -1;
+
+	/* Clear pending interrupts */
+	this->PCIRegP[0]->NormalIntStatus = 
+			(BuffReadReady | XferComplete | CmdComplete);
+
+	/* Set maximum timeout value */
+	this->PCIRegP[0]->TimeoutControl = 0xe;
+
+#ifdef __DEBUG__
+	IOLog("VoodooSDHCI Int Status 0x%x Timeout = 0x%x\n",
+		*(volatile UInt32 *)&(this->PCIRegP[0]->NormalIntStatus), 
+		this->PCIRegP[0]->TimeoutControl);
+
+	//IOLog("VoodooSDHCI:  state1 = 0x%x response = 0x%x\n",
+	//	this->PCIRegP[0]->PresentState, this->PCIRegP[0]->Response[0]);
+#endif /* __DEBUG__ */
+
+	*(volatile UInt32 *)&(this->PCIRegP[0]->NormalIntStatus) =
+		*(volatile UInt32 *)&(this->PCIRegP[0]->NormalIntStatus);
+
+	SDCommand(0, SD_READ_SINGLE_BLOCK, SDCR17, isHighCapacity ? block : block * 512);
+
+	//IOLog("VoodooSDHCI:  state2 = 0x%x response = 0x%x\n",
+	//	this->PCIRegP[0]->PresentState, this->PCIRegP[0]->Response[0]);
+
+	if (! waitReg<UInt16>(0, &this->PCIRegP[0]->NormalIntStatus, BuffReadReady | ErrorInterrupt,
+				true, INT_TIMEOUT_US, "read buffer") ||
+	    (this->PCIRegP[0]->NormalIntStatus & ErrorInterrupt)) {
+		IOLog("VoodooSDHCI: S Returning error:  0x%x\n", *(volatile UInt32 *) & (this->PCIRegP[0]->NormalIntStatus));
+		ret = kIOReturnError;
+		goto out;
+	}
+
+	/* Read block from card */
+	read_block_pio(&this->PCIRegP[0]->BufferDataPort, pBuff);
+
+	ret = kIOReturnSuccess;
+
+out:
+	this->PCIRegP[0]->NormalIntStatus =
+				(BuffReadReady|XferComplete|CmdComplete);
+	return ret;
+}
+
+/*
+ * writeBlockMulti_pio:  Write multiple blocks to the card using PIO not DMA
+ *			 mode.  The host controller must be locked when this
+ *			 function is called.
+ *		IOMemoryDescriptor *buffer:  Buffer operation class.  Defines
+ *				read/write, address of operation, etc.
+ *		UInt32 block:  Block offset to read/write
+ *		UInt32 nblks:  Number of blocks to read/write
+ *		UInt32 offset:  Offset from beginning of transfer - where in
+ *				final buffer we should begin placing data
+ *		UInt8 *mapped:  buffer mapped into the kernel, or NULL to
+ *				copy through a bounce block
+ */
+IOReturn VoodooSDHC::writeBlockMulti_pio(IOMemoryDescriptor *buffer,
+				UInt32 block, UInt32 nblks, UInt32 offset, UInt8 *mapped) {
+	UInt8 buff[512];	// Temporary storage for data block
+	UInt32 *pBuff;
+	IOReturn ret;
+
+	if (quirks & kSDQuirkResetPerCommand) {
+		Reset(0, CMD_RESET);
+		Reset(0, DAT_RESET);
+	}
+	
+	this->PCIRegP[0]->NormalIntStatusEn = -1;
+	this->PCIRegP[0]->ErrorIntStatusEn = -1;
+	this->PCIRegP[0]->NormalIntStatus = 
+			BuffWriteReady | XferComplete | CmdComplete;
+	this->PCIRegP[0]->TimeoutControl = 0xe;
+
+	this->PCIRegP[0]->BlockSize = 512;
+	this->PCIRegP[0]->BlockCount = nblks;
+
+	preErase(nblks);
+	this->PCIRegP[0]->TransferMode = multiBlockMode(false, false) | transferEnd(nblks, true);
+	SDCommand(0, SD_WRITE_MULTIPLE_BLOCK, SDCR24, isHighCapacity ? block : block * 512);
+
+	for (int i = 0; i < nblks; i++) {
+		if (mapped != NULL) {
+			pBuff = (UInt32 *)(mapped + (offset + i) * 512);
+		} else {
+			buffer->readBytes((offset + i) * 512, buff, 1 * 512);
+			pBuff = (UInt32*)buff;
+		}
+
+		if (! waitReg<UInt16>(0, &this->PCIRegP[0]->NormalIntStatus, BuffWriteReady | ErrorInterrupt,
+					true, INT_TIMEOUT_US, "write buffer") ||
+		    (this->PCIRegP[0]->NormalIntStatus & ErrorInterrupt)) {
+			IOLog("VoodooSDHCI 2 Returning error:  0x%x\n",
+		      		*(volatile UInt32 *)
+		      		&(this->PCIRegP[0]->NormalIntStatus));
+			ret = kIOReturnError;
+			goto out;
+		}
+
+                this->PCIRegP[0]->NormalIntStatus =
+                                this->PCIRegP[0]->NormalIntStatus;
+
+		write_block_pio(&this->PCIRegP[0]->BufferDataPort, pBuff);
+	}
+
+	if (! waitReg<UInt16>(0, &this->PCIRegP[0]->NormalIntStatus, XferComplete | ErrorInterrupt,
+				true, INT_TIMEOUT_US, "write completion") ||
+	    (this->PCIRegP[0]->NormalIntStatus & ErrorInterrupt)) {
+		IOLog("VoodooSDHCI 3 Returning error:  0x%x\n",
+	      		*(volatile UInt32 *)
+	      		&(this->PCIRegP[0]->NormalIntStatus));
+		ret = kIOReturnError;
+		goto out;
+	}
+	this->PCIRegP[0]->NormalIntStatus =
+				BuffWriteReady | XferComplete | CmdComplete;	
+	ret = kIOReturnSuccess;
+
+out:
+	if (stopNeeded && ! stopTransmission(0))
+		ret = kIOReturnError;
+	return ret;
+}
+
+/*
+ * writeBlockSingle_pio:  Read a single block from the card using PIO not DMA
+ *			  mode.  The host controller must be locked when this
+ *			  function is called.
+ *		IOMemoryDescriptor *buffer:  Buffer operation class.  Defines
+ *				read/write, address of operation, etc.
+ *		UInt32 block:  Block offset to read/write
+ *		UInt32 offset:  Offset from beginning of transfer - where in
+ *				final buffer we should begin placing data
+ *		UInt8 *mapped:  buffer mapped into the kernel, or NULL to
+ *				copy through a bounce block
+ */
+IOReturn VoodooSDHC::writeBlockSingle_pio(IOMemoryDescriptor *buffer,
+			UInt32 block, UInt32 offset, UInt8 *mapped) {
+	UInt8 buff[512];	// Temporary storage for data block
+	UInt32 *pBuff;
+	IOReturn ret;
+
+	if (mapped != NULL) {
+		pBuff = (UInt32 *)(mapped + offset * 512);
+	} else {
+		pBuff = (UInt32*)buff;
+		buffer->readBytes(offset * 512, buff, 1 * 512);
+	}
+
+	if (quirks & kSDQuirkResetPerCommand) {
+		Reset(0, CMD_RESET);
+		Reset(0, DAT_RESET);
+	}
+
+	this->PCIRegP[0]->TransferMode = 0;
+	this->PCIRegP[0]->NormalIntStatusEn = -1;
+	this->PCIRegP[0]->ErrorIntStatusEn = -1;
+	this->PCIRegP[0]->NormalIntStatus = 
+				BuffWriteReady | XferComplete | CmdComplete;
+	this->PCIRegP[0]->TimeoutControl = 0xe;
+
+	SDCommand(0, SD_WRITE_BLOCK, SDCR24, isHighCapacity ? block : block * 512);
+
+	if (! waitReg<UInt16>(0, &this->PCIRegP[0]->NormalIntStatus, BuffWriteReady | ErrorInterrupt,
+				true, INT_TIMEOUT_US, "write buffer") ||
+	    (this->PCIRegP[0]->NormalIntStatus & ErrorInterrupt)) {
+		IOLog("VoodooSDHCI: 2 Returning error:  0x%x\n",
+			*(volatile UInt32 *)
+				&(this->PCIRegP[0]->NormalIntStatus));
+		ret = kIOReturnError;
+		goto out;
+	}
+
+	write_block_pio(&this->PCIRegP[0]->BufferDataPort, pBuff);
+
+	if (! waitReg<UInt16>(0, &this->PCIRegP[0]->NormalIntStatus, XferComplete | ErrorInterrupt,
+				true, INT_TIMEOUT_US, "write completion") ||
+	    (this->PCIRegP[0]->NormalIntStatus & ErrorInterrupt)) {
+		IOLog("VoodooSDHCI 3 Returning error:  0x%x\n",
+			*(volatile UInt32 *)
+				&(this->PCIRegP[0]->NormalIntStatus));
+		ret = kIOReturnError;
+		goto out;
+	}
+	this->PCIRegP[0]->NormalIntStatus =
+			BuffWriteReady | XferComplete | CmdComplete;	
+	ret = kIOReturnSuccess;
+
+out:
+	return ret;
+}
+
+/*
+ * transferBlocks:  Move a range of blocks between the card and a client
+ *		    buffer using the configured transfer method.  The host
+ *		    controller must be locked when this function is called.
+ *		IOMemoryDescriptor *buffer:  Buffer operation class.  Defines
+ *				read/write, address of operation, etc.
+ *		UInt32 block:  Block offset to read/write
+ *		UInt32 nblks:  Block count to read/write
+ *		bool read:  true if read, false if write
+ */
+IOReturn VoodooSDHC::transferBlocks(IOMemoryDescriptor *buffer,
+				UInt32 block, UInt32 nblks, bool read) {
+	IOReturn ret = kIOReturnSuccess;
+	UInt32 blk, n, b, limit;
+	UInt8 e = engine;
+	int i;
+
+#ifdef READONLY_DRIVER
+	// When compiled in this mode, the driver fails all write
+	// operations.  Useful for testing to gain confidence in
+	// code without trashing data.  Define must be set at top
+	// of file.
+	if (! read)
+		return kIOReturnError;
+#endif
+	blk = block;
+	n = nblks;
+	limit = read ? tuning.readBlocks : tuning.writeBlocks;
+	// PIO moves data through the client's pages; map them once for the request
+	clientMap = e == kSDEnginePIO ? mapClient(buffer) : NULL;
+	while (n) {
+		b = MIN(n, maxBlockCount());
+		if (limit != 0)
+			b = MIN(b, limit);
+		// Cards that prefer aligned writes get the head split off
+		if (! read && tuning.writeAlign != 0 && blk % tuning.writeAlign != 0)
+			b = MIN(b, tuning.writeAlign - blk % tuning.writeAlign);
+
+		for (i = 0; i < SDMA_RETRY_COUNT; i++) {
+			xferDone = 0;
+			ret = (this->*engines[e].access)(buffer, blk, b, read, blk - block);
+			if (ret != kIOReturnTimeout && ret != kIOReturnIOError && ret != kIOReturnError)
+				break;
+			// Carry on from the last block known to have made it
+			if (xferDone != 0 && xferDone < b) {
+				OSAddAtomic64(xferDone, &stats[0].resumedBlocks);
+				blk += xferDone;
+				n -= xferDone;
+				b -= xferDone;
+			}
+			if (i + 1 < SDMA_RETRY_COUNT && ! recover(0, i))
+				break;
+		}
+		if (i != 0) {
+			OSAddAtomic(i, &stats[0].retries);
+			if (ret == kIOReturnSuccess)
+				IOLog("VoodooSDHCI: retry succeeded\n");
+		}
+		if (ret == kIOReturnSuccess && degrade != 0 && ++cleanRun >= CLEAN_RUN_STEP_UP)
+			busStepUp(0);
+		// The rest of this request goes through a slower engine
+		if ((ret == kIOReturnDMAError || ret == kIOReturnUnsupported) && e != kSDEnginePIO) {
+			IOLog("VoodooSDHCI: %s transfer failed, falling back to %s\n",
+				engines[e].name, engines[e - 1].name);
+			if (--e == kSDEnginePIO)
+				clientMap = mapClient(buffer);
+			continue;
+		}
+		if (ret != kIOReturnSuccess)
+			break;
+		n -= b;
+		blk += b;
+#ifdef __DEBUG__
+		IOLog("VoodooSDHCI:  ret = 0x%x block = %d\n", ret, blk);
+#endif /* __DEBUG__ */
+	}
+	unmapClient(buffer, clientMap);
+	clientMap = NULL;
+	return ret;
+}
+
+/*
+ * mapClient:  Prepare a client buffer and map it into the kernel, so data
+ *	       can move to and from its pages without readBytes/writeBytes.
+ *	       Returns NULL if it cannot be mapped; the caller then falls
+ *	       back to copying through the descriptor.
+ *		IOMemoryDescriptor *buffer:  Client buffer
+ */
+IOMemoryMap *VoodooSDHC::mapClient(IOMemoryDescriptor *buffer) {
+	IOMemoryMap *map;
+
+	if (buffer->prepare() != kIOReturnSuccess)
+		return NULL;
+	if ((map = buffer->map()) == NULL)
+		buffer->complete();
+	return map;
+}
+
+/*
+ * unmapClient:  Undo mapClient.  A NULL map is ignored.
+ *		IOMemoryDescriptor *buffer:  Client buffer
+ *		IOMemoryMap *map:  What mapClient returned
+ */
+void VoodooSDHC::unmapClient(IOMemoryDescriptor *buffer, IOMemoryMap *map) {
+	if (map != NULL) {
+		map->release();
+		buffer->complete();
+	}
+}
+
+/*
+ * bounceMap:  Map a client buffer for bounce copies of len bytes, but
+ *	       only when the non-temporal copy is in use and the copies are
+ *	       big enough for it to pay off.  Otherwise returns NULL and
+ *	       bounceIn/bounceOut use the descriptor's own copy.
+ *		IOMemoryDescriptor *buffer:  Client buffer
+ *		IOByteCount len:  Largest single copy that will be made
+ */
+IOMemoryMap *VoodooSDHC::bounceMap(IOMemoryDescriptor *buffer, IOByteCount len) {
+	if (copy_bounce == copy_plain || len < NT_COPY_MIN)
+		return NULL;
+	return mapClient(buffer);
+}
+
+/*
+ * bounceIn:  Copy client data into a bounce buffer for a write.  With no
+ *	      map the descriptor's own copy is used; mapping per copy would
+ *	      cost a TLB shootdown on every unmap.
+ *		IOMemoryDescriptor *buffer:  Client buffer
+ *		IOMemoryMap *map:  From bounceMap, or NULL
+ *		IOByteCount offset:  Offset within the client buffer
+ *		void *bounce:  Bounce buffer
+ *		IOByteCount len:  Byte count
+ */
+void VoodooSDHC::bounceIn(IOMemoryDescriptor *buffer, IOMemoryMap *map,
+				IOByteCount offset, void *bounce, IOByteCount len) {
+	if (map != NULL)
+		copy_bounce(bounce, (UInt8 *)map->getVirtualAddress() + offset, len);
+	else
+		buffer->readBytes(offset, bounce, len);
+}
+
+/*
+ * bounceOut:  Copy data a read left in a bounce buffer out to the client.
+ *	       With no map the descriptor's own copy is used.
+ *		IOMemoryDescriptor *buffer:  Client buffer
+ *		IOMemoryMap *map:  From bounceMap, or NULL
+ *		IOByteCount offset:  Offset within the client buffer
+ *		const void *bounce:  Bounce buffer
+ *		IOByteCount len:  Byte count
+ */
+void VoodooSDHC::bounceOut(IOMemoryDescriptor *buffer, IOMemoryMap *map,
+				IOByteCount offset, const void *bounce, IOByteCount len) {
+	if (map != NULL)
+		copy_bounce((UInt8 *)map->getVirtualAddress() + offset, bounce, len);
+	else
+		buffer->writeBytes(offset, bounce, len);
+}
+
+/*
+ * pio_access:  Transfer engine that moves blocks through the Buffer Data
+ *		Port, with multi-block commands unless the card or host
+ *		cannot take them.  Blocks move between the port and the
+ *		client pages transferBlocks mapped for the request, without
+ *		a bounce copy; if it could not map them every block goes
+ *		through a stack buffer.  The host controller must be
+ *		locked when this function is called.
+ *		IOMemoryDescriptor *buffer:  Client buffer
+ *		UInt32 block:  Block offset to read/write
+ *		UInt32 nblks:  Block count to read/write
+ *		bool read:  true if read, false if write
+ *		UInt32 base:  Block offset of the transfer within buffer
+ */
+IOReturn VoodooSDHC::pio_access(IOMemoryDescriptor *buffer,
+				UInt32 block, UInt32 nblks, bool read, UInt32 base) {
+	UInt8 buff[512];	// Temporary storage for data block
+	IOReturn ret = kIOReturnSuccess;
+	UInt8 *mapped = clientMap != NULL ? (UInt8 *)clientMap->getVirtualAddress() : NULL;
+	UInt32 b;
+
+	while (nblks && ret == kIOReturnSuccess) {
+		if (nblks > 1 && USE_MULTIBLOCK && ! (quirks & kSDQuirkBrokenMultiBlock)) {
+			b = MIN(2048, nblks);
+			if (read)
+				ret = readBlockMulti_pio(buffer, block, b, base, mapped);
+			else
+				ret = writeBlockMulti_pio(buffer, block, b, base, mapped);
+		} else {
+			b = 1;
+			if (read && mapped != NULL) {
+				ret = readBlockSingle_pio(mapped + base * 512, block);
+			} else if (read) {
+				ret = readBlockSingle_pio(buff, block);
+				buffer->writeBytes(base * 512, buff, 1 * 512);
+			} else {
+				ret = writeBlockSingle_pio(buffer, block, base, mapped);
+			}
+		}
+		nblks -= b;
+		block += b;
+		base += b;
+	}
+	return ret;
+}
+
+/*
+ * adma32_access:  ADMA2 transfer engine with 32 bit descriptors.
+ */
+IOReturn VoodooSDHC::adma32_access(IOMemoryDescriptor *buffer,
+				UInt32 block, UInt32 nblks, bool read, UInt32 base) {
+	return adma2_transfer(buffer, block, nblks, read, base, false);
+}
+
+/*
+ * adma64_access:  ADMA2 transfer engine with 96 bit (64 bit address)
+ *		   descriptors.
+ */
+IOReturn VoodooSDHC::adma64_access(IOMemoryDescriptor *buffer,
+				UInt32 block, UInt32 nblks, bool read, UInt32 base) {
+	return adma2_transfer(buffer, block, nblks, read, base, true);
+}
+
+/*
+ * adma2_transfer:  Move blocks with ADMA2, straight between the card and
+ *		    the client's pages as the IODMACommand for the descriptor
+ *		    width maps them, one CMD18/CMD25 per page of descriptors.
+ *		    Returns kIOReturnUnsupported for memory that cannot be
+ *		    mapped or is not 4 byte aligned, and kIOReturnDMAError
+ *		    for an ADMA error; either way the caller can redo the
+ *		    whole range with another engine.  The host controller must
+ *		    be locked when this function is called.
+ *		IOMemoryDescriptor *buffer:  Client buffer
+ *		UInt32 block:  Block offset to read/write
+ *		UInt32 nblks:  Block count to read/write
+ *		bool read:  true if read, false if write
+ *		UInt32 base:  Block offset of the transfer within buffer
+ *		bool wide:  Use 64 bit descriptors
+ */
+IOReturn VoodooSDHC::adma2_transfer(IOMemoryDescriptor *buffer,
+				UInt32 block, UInt32 nblks, bool read, UInt32 base, bool wide) {
+	const UInt32 descSize = wide ? 12 : 8;
+	const UInt32 maxDesc = PAGE_SIZE / descSize;
+	IOReturn ret = kIOReturnSuccess;
+	IOByteCount offset = (IOByteCount)base * 512, len, seg, trim;
+	UInt64 remaining = (UInt64)nblks * 512;
+	UInt32 *desc = NULL, d, n, numSeg;
+	IODMACommand *dma = admaCmd[wide ? 1 : 0];
+	IODMACommand::Segment64 segment;
+	UInt64 genOffset;
+	addr64_t phys;
+	AbsoluteTime deadline;
+	UInt64 start;
+	UInt16 nis, eis;
+
+	if (admaDescDesc == NULL || dma == NULL)
+		return kIOReturnUnsupported;
+	if (buffer->prepare() != kIOReturnSuccess)
+		return kIOReturnUnsupported;
+	if (dma->setMemoryDescriptor(buffer) != kIOReturnSuccess) {
+		buffer->complete();
+		return kIOReturnUnsupported;
+	}
+	while (remaining != 0 && ret == kIOReturnSuccess) {
+		/* Describe as much of the rest of the buffer as one page of descriptors holds */
+		for (d = 0, len = 0; d < maxDesc && len < remaining; d++, len += seg) {
+			genOffset = offset + len;
+			numSeg = 1;
+			if (dma->gen64IOVMSegments(&genOffset, &segment, &numSeg) != kIOReturnSuccess ||
+			    numSeg != 1) {
+				ret = kIOReturnUnsupported;
+				break;
+			}
+			phys = segment.fIOVMAddr;
+			seg = (IOByteCount)MIN(segment.fLength, MIN(remaining - len, ADMA2_SEG_MAX));
+			if ((phys & 3) || (seg & 3)) {
+				ret = kIOReturnUnsupported;
+				break;
+			}
+			desc = (UInt32 *)(virtAdmaDesc + d * descSize);
+			desc[0] = (UInt32)(ADMA_DESC_VALID | ADMA_ACT_TRAN | ADMA_DESC_LEN(seg));
+			desc[1] = (UInt32)phys;
+			if (wide)
+				desc[2] = (UInt32)(phys >> 32);
+		}
+		if (ret != kIOReturnSuccess)
+			break;
+		// A full table may end mid block; the rest goes with the next command
+		if ((trim = len % 512) != 0) {
+			if (seg <= trim) {
+				ret = kIOReturnUnsupported;
+				break;
 			}
-			if (nis & maskBits) {
-				PCIRegP[0]->NormalIntStatus = nis | maskBits;
-				return true;
+			len -= trim;
+			desc[0] = (UInt32)(ADMA_DESC_VALID | ADMA_ACT_TRAN | ADMA_DESC_LEN(seg - trim));
+		}
+		desc[0] |= ADMA_DESC_END;
+		n = (UInt32)(len / 512);
+
+		setHostControl(0, SDHCI_CTRL_DMA_MASK, wide ? SDHCI_CTRL_ADMA64 : SDHCI_CTRL_ADMA32);
+		this->PCIRegP[0]->TimeoutControl = 0xe;
+		this->PCIRegP[0]->NormalIntSignalEn = XferComplete | ErrorInterrupt;
+		this->PCIRegP[0]->ErrorIntSignalEn = 0x03ff;
+		this->PCIRegP[0]->NormalIntStatus = BuffReadReady | XferComplete | CmdComplete | DMAInterrupt;
+		this->PCIRegP[0]->ErrorIntStatus = 0xf3ff;
+		::OSSynchronizeIO();
+		this->PCIRegP[0]->ADMASystemAddr[0] = physAdmaDesc;
+		this->PCIRegP[0]->ADMASystemAddr[1] = 0;
+		this->PCIRegP[0]->BlockSize = 512;
+		setBlockCount(0, n);
+		if (! read)
+			preErase(n);
+		this->PCIRegP[0]->TransferMode = multiBlockMode(read, true) | transferEnd(n, true);
+		::OSSynchronizeIO();
+		SDCommand(0, read ? SD_READ_MULTIPLE_BLOCK : SD_WRITE_MULTIPLE_BLOCK, SDCR18,
+			isHighCapacity ? block : block * 512);
+
+		clock_interval_to_deadline(ADMA2_TIMEOUT_MS, kMillisecondScale, (uint64_t*)&deadline);
+		start = traceClock();
+		IOLockLock(sdmaCond);
+		while (! (this->PCIRegP[0]->NormalIntStatus & (XferComplete | ErrorInterrupt))) {
+			if (IOLockSleepDeadline(sdmaCond, sdmaCond, deadline, THREAD_UNINT) == THREAD_TIMED_OUT)
+				break;
+		}
+		IOLockUnlock(sdmaCond);
+		statTime(0, kSDStatBusyWait, start);
+
+		nis = this->PCIRegP[0]->NormalIntStatus;
+		if ((nis & (XferComplete | ErrorInterrupt)) != XferComplete) {
+			eis = this->PCIRegP[0]->ErrorIntStatus;
+#if USE_CMD_TRACE
+			traceCmd(0, kSDTraceError, lastCommand[0], XferComplete, nis,
+				this->PCIRegP[0]->Response[0], eis);
+#endif
+			IOLog("VoodooSDHCI: ADMA2 transfer of %d blocks failed: Status: 0x%x, Error: 0x%x, ADMA Error: 0x%x\n",
+				(int)n, nis, eis, this->PCIRegP[0]->AMDAErrorStatus);
+			if (eis & ADMAError) {
+				ret = kIOReturnDMAError;
+			} else if (! (nis & ErrorInterrupt)) {
+				OSIncrementAtomic(&stats[0].timeouts);
+				ret = kIOReturnTimeout;
+				// Earlier commands of this transfer, then this one so far
+				xferDone = (UInt32)(offset / 512) - base + partialBlocks(read, n, n);
+			} else {
+				ret = kIOReturnIOError;
 			}
+			Reset(0, CMD_RESET);
+			Reset(0, DAT_RESET);
 		}
-		::IODelay(10);
+		this->PCIRegP[0]->NormalIntStatus = XferComplete | CmdComplete | DMAInterrupt;
+		setHostControl(0, SDHCI_CTRL_DMA_MASK, SDHCI_CTRL_SDMA);
+		this->PCIRegP[0]->NormalIntSignalEn = 0;
+		this->PCIRegP[0]->ErrorIntSignalEn = 0;
+		if (stopNeeded && ! stopTransmission(0) && ret == kIOReturnSuccess)
+			ret = kIOReturnIOError;
+
+		offset += len;
+		remaining -= len;
+		block += n;
 	}
-	return false;
+	// Copies bounced reads back to the client
+	dma->clearMemoryDescriptor();
+	buffer->complete();
+	return ret;
 }
 
 /*
- * readBlockMulti_pio:  Read a set of blocks using multi-block reads and PIO
- *                      not DMA mode.  The host controller must be locked when
- *			this function is called.
- *		IOMemoryDescriptor *buffer:  Buffer operation class.  Defines
- *				read/write, address of operation, etc.
- *		UInt32 block:  Block offset to read/write
- *		UInt32 nblks:  Block count to read/write
- *		UInt32 offset:  Offset from beginning of transfer - where in
- *				final buffer we should begin placing data
+ * cmdq_access:  Carry out a batch of requests through the SD command queue.
+ *		 Tasks are queued with CMD44/CMD45 up to the card's depth, the
+ *		 Queue Status Register is polled with CMD13 and ready tasks are
+ *		 executed with CMD46/CMD47, in whatever order the card picks.
+ *		 On a queue error the card's queue is aborted and the requests
+ *		 not yet completed are left for the caller to retry one by one.
+ *		 The host controller must be locked when this function is called.
+ *		SDRequest_t **reqs:  Requests to carry out
+ *		UInt32 count:  Number of requests
  */
-IOReturn VoodooSDHC::readBlockMulti_pio(IOMemoryDescriptor *buffer,
-					UInt32 block, UInt32 nblks,
-					UInt32 offset) {
-	UInt8 buff[512];	// Temporary storage for one block
-	UInt32 *pBuff;
-	IOReturn ret = kIOReturnError;
+IOReturn VoodooSDHC::cmdq_access(SDRequest_t **reqs, UInt32 count) {
+	SDRequest_t *task[CMDQ_MAX_DEPTH];
+	UInt32 next = 0, done = 0, qsr;
+	UInt64 pollStart = 0;
+	int polls = 0;
+
+	bzero(task, sizeof(task));
+	while (done < count) {
+		/* Fill free task IDs */
+		for (int tid = 0; tid < cmdqDepth && next < count; tid++) {
+			if (task[tid] != NULL)
+				continue;
+			SDRequest_t *req = reqs[next];
+			UInt32 addr = isHighCapacity ? (UInt32)req->block : (UInt32)req->block * 512;
 
-#ifdef __DEBUG__
-	IOLog("VoodooSDHCI: readBlockMulti_pio:  block = %d, nblks = %d\n", block, nblks);
-#endif /* __DEBUG__ */
+#ifdef READONLY_DRIVER
+			if (! req->read) {
+				req->status = kIOReturnError;
+				req->done = true;
+				next++;
+				done++;
+				continue;
+			}
+#endif
+			SDCommand(0, SD_Q_TASK_INFO_A, SDCR44,
+				(req->read ? SD_Q_TASK_READ : 0) | SD_Q_TASK_ID(tid) | (UInt16)req->nblks);
+			if (! waitIntStatus(0, CmdComplete) || (PCIRegP[0]->Response[0] & R1_ERROR))
+				goto abort;
+			SDCommand(0, SD_Q_TASK_INFO_B, SDCR45, addr);
+			if (! waitIntStatus(0, CmdComplete) || (PCIRegP[0]->Response[0] & R1_ERROR))
+				goto abort;
+			task[tid] = req;
+			next++;
+		}
 
-	pBuff = (UInt32*)buff;
+		/* Ask the card which tasks are ready to run */
+		SDCommand(0, SD_SEND_STATUS, SDCR13, (this->RCA << 16) | SD_Q_SEND_QSR);
+		if (! waitIntStatus(0, CmdComplete))
+			goto abort;
+		qsr = PCIRegP[0]->Response[0];
+		if (qsr == 0) {
+			if (polls++ == 0)
+				pollStart = traceClock();
+			else if (traceClock() - pollStart > (UInt64)CMDQ_POLL_TIMEOUT_MS * 1000000)
+				goto abort;
+			// Ready tasks usually show up at once; after that stop hogging the bus
+			if (polls > CMDQ_POLL_SPINS)
+				IOSleep(1);
+			continue;
+		}
+		polls = 0;
+
+		for (int tid = 0; tid < cmdqDepth; tid++) {
+			if (! (qsr & (1 << tid)) || task[tid] == NULL)
+				continue;
+			SDRequest_t *req = task[tid];
+			req->status = sdma_transfer(req->buffer,
+				req->read ? SD_Q_RD_TASK : SD_Q_WR_TASK,
+				SD_Q_TASK_ID(tid), (UInt32)req->nblks, req->read);
+			if (req->status != kIOReturnSuccess)
+				goto abort;
+			req->done = true;
+			task[tid] = NULL;
+			done++;
+		}
+	}
+	return kIOReturnSuccess;
 
-#ifndef NO_RESET_WAR	
-	// Reset card before every operation.  The Linux driver
-	// does this for this host controller. Not sure why.
+abort:
+	IOLog("VoodooSDHCI: command queue error, aborting %d tasks\n", (int)(next - done));
 	Reset(0, CMD_RESET);
 	Reset(0, DAT_RESET);
-#endif
-
-	/* Enable all interrupts */
-	this->PCIRegP[0]->NormalIntStatusEn = -1;
-	this->PCIRegP[0]->ErrorIntStatusEn = -1;
-
-	/* Clear pending interrupts */
-	this->PCIRegP[0]->NormalIntStatus = 
-			(BuffReadReady | XferComplete | CmdComplete);
-
-	/* Set maximum timeout value */
-	this->PCIRegP[0]->TimeoutControl = 0xe;
+	SDCommand(0, SD_Q_MANAGEMENT, SDCR43, SD_Q_ABORT_QUEUE);
+	waitIntStatus(0, CmdComplete);
+	return kIOReturnError;
+}
 
-	*(volatile UInt32 *)&(this->PCIRegP[0]->NormalIntStatus) =
-		*(volatile UInt32 *)&(this->PCIRegP[0]->NormalIntStatus);
+/*
+ * cqhci_access:  Carry out a batch of requests through the host's command
+ *		  queue engine.  Requests are cut into tasks of at most one
+ *		  task buffer each; free task slots are filled and rung with a
+ *		  single doorbell write, and the engine picks the order.
+ *		  Completed slots are refilled as the Task Completion
+ *		  Notification register reports them.  On an error the engine
+ *		  is recovered and the requests not yet completed are left for
+ *		  the caller.  The host controller must be locked when this
+ *		  function is called.
+ *		SDRequest_t **reqs:  Requests to carry out
+ *		UInt32 count:  Number of requests
+ */
+IOReturn VoodooSDHC::cqhci_access(SDRequest_t **reqs, UInt32 count) {
+	UInt32 left[CMDQ_MAX_DEPTH];		// blocks not yet queued, per request
+	UInt32 busy[CMDQ_MAX_DEPTH];		// tasks in flight, per request
+	UInt32 taskReq[CMDQ_MAX_DEPTH];
+	UInt32 taskOff[CMDQ_MAX_DEPTH];
+	UInt32 taskBlks[CMDQ_MAX_DEPTH];
+	UInt32 next = 0, inFlight = 0, doorbell, tcn, cqis;
+	IOReturn ret = kIOReturnSuccess;
+	AbsoluteTime deadline;
 
-	this->PCIRegP[0]->BlockSize = 512;
-	this->PCIRegP[0]->BlockCount = nblks;
+	for (UInt32 i = 0; i < count; i++) {
+		left[i] = (UInt32)reqs[i]->nblks;
+		busy[i] = 0;
+	}
 
-	this->PCIRegP[0]->TransferMode = SDHCI_TRNS_READ | SDHCI_TRNS_MULTI |
-	  		SDHCI_TRNS_BLK_CNT_EN | SDHCI_TRNS_ACMD12;
+	this->PCIRegP[0]->NormalIntSignalEn = SDHCI_INT_CQE | ErrorInterrupt;
+	this->PCIRegP[0]->ErrorIntSignalEn = 0x01ff;
+	this->CQHCIRegP->CQISGE = CQRespErrDet | CQTaskComplete;
+
+	while (next < count || inFlight) {
+		/* Fill free task slots */
+		doorbell = 0;
+		for (UInt32 tag = 0; tag < cqeDepth && next < count; tag++) {
+			if (inFlight & (1U << tag))
+				continue;
+			SDRequest_t *req = reqs[next];
+			UInt32 off = (UInt32)req->nblks - left[next];
+			UInt32 n = MIN(left[next], TASK_BUFFER_SIZE / 512);
+			UInt32 blk = (UInt32)req->block + off;
+			UInt32 phys = physTaskBuff + PAGE_SIZE + tag * TASK_BUFFER_SIZE;
+			UInt8 *virt = virtTaskBuff + PAGE_SIZE + tag * TASK_BUFFER_SIZE;
+			UInt64 *desc = (UInt64 *)(virtTaskBuff + tag * CQHCI_SLOT_SIZE);
 
-	
-	// Issue read command to host controller
-	SDCommand(0, SD_READ_MULTIPLE_BLOCK, SDCR18, isHighCapacity ? block : block * 512);
-	
-	// wait for CmdComplete
-	if (! waitIntStatus(CmdComplete)) {
-		IOLog("VoodooSDHCI: I/O error after command 18: It Status: 0x%x\n", PCIRegP[0]->NormalIntStatus);
-		goto out;
-	}
-	
-	for (int i = 0; i < nblks; i++) {
-		// wait for BufferReadReady
-		if (! waitIntStatus(BuffReadReady)) {
-			IOLog("VoodooSDHCI: I/O timeout while waiting for data, Status: 0x%0x\n", PCIRegP[0]->NormalIntStatus);
-			goto out;
-			
+#ifdef READONLY_DRIVER
+			if (! req->read) {
+				req->status = kIOReturnError;
+				req->done = true;
+				next++;
+				continue;
+			}
+#endif
+			if (! req->read)
+				bounceIn(req->buffer, NULL, off * 512, virt, n * 512);
+			desc[0] = CQ_DESC_VALID | CQ_DESC_END | CQ_DESC_INT | CQ_DESC_ACT_TASK |
+				(req->read ? CQ_TASK_READ : 0) | CQ_TASK_BLKCNT(n) |
+				CQ_TASK_BLKADDR(isHighCapacity ? blk : blk * 512);
+			desc[1] = CQ_DESC_VALID | CQ_DESC_END | CQ_DESC_ACT_TRAN |
+				CQ_TRAN_LEN(n * 512) | CQ_TRAN_ADDR(phys);
+			taskReq[tag] = next;
+			taskOff[tag] = off;
+			taskBlks[tag] = n;
+			busy[next]++;
+			left[next] -= n;
+			if (left[next] == 0)
+				next++;
+			inFlight |= 1U << tag;
+			doorbell |= 1U << tag;
+		}
+		if (doorbell) {
+			::OSSynchronizeIO();
+			this->CQHCIRegP->CQTDBR = doorbell;
 		}
-		/* Read block from card */
-		read_block_pio(&this->PCIRegP[0]->BufferDataPort, pBuff);
 
-		/* Copy buffer to final location */
-		buffer->writeBytes((i + offset) * 512, buff, 1 * 512);
-	}
-	
-	// wait for transfer complete
-	if (! waitIntStatus(XferComplete)) {
-		IOLog("VoodooSDHCI: I/O timeout during completion... status == 0x%x\n", PCIRegP[0]->NormalIntStatus);
+		/* Wait for the engine to report something */
+		clock_interval_to_deadline(5000, kMillisecondScale, (uint64_t*)&deadline);
+		IOLockLock(sdmaCond);
+		while (! (this->CQHCIRegP->CQIS & (CQRespErrDet | CQTaskComplete)) &&
+		       ! (this->PCIRegP[0]->NormalIntStatus & ErrorInterrupt)) {
+			if (IOLockSleepDeadline(sdmaCond, sdmaCond, deadline, THREAD_UNINT) == THREAD_TIMED_OUT) {
+				IOLockUnlock(sdmaCond);
+				IOLog("VoodooSDHCI: command queue timeout: CQIS: 0x%x, doorbell: 0x%x, Status: 0x%x\n",
+					this->CQHCIRegP->CQIS, this->CQHCIRegP->CQTDBR,
+					this->PCIRegP[0]->NormalIntStatus);
+				ret = kIOReturnTimeout;
+				goto recover;
+			}
+		}
+		IOLockUnlock(sdmaCond);
+		cqis = this->CQHCIRegP->CQIS;
+		this->CQHCIRegP->CQIS = cqis;
+		if ((cqis & CQRespErrDet) || (this->PCIRegP[0]->NormalIntStatus & ErrorInterrupt)) {
+			IOLog("VoodooSDHCI: command queue error: CQIS: 0x%x, CQTERRI: 0x%x, CQCRA: 0x%x, Error: 0x%x\n",
+				cqis, this->CQHCIRegP->CQTERRI, this->CQHCIRegP->CQCRA,
+				this->PCIRegP[0]->ErrorIntStatus);
+			ret = kIOReturnIOError;
+			goto recover;
+		}
+		tcn = this->CQHCIRegP->CQTCN;
+		this->CQHCIRegP->CQTCN = tcn;
+
+		/* Retire completed tasks */
+		for (UInt32 tag = 0; tag < cqeDepth; tag++) {
+			if (! (tcn & inFlight & (1U << tag)))
+				continue;
+			UInt32 i = taskReq[tag];
+			if (reqs[i]->read)
+				bounceOut(reqs[i]->buffer, NULL, taskOff[tag] * 512,
+					virtTaskBuff + PAGE_SIZE + tag * TASK_BUFFER_SIZE,
+					taskBlks[tag] * 512);
+			inFlight &= ~(1U << tag);
+			if (--busy[i] == 0 && left[i] == 0) {
+				reqs[i]->status = kIOReturnSuccess;
+				reqs[i]->done = true;
+			}
+		}
 	}
-	ret = kIOReturnSuccess;
+	goto out;
+
+recover:
+	cqhciRecover(0);
 out:
+	this->CQHCIRegP->CQISGE = 0;
+	this->PCIRegP[0]->NormalIntSignalEn = 0;
+	this->PCIRegP[0]->ErrorIntSignalEn = 0;
 	return ret;
 }
 
 /*
- * sdma_access:  Read / write a set of blocks using multi-block reads in SDMA mode.
- *                       The host controller must be locked when this function is called.
- *		IOMemoryDescriptor *buffer:  Buffer operation class.  Defines
- *				read/write, address of operation, etc.
- *		UInt32 block:  Block offset to read/write
- *		UInt32 nblks:  Block count to read/write
- *      bool   read: true if read, false if write
+ * adma3_access:  Carry out a batch of requests as one ADMA3 integrated
+ *		  descriptor chain.  Each request becomes a command descriptor
+ *		  set (CMD18/CMD25 with Auto CMD12) followed by ADMA2
+ *		  descriptors into its share of the task buffers, so the host
+ *		  runs the whole batch without the driver programming the
+ *		  command registers in between.  Only the last integrated
+ *		  descriptor interrupts.  Requests that do not fit in the task
+ *		  buffers are left for the caller, as is the whole batch on an
+ *		  error.  The host controller must be locked when this function
+ *		  is called.
+ *		SDRequest_t **reqs:  Requests to carry out
+ *		UInt32 count:  Number of requests
  */
-IOReturn VoodooSDHC::sdma_access(IOMemoryDescriptor *buffer,
-					UInt32 block, UInt32 nblks, bool read) {
-	IOReturn ret = kIOReturnError;
-	UInt32 nis, offset = 0;
+IOReturn VoodooSDHC::adma3_access(SDRequest_t **reqs, UInt32 count) {
+	SDRequest_t *chain[CMDQ_MAX_DEPTH];
+	UInt32 where[CMDQ_MAX_DEPTH];	// offset of each request's data in the task buffers
+	UInt32 n = 0, used = 0, len, off, addr;
+	UInt64 *integ, *desc;
+	UInt16 mode, cmd;
+	IOReturn ret = kIOReturnSuccess;
 	AbsoluteTime deadline;
 
-#ifdef __DEBUG__
-IOLog("VoodooSDHCI readBlockMulti_sdma:  block = %d, nblks = %d\n", block, nblks);
-#endif /* __DEBUG__ */
-#ifndef NO_RESET_WAR	
-	// Reset card before every operation.  The Linux driver
-	// does this for this host controller. Not sure why.
-	Reset(0, CMD_RESET);
-	Reset(0, DAT_RESET);
-#endif
+	if (! allocTaskBuffers())
+		return kIOReturnNoMemory;
+	integ = (UInt64 *)virtTaskBuff;
+	desc = integ + CMDQ_MAX_DEPTH;
 
-	/* write: fill in data */
-	if (! read) {
-		buffer->readBytes(offset * 512, virtSdmaBuff, min(SDMA_BUFFER_SIZE, nblks * 512));
-		offset += min(SDMA_BUFFER_SIZE / 512, nblks);
-	}
-	
-	/* Set maximum timeout value */
-	this->PCIRegP[0]->TimeoutControl = 0xe; // 2^27clks / 50MHz = 2.7 seconds
+	for (UInt32 i = 0; i < count; i++) {
+		SDRequest_t *req = reqs[i];
 
-	/* Enable all interrupts */
-	this->PCIRegP[0]->NormalIntSignalEn = 0x01ff;
-	this->PCIRegP[0]->NormalIntStatusEn = -1;
-	this->PCIRegP[0]->ErrorIntSignalEn = 0x01ff;
-	this->PCIRegP[0]->ErrorIntStatusEn = -1;
+		len = (UInt32)req->nblks * 512;
+		if (req->nblks > (CMDQ_MAX_DEPTH * TASK_BUFFER_SIZE - used) / 512)
+			continue;
+#ifdef READONLY_DRIVER
+		if (! req->read)
+			continue;
+#endif
+		if (! req->read)
+			bounceIn(req->buffer, NULL, 0, virtTaskBuff + PAGE_SIZE + used, len);
+		addr = isHighCapacity ? (UInt32)req->block : (UInt32)req->block * 512;
+		mode = multiBlockMode(req->read, true) | SDHCI_TRNS_ACMD12;
+		cmd = sdCommandTable[req->read ? SD_READ_MULTIPLE_BLOCK : SD_WRITE_MULTIPLE_BLOCK].command |
+			responseFlagTable[R1];
+
+		integ[n] = ADMA_DESC_VALID | ADMA3_ACT_INTEGRATED |
+			ADMA_DESC_ADDR(physTaskBuff + (UInt32)((UInt8 *)desc - virtTaskBuff));
+		/* 0x00 block count, 0x04 block size (16 bit count left 0), 0x08, 0x0C */
+		desc[0] = ADMA_DESC_VALID | ADMA3_ACT_CMD | ADMA3_CMD_DATA(req->nblks);
+		desc[1] = ADMA_DESC_VALID | ADMA3_ACT_CMD | ADMA3_CMD_DATA(512);
+		desc[2] = ADMA_DESC_VALID | ADMA3_ACT_CMD | ADMA3_CMD_DATA(addr);
+		desc[3] = ADMA_DESC_VALID | ADMA_DESC_END | ADMA3_ACT_CMD |
+			ADMA3_CMD_DATA(mode | ((UInt32)cmd << 16));
+		desc += 4;
+		for (off = 0; off < len; off += TASK_BUFFER_SIZE) {
+			*desc++ = ADMA_DESC_VALID | ADMA_ACT_TRAN |
+				(off + TASK_BUFFER_SIZE >= len ? ADMA_DESC_END : 0) |
+				ADMA_DESC_LEN(MIN(TASK_BUFFER_SIZE, len - off)) |
+				ADMA_DESC_ADDR(physTaskBuff + PAGE_SIZE + used + off);
+		}
+		chain[n] = req;
+		where[n] = used;
+		used += len;
+		n++;
+	}
+	if (n == 0)
+		return kIOReturnSuccess;
+	integ[n - 1] |= ADMA_DESC_END | ADMA_DESC_INT;
 
-	/* Clear pending interrupts */
-	this->PCIRegP[0]->NormalIntStatus = 
-			(BuffReadReady | XferComplete | CmdComplete);
+	setHostControl(0, SDHCI_CTRL_DMA_MASK, SDHCI_CTRL_ADMA3);
+	this->PCIRegP[0]->TimeoutControl = 0xe;
+	this->PCIRegP[0]->NormalIntSignalEn = XferComplete | ErrorInterrupt;
+	this->PCIRegP[0]->ErrorIntSignalEn = 0x03ff;
+	this->PCIRegP[0]->NormalIntStatus = BuffReadReady | XferComplete | CmdComplete | DMAInterrupt;
 	this->PCIRegP[0]->ErrorIntStatus = 0xf3ff;
 
+	// Writing the integrated descriptor address starts the chain
 	::OSSynchronizeIO();
-	PCIRegP[0]->SDMASysAddr = physSdmaBuff;
-	::OSSynchronizeIO();
-	this->PCIRegP[0]->BlockSize = 512 | SDMA_BUFFER_SIZE_IN_REG;
-	this->PCIRegP[0]->BlockCount = nblks;
-	::OSSynchronizeIO();
-	
-	// Issue read command to host controller
-	SDCommand(0,
-		read ? SD_READ_MULTIPLE_BLOCK : SD_WRITE_MULTIPLE_BLOCK,
-		SDCR18,
-		isHighCapacity ? block : block * 512);
-	::OSSynchronizeIO();
-	
-	// wait for CmdComplete
-	if (! waitIntStatus(CmdComplete)) {
-		IOLog("VoodooSDHCI: I/O error after command %d (SDMA): Status: 0x%x, Error: 0x%x\n",
-			read ? SD_READ_MULTIPLE_BLOCK : SD_WRITE_MULTIPLE_BLOCK, PCIRegP[0]->NormalIntStatus, PCIRegP[0]->ErrorIntStatus);
-		Reset(0, FULL_RESET);
-		if (! cardInit(0)) {
-			IOLog("VoodooSDHCI: reset failed, disabling access\n");
-			cardPresence = kCardRemount;
-		}
-		ret = kIOReturnTimeout;
-		goto out;
-	}
-	// check response
-	if (PCIRegP[0]->Response[0] & (read ? 0xcff80000 : 0xeff80000)) {
-		IOLog("VoodooSDHCI: Unexpected response from command %d (SDMA): Response: 0x%x\n",
-			read ? SD_READ_MULTIPLE_BLOCK : SD_WRITE_MULTIPLE_BLOCK, PCIRegP[0]->Response[0]);
-		goto out;
-	}
-	
-	clock_interval_to_deadline(5000, kMillisecondScale, (uint64_t*)&deadline);
+	this->PCIRegP[0]->ADMA3IntDescAddr[1] = 0;
+	this->PCIRegP[0]->ADMA3IntDescAddr[0] = physTaskBuff;
+
+	clock_interval_to_deadline(ADMA3_TIMEOUT_MS, kMillisecondScale, (uint64_t*)&deadline);
 	IOLockLock(sdmaCond);
-	while ((PCIRegP[0]->NormalIntStatus & ErrorInterrupt) == 0) {
-		if (IOLockSleepDeadline(sdmaCond, sdmaCond, deadline, THREAD_UNINT) == THREAD_TIMED_OUT) {
-			IOLockUnlock(sdmaCond);
-			// timeout
-			IOLog("VoodooSDHCI: I/O timeout during SDMA transfer: Status: 0x%x, Error: 0x%x, Block: %d, Offset: %d, Blocks: %d\n",
-				PCIRegP[0]->NormalIntStatus, PCIRegP[0]->ErrorIntStatus, (int)block, (int)offset, (int)nblks);
-			ret = kIOReturnTimeout;
-			goto out;
-		}
-		nis = PCIRegP[0]->NormalIntStatus;
-		if (nis & XferComplete) {
-			IOLockUnlock(sdmaCond);
-			if (read) {
-				buffer->writeBytes(offset * 512, virtSdmaBuff, nblks * 512);
-			}
-			PCIRegP[0]->NormalIntStatus = XferComplete | DMAInterrupt;
-			ret = kIOReturnSuccess;
-			goto out;
-		} else if (nis & DMAInterrupt) {
-			IOLockUnlock(sdmaCond);
-			if (read) {
-				buffer->writeBytes(offset * 512, virtSdmaBuff, SDMA_BUFFER_SIZE);
-				offset += SDMA_BUFFER_SIZE / 512;
-				nblks -= SDMA_BUFFER_SIZE / 512;
-			} else {
-				buffer->readBytes(offset * 512, virtSdmaBuff, min(SDMA_BUFFER_SIZE, (nblks - offset) * 512));
-				offset += min(SDMA_BUFFER_SIZE / 512, nblks - offset);
-			}
-			IOLockLock(sdmaCond);
-			PCIRegP[0]->NormalIntStatus = DMAInterrupt;
-			::OSSynchronizeIO();
-			PCIRegP[0]->SDMASysAddr = physSdmaBuff;
-		}
+	while (! (this->PCIRegP[0]->NormalIntStatus & (XferComplete | ErrorInterrupt))) {
+		if (IOLockSleepDeadline(sdmaCond, sdmaCond, deadline, THREAD_UNINT) == THREAD_TIMED_OUT)
+			break;
 	}
 	IOLockUnlock(sdmaCond);
-	// error
-	IOLog("VoodooSDHCI: I/O error during SDMA transfer: Status: 0x%x, Error: 0x%x, Block: %d, Offset: %d, Blocks: %d\n",
-		PCIRegP[0]->NormalIntStatus, PCIRegP[0]->ErrorIntStatus, (int)block, (int)offset, (int)nblks);
-	goto out;
 
-	ret = kIOReturnSuccess;
-out:
-	PCIRegP[0]->NormalIntSignalEn = 0;
-	PCIRegP[0]->ErrorIntSignalEn = 0;
+	if ((this->PCIRegP[0]->NormalIntStatus & (XferComplete | ErrorInterrupt)) != XferComplete) {
+		IOLog("VoodooSDHCI: ADMA3 chain of %d commands failed: Status: 0x%x, Error: 0x%x, ADMA Error: 0x%x\n",
+			(int)n, this->PCIRegP[0]->NormalIntStatus, this->PCIRegP[0]->ErrorIntStatus,
+			this->PCIRegP[0]->AMDAErrorStatus);
+		Reset(0, CMD_RESET);
+		Reset(0, DAT_RESET);
+		ret = kIOReturnIOError;
+	} else {
+		for (UInt32 i = 0; i < n; i++) {
+			if (chain[i]->read)
+				bounceOut(chain[i]->buffer, NULL, 0, virtTaskBuff + PAGE_SIZE + where[i],
+					(UInt32)chain[i]->nblks * 512);
+			chain[i]->status = kIOReturnSuccess;
+			chain[i]->done = true;
+		}
+	}
+	this->PCIRegP[0]->NormalIntStatus = XferComplete | CmdComplete | DMAInterrupt;
+	setHostControl(0, SDHCI_CTRL_DMA_MASK, SDHCI_CTRL_SDMA);
+	this->PCIRegP[0]->NormalIntSignalEn = 0;
+	this->PCIRegP[0]->ErrorIntSignalEn = 0;
 	return ret;
-}		
-	
+}
 
-	
 /*
- * readBlockSingle_pio:  Read a single block from the card using PIO not DMA
- *			 mode.  The host controller must be locked when this
- *			 function is called.
- *		UInt8 *buff:  Temporary buffer for data
- *		UInt32 block:  Block offset to read/write
+ * rawCommand:  Issue one command from the user client.  Commands without
+ *		data, single blocks of up to SD_RAW_MAX_BLKSZ bytes through the
+ *		PIO buffer port, and multi-block reads and writes through SDMA
+ *		are supported.  The command queue engine is halted around
+ *		the command, since it would otherwise own the bus.  The
+ *		host controller must be locked when this function is called.
+ *		SDRequest_t *req:  Request carrying the raw command
  */
-IOReturn VoodooSDHC::readBlockSingle_pio(UInt8 *buff, UInt32 block) {
-	UInt32 *pBuff;
-	int cnt, pass;
+IOReturn VoodooSDHC::rawCommand(SDRequest_t *req) {
+	const SDRawCommand_t *cmd = req->raw;
+	UInt32 buff[SD_RAW_MAX_BLKSZ / sizeof(UInt32)];
 	IOReturn ret;
+	bool paused;
 
-#ifndef NO_RESET_WAR	
-	// Reset card before every operation.  The Linux driver does this for
-	// this host controller. Not sure why
-	Reset(0, CMD_RESET);
-	Reset(0, DAT_RESET);
-#endif /* NO_RESET_WAR */
-
-	pBuff = (UInt32*)buff;
-
-	/* Set transfer mode to single block */
-	this->PCIRegP[0]->TransferMode = BIT4;
-
-	/* Enable interrupt flags */
-	this->PCIRegP[0]->NormalIntStatusEn = -1;
-	this->PCIRegP[0]->ErrorIntStatusEn = -1;
-
-	/* Clear pending interrupts */
-	this->PCIRegP[0]->NormalIntStatus = 
-			(BuffReadReady | XferComplete | CmdComplete);
+#ifdef READONLY_DRIVER
+	if (cmd->blockCount != 0 && ! req->read)
+		return kIOReturnError;
+#endif
+	if (cmd->opcode > 63 || cmd->response > R7 ||
+	    (sdCommandTable[cmd->opcode].response != SD_RSP_ANY &&
+	     cmd->response != sdCommandTable[cmd->opcode].response) ||
+	    (cmd->blockCount == 0 && (commandFlags(cmd->opcode) & SD_CMD_DATA)) ||
+	    (cmd->blockCount > 1 && ! (commandFlags(cmd->opcode) & SD_CMD_MULTI)))
+		return kIOReturnBadArgument;
+	paused = cqeDepth > 0;
+	if (paused && ! cqhciPause(0, cmd->blockCount != 0))
+		return kIOReturnBusy;
+
+	if (cmd->blockCount == 0) {
+		this->PCIRegP[0]->NormalIntStatus = CmdComplete | XferComplete;
+		this->PCIRegP[0]->ErrorIntStatus = 0xf3ff;
+		SDCommand(0, cmd->opcode, cmd->response, cmd->arg);
+		ret = kIOReturnSuccess;
+		// The end of the busy period shows up as transfer complete
+		if (! waitIntStatus(0, CmdComplete) ||
+		    ((cmd->response == R1b || cmd->response == R5b) && ! waitIntStatus(0, XferComplete))) {
+			IOLog("VoodooSDHCI: raw command %d failed: Status: 0x%x, Error: 0x%x\n",
+				cmd->opcode, PCIRegP[0]->NormalIntStatus, PCIRegP[0]->ErrorIntStatus);
+			Reset(0, CMD_RESET);
+			Reset(0, DAT_RESET);
+			ret = kIOReturnIOError;
+		}
+	} else if (cmd->blockCount == 1) {
+		if (! req->read)
+			req->buffer->readBytes(SD_RAW_DATA_OFFSET + cmd->dataOffset, buff, cmd->blockSize);
+		ret = dataCommand_pio(0, cmd->opcode, cmd->response, cmd->arg,
+			buff, cmd->blockSize, req->read);
+		if (ret == kIOReturnSuccess && req->read)
+			req->buffer->writeBytes(SD_RAW_DATA_OFFSET + cmd->dataOffset, buff, cmd->blockSize);
+	} else if (USE_SDMA && ! (quirks & kSDQuirkBrokenDMA) &&
+		   (commandFlags(cmd->opcode) & SD_CMD_ACMD12)) {
+		ret = sdma_transfer(req->buffer, cmd->opcode, cmd->arg, cmd->blockCount,
+			req->read, (SD_RAW_DATA_OFFSET + cmd->dataOffset) / 512);
+	} else {
+		ret = kIOReturnUnsupported;
+	}
 
-	/* Set maximum timeout value */
-	this->PCIRegP[0]->TimeoutControl = 0xe;
+	for (int i = 0; i < 4; i++)
+		req->response[i] = this->PCIRegP[0]->Response[i];
+	if (paused)
+		cqhciResume(0, cmd->blockCount != 0);
+	return ret;
+}
 
-#ifdef __DEBUG__
-	IOLog("VoodooSDHCI Int Status 0x%x Timeout = 0x%x\n",
-		*(volatile UInt32 *)&(this->PCIRegP[0]->NormalIntStatus), 
-		this->PCIRegP[0]->TimeoutControl);
+/*
+ * processRequests:  Carry out every request in a batch, through the eMMC
+ *		     command queue engine when it is running, or through the
+ *		     SD command queue when the card has one, or as one ADMA3
+ *		     descriptor chain, when there is more than one request
+ *		     waiting.  Raw commands from the user client are
+ *		     issued one at a time, in queue order.  Marks each
+ *		     request done and sets its status.  The host controller must be locked when this
+ *		     function is called.
+ *		SDRequest_t *batch:  List of requests
+ */
+void VoodooSDHC::processRequests(SDRequest_t *batch) {
+	SDRequest_t *reqs[CMDQ_MAX_DEPTH];
+	SDRequest_t *qreqs[CMDQ_MAX_DEPTH];
+	SDRequest_t *req;
+	UInt32 count, qcount;
+
+	if (tunePending) {
+		tunePending = false;
+		if (cardPresence == kCardIsPresent)
+			characterize(0);
+	}
+	while (batch != NULL) {
+		count = 0;
+		for (req = batch; req != NULL && count < CMDQ_MAX_DEPTH; req = req->next) {
+			/* Raw commands run on their own, after the block I/O ahead of them */
+			if (req->raw != NULL && count > 0)
+				break;
+			if (cardPresence != kCardIsPresent || ! isCardPresent(0)) {
+				/* require remount */
+				cardPresence = kCardRemount;
+				IOLog("VoodooSDHCI: media not present, require remount\n");
+				req->status = kIOReturnNoMedia;
+				req->done = true;
+				continue;
+			}
+			if (req->raw != NULL) {
+				req->status = rawCommand(req);
+				req->done = true;
+				req = req->next;
+				break;
+			}
+			reqs[count++] = req;
+		}
+		batch = req;
+
+		if (cqeDepth > 0) {
+			/*
+			 * Once the card is queueing, all data must go through the
+			 * engine.  cqhci_access has recovered the engine after an
+			 * error, so the unfinished requests are queued again; only
+			 * an engine that keeps failing is turned off.
+			 */
+			for (UInt32 i = 0; i < count; i++)
+				qreqs[i] = reqs[i];
+			qcount = count;
+			for (int tries = 1; qcount > 0; tries++) {
+				if (cqhci_access(qreqs, qcount) == kIOReturnSuccess)
+					break;
+				if (tries == CQHCI_RETRY_COUNT) {
+					cqhciDisable(0);
+					break;
+				}
+				qcount = 0;
+				for (UInt32 i = 0; i < count; i++)
+					if (! reqs[i]->done)
+						qreqs[qcount++] = reqs[i];
+			}
+		} else if (count > 1 && cmdqDepth > 0) {
+			/* A task's block count is 16 bits; longer requests go alone */
+			qcount = 0;
+			for (UInt32 i = 0; i < count; i++)
+				if (reqs[i]->nblks <= 0xFFFF)
+					qreqs[qcount++] = reqs[i];
+			if (qcount > 1)
+				cmdq_access(qreqs, qcount);
+		} else if (count > 1 && hostADMA3) {
+			adma3_access(reqs, count);
+		}
 
-	//IOLog("VoodooSDHCI:  state1 = 0x%x response = 0x%x\n",
-	//	this->PCIRegP[0]->PresentState, this->PCIRegP[0]->Response[0]);
-#endif /* __DEBUG__ */
+		for (UInt32 i = 0; i < count; i++) {
+			if (! reqs[i]->done) {
+				reqs[i]->status = transferBlocks(reqs[i]->buffer,
+					(UInt32)reqs[i]->block, (UInt32)reqs[i]->nblks, reqs[i]->read);
+				reqs[i]->done = true;
+			}
+		}
+	}
+}
 
-	*(volatile UInt32 *)&(this->PCIRegP[0]->NormalIntStatus) =
-		*(volatile UInt32 *)&(this->PCIRegP[0]->NormalIntStatus);
+/*
+ * submitRequest:  Queue a request and wait until it has been carried out.
+ *		   Whichever thread gets the card lock first takes every
+ *		   request queued so far and issues them together, so callers
+ *		   blocked on the lock usually find their request already done.
+ *		   Returns the request status.
+ *		SDRequest_t *req:  Request to carry out
+ */
+IOReturn VoodooSDHC::submitRequest(SDRequest_t *req) {
+	SDRequest_t *batch;
 
-	SDCommand(0, SD_READ_SINGLE_BLOCK, SDCR17, isHighCapacity ? block : block * 512);
+	req->done = false;
+	req->status = kIOReturnError;
+	req->next = NULL;
 
-	cnt = pass = 0;
+	IOLockLock(reqQueueLock);
+	if (reqTail != NULL)
+		reqTail->next = req;
+	else
+		reqHead = req;
+	reqTail = req;
+	IOLockUnlock(reqQueueLock);
 
-	//IOLog("VoodooSDHCI:  state2 = 0x%x response = 0x%x\n",
-	//	this->PCIRegP[0]->PresentState, this->PCIRegP[0]->Response[0]);
+	// All access to the card must be done while this lock is held
+	lock.lock();
+	if (! req->done) {
+		IOLockLock(reqQueueLock);
+		batch = reqHead;
+		reqHead = reqTail = NULL;
+		IOLockUnlock(reqQueueLock);
+		processRequests(batch);
+	}
+	lock.unlock();
 
-	while((this->PCIRegP[0]->NormalIntStatus & BuffReadReady) !=
-							BuffReadReady) {
-		if (this->PCIRegP[0]->NormalIntStatus & 0x8000) {
-			IOLog("VoodooSDHCI: S Returning error:  0x%x\n", *(volatile UInt32 *) & (this->PCIRegP[0]->NormalIntStatus));
-			ret = kIOReturnError;
-			goto out;
-		}
-		cnt++;
-		if (cnt > 100000) {
-			cnt = 0;
-			pass++;
-			IOLog("VoodooSDHCI:  Stuck in while loop 1: pass = %d"
-				" status = 0x%x state = 0x%x\n", pass, 
-				*(volatile UInt32 *)&(this->PCIRegP[0]->
-					NormalIntStatus),
-				this->PCIRegP[0]->PresentState);
-			if (pass > 10) {
-				ret = kIOReturnError;
-				goto out;
-			}
+	return req->status;
+}
+
+/*
+ * setProperties:  Registry hook for user space control.  Setting
+ *		   IOTraceCapture to true or false turns I/O trace capture
+ *		   on or off; setting IOTraceDump publishes the captured
+ *		   trace in the IOTrace property, and CommandTraceDump the
+ *		   command trace in CommandTrace.  Setting CardCache to
+ *		   data previously published there restores the card cache.
+ *		   Like the raw command user client, only administrators
+ *		   may do any of this.
+ *	OSObject *properties:  Dictionary of properties to set
+ */
+IOReturn VoodooSDHC::setProperties(OSObject *properties) {
+	OSDictionary *dict = OSDynamicCast(OSDictionary, properties);
+	OSBoolean *capture;
+	OSData *cache;
+
+	if (dict == NULL)
+		return kIOReturnBadArgument;
+	if (IOUserClient::clientHasPrivilege(current_task(), kIOClientPrivilegeAdministrator) !=
+	    kIOReturnSuccess)
+		return kIOReturnNotPrivileged;
+	if ((capture = OSDynamicCast(OSBoolean, dict->getObject(kVoodooSDHCTraceCaptureKey))) != NULL) {
+		if (capture->isTrue() && ioTrace == NULL) {
+			SDIOTraceRecord_t *ring = (SDIOTraceRecord_t *)
+				IOMalloc(IO_TRACE_ENTRIES * sizeof(SDIOTraceRecord_t));
+			if (ring == NULL)
+				return kIOReturnNoMemory;
+			bzero(ring, IO_TRACE_ENTRIES * sizeof(SDIOTraceRecord_t));
+			ioTraceNext = 0;
+			ioTrace = ring;
 		}
-			::IODelay(10);
+		ioTraceOn = capture->isTrue();
+		setProperty(kVoodooSDHCTraceCaptureKey, ioTraceOn);
 	}
+	if (dict->getObject(kVoodooSDHCTraceDumpKey) != NULL)
+		publishIOTrace();
+	if (dict->getObject(kVoodooSDHCCmdTraceDumpKey) != NULL)
+		publishCmdTrace();
+	if ((cache = OSDynamicCast(OSData, dict->getObject(kVoodooSDHCCardCacheKey))) != NULL) {
+		if (cache->getLength() != sizeof(cardCache) ||
+		    ! cardCacheValid((const SDCardCacheEntry_t *)cache->getBytesNoCopy()))
+			return kIOReturnBadArgument;
+		lock.lock();
+		IOLockLock(mediaStateLock);
+		bcopy(cache->getBytesNoCopy(), cardCache, sizeof(cardCache));
+		if (cardPresence == kCardIsPresent)
+			cardCacheFind(0);
+		else
+			cardCacheEntry = NULL;
+		IOLockUnlock(mediaStateLock);
+		lock.unlock();
+		publishCardCache();
+	}
+	return kIOReturnSuccess;
+}
 
-	/* Read block from card */
-	read_block_pio(&this->PCIRegP[0]->BufferDataPort, pBuff);
-
-	ret = kIOReturnSuccess;
+/*
+ * traceIO:  Record a finished I/O in the capture ring.  Callers only get
+ *	     here with capture on; slots are claimed atomically so no lock
+ *	     is taken.
+ *	const SDRequest_t *req:  The finished request
+ *	UInt32 options:  IOStorageAttributes options of the request
+ *	UInt64 start:  traceClock() at submission
+ */
+void VoodooSDHC::traceIO(const SDRequest_t *req, UInt32 options, UInt64 start) {
+	UInt64 end = traceClock();
+	SDIOTraceRecord_t *rec =
+		&ioTrace[(UInt64)OSIncrementAtomic64(&ioTraceNext) % IO_TRACE_ENTRIES];
+
+	rec->start = start;
+	rec->block = req->block;
+	rec->nblks = (UInt32)req->nblks;
+	rec->latency = (UInt32)MIN(end - start, 0xFFFFFFFFULL);
+	rec->status = req->status;
+	rec->options = (UInt16)options;
+	rec->read = req->read;
+	rec->reserved = 0;
+}
 
-out:
-	this->PCIRegP[0]->NormalIntStatus =
-				(BuffReadReady|XferComplete|CmdComplete);
-	return ret;
+/*
+ * publishIOTrace:  Copy the capture ring, oldest record first, into the
+ *		    IOTrace property.
+ */
+void VoodooSDHC::publishIOTrace(void) {
+	OSData *data;
+
+	if (ioTrace == NULL)
+		return;
+	data = copyTraceRing(ioTrace, (UInt64)ioTraceNext,
+		IO_TRACE_ENTRIES, sizeof(SDIOTraceRecord_t));
+	if (data == NULL)
+		return;
+	setProperty(kVoodooSDHCTraceKey, data);
+	data->release();
 }
 
+#if USE_CMD_TRACE
 /*
- * writeBlockMulti_pio:  Write multiple blocks to the card using PIO not DMA
- *			 mode.  The host controller must be locked when this
- *			 function is called.
- *		IOMemoryDescriptor *buffer:  Buffer operation class.  Defines
- *				read/write, address of operation, etc.
- *		UInt32 block:  Block offset to read/write
- *		UInt32 nblks:  Number of blocks to read/write
- *		UInt32 offset:  Offset from beginning of transfer - where in
- *				final buffer we should begin placing data
+ * traceCmd:  Record a host event in a slot's command trace.  Safe from any
+ *	      context: slots are claimed atomically and nothing is locked.
+ *	      No registers are read here; callers pass what they have read.
+ *	UInt8 slot:  Host controller/slot number
+ *	UInt8 event:  kSDTrace*
+ *	UInt8 opcode:  Command the event belongs to
+ *	UInt32 arg:  Command argument, or status bits being waited for
+ *	UInt16 normal:  Normal Interrupt Status, or 0
+ *	UInt32 response:  Response[0] at command completion, or 0
+ *	UInt16 error:  Error Interrupt Status at an error, or 0
  */
-IOReturn VoodooSDHC::writeBlockMulti_pio(IOMemoryDescriptor *buffer,
-				UInt32 block, UInt32 nblks, UInt32 offset) {
-	UInt8 buff[512];	// Temporary storage for data block
-	int cnt, pass;
-	UInt32 *pBuff;
-	IOReturn ret;
+void VoodooSDHC::traceCmd(UInt8 slot, UInt8 event, UInt8 opcode, UInt32 arg, UInt16 normal,
+			  UInt32 response, UInt16 error) {
+	SDCmdTraceRecord_t *rec;
+
+	if (cmdTrace[slot] == NULL)
+		return;
+	rec = &cmdTrace[slot][(UInt64)OSIncrementAtomic64(&cmdTraceNext[slot]) % CMD_TRACE_ENTRIES];
+	rec->time = traceClock();
+	rec->event = event;
+	rec->opcode = opcode;
+	rec->arg = arg;
+	rec->response = response;
+	rec->normal = normal;
+	rec->error = error;
+	rec->reserved = 0;
+}
+#endif /* USE_CMD_TRACE */
 
-#ifndef NO_RESET_WAR
-	// Reset card before every operation.  The Linux driver does this
-	// for this host controller.  Not sure why.
-	Reset(0, CMD_RESET);
-	Reset(0, DAT_RESET);
-#endif
-	
-	this->PCIRegP[0]->NormalIntStatusEn = -1;
-	this->PCIRegP[0]->ErrorIntStatusEn = -1;
-	this->PCIRegP[0]->NormalIntStatus = 
-			BuffWriteReady | XferComplete | CmdComplete;
-	this->PCIRegP[0]->TimeoutControl = 0xe;
+/*
+ * publishCmdTrace:  Publish the command trace of every slot, oldest event
+ *		     first, as an array of data in the CommandTrace property.
+ */
+void VoodooSDHC::publishCmdTrace(void) {
+	OSArray *slots;
+	OSData *data;
+
+	if ((slots = OSArray::withCapacity(6)) == NULL)
+		return;
+	for (int i = 0; i < 6 && cmdTrace[i] != NULL; i++) {
+		data = copyTraceRing(cmdTrace[i], (UInt64)cmdTraceNext[i],
+			CMD_TRACE_ENTRIES, sizeof(SDCmdTraceRecord_t));
+		if (data == NULL)
+			break;
+		slots->setObject(data);
+		data->release();
+	}
+	setProperty(kVoodooSDHCCmdTraceKey, slots);
+	slots->release();
+}
 
-	this->PCIRegP[0]->BlockSize = 512;
-	this->PCIRegP[0]->BlockCount = nblks;
+/*
+ * statTime:  Count a latency sample in one of a slot's histograms.
+ *	UInt8 slot:  Host controller/slot number
+ *	UInt8 type:  kSDStat*
+ *	UInt64 start:  traceClock() when the operation began
+ */
+void VoodooSDHC::statTime(UInt8 slot, UInt8 type, UInt64 start) {
+	UInt64 us = (traceClock() - start) / 1000;
+	int b;
 
-	SDCommand(0, SD_APP_CMD, SDCR55, this->RCA << 16);
-	SDCommand(0, SD_APP_SET_WR_BLK_ERASE_COUNT, SDCR23, nblks);
-	SDCommand(0, SD_WRITE_MULTIPLE_BLOCK, SDCR24, isHighCapacity ? block : block * 512);
+	for (b = 0; us != 0 && b < SD_STAT_BUCKETS - 1; b++)
+		us >>= 1;
+	OSIncrementAtomic(&stats[slot].hist[type][b]);
+}
 
-	for (int i = 0; i < nblks; i++) {
-		buffer->readBytes((offset + i) * 512, buff, 1 * 512);
+/*
+ * statIO:  Account for a finished request.
+ *	UInt8 slot:  Host controller/slot number
+ *	const SDRequest_t *req:  The finished request
+ *	UInt64 start:  traceClock() at submission
+ */
+void VoodooSDHC::statIO(UInt8 slot, const SDRequest_t *req, UInt64 start) {
+	int dir = req->read ? 0 : 1;
 
-		pBuff = (UInt32*)buff;
+	statTime(slot, req->read ? kSDStatRead : kSDStatWrite, start);
+	if (req->status != kIOReturnSuccess) {
+		OSIncrementAtomic(&stats[slot].errors);
+		return;
+	}
+	OSIncrementAtomic64(&stats[slot].ops[dir]);
+	OSAddAtomic64(req->nblks * 512, &stats[slot].bytes[dir]);
+}
 
-		cnt = pass = 0;
-                while(!(this->PCIRegP[0]->PresentState &
-                                                      SDHCI_SPACE_AVAILABLE)) {
-			cnt++;
-
-			if (this->PCIRegP[0]->NormalIntStatus & 0x8000) {
-				IOLog("VoodooSDHCI 2 Returning error:  0x%x\n",
-			      		*(volatile UInt32 *)
-			      		&(this->PCIRegP[0]->NormalIntStatus));
-				ret = kIOReturnError;
-				goto out;
+/*
+ * publishStats:  Publish every slot's statistics as an array of
+ *		  dictionaries in the Statistics property.  Called from the
+ *		  media poll timer; skipped when nothing has happened since
+ *		  the last time.
+ */
+void VoodooSDHC::publishStats(void) {
+	static const char *histNames[kSDStatCount] = {
+		"ReadLatency", "WriteLatency", "DMAWaitLatency", "BusyWaitLatency", "ReinitLatency",
+		"RegWaitLatency"
+	};
+	OSArray *slots, *hist;
+	OSDictionary *dict;
+	OSNumber *num;
+	SInt64 total = 0;
+
+	// Every counter only grows, so the sum changes whenever any of them does
+	for (int i = 0; i < slotCount; i++)
+		total += stats[i].ops[0] + stats[i].ops[1] + stats[i].errors + stats[i].retries +
+			stats[i].timeouts + stats[i].reinits + stats[i].stalls + stats[i].resumedBlocks;
+	if (total == statsPublished)
+		return;
+	statsPublished = total;
+
+	if ((slots = OSArray::withCapacity(slotCount)) == NULL)
+		return;
+	for (int i = 0; i < slotCount; i++) {
+		SDStats_t *st = &stats[i];
+		const struct { const char *key; UInt64 value; } counters[] = {
+			{ "Reads", (UInt64)st->ops[0] },
+			{ "Writes", (UInt64)st->ops[1] },
+			{ "BytesRead", (UInt64)st->bytes[0] },
+			{ "BytesWritten", (UInt64)st->bytes[1] },
+			{ "Errors", (UInt64)st->errors },
+			{ "Retries", (UInt64)st->retries },
+			{ "Timeouts", (UInt64)st->timeouts },
+			{ "Reinits", (UInt64)st->reinits },
+			{ "Stalls", (UInt64)st->stalls },
+			{ "ResumedBlocks", (UInt64)st->resumedBlocks }
+		};
+
+		if ((dict = OSDictionary::withCapacity(16)) == NULL)
+			break;
+		for (unsigned c = 0; c < sizeof(counters) / sizeof(counters[0]); c++) {
+			if ((num = OSNumber::withNumber(counters[c].value, 64)) != NULL) {
+				dict->setObject(counters[c].key, num);
+				num->release();
 			}
-			if (cnt > 100000) {
-				cnt = 0;
-				pass++;
-				IOLog("VoodooSDHCI:  Stuck in while loop 2: pass = %d"
-			      		" status = 0x%x\n", pass,
-			      		this->PCIRegP[0]->NormalIntStatus);
-				if (pass > 10) {
-					ret = kIOReturnError;
-					goto out;
+		}
+		for (int t = 0; t < kSDStatCount; t++) {
+			if ((hist = OSArray::withCapacity(SD_STAT_BUCKETS)) == NULL)
+				continue;
+			for (int b = 0; b < SD_STAT_BUCKETS; b++) {
+				if ((num = OSNumber::withNumber((UInt64)st->hist[t][b], 32)) != NULL) {
+					hist->setObject(num);
+					num->release();
 				}
-			}	
-			::IODelay(10);
+			}
+			dict->setObject(histNames[t], hist);
+			hist->release();
 		}
+		slots->setObject(dict);
+		dict->release();
+	}
+	setProperty(kVoodooSDHCStatsKey, slots);
+	slots->release();
+}
 
-                this->PCIRegP[0]->NormalIntStatus =
-                                this->PCIRegP[0]->NormalIntStatus;
-
-		for (int j = 0; j < 128; j++) {
-			this->PCIRegP[0]->BufferDataPort = *pBuff;
-			pBuff++;			
-		}
+/*
+ * tuneDefaults:  Transfer settings used until a card is characterized.
+ */
+void VoodooSDHC::tuneDefaults(void) {
+	tuning.readBlocks = 0;
+	tuning.writeBlocks = 0;
+	tuning.writeAlign = 0;
+	tuning.sdmaBoundary = SDMA_BUFFER_SIZE;
+	tuning.preEraseBlocks = PRE_ERASE_BLOCKS;
+}
 
+/*
+ * tuneCard:  Pick transfer settings for a newly inserted card.  A card
+ *	      characterized before gets its cached settings; any other card
+ *	      gets the defaults, and is characterized before its first I/O
+ *	      when USE_AUTOTUNE is on.  Called after cardInit.
+ *	UInt8 slot:  slot the card is in
+ */
+void VoodooSDHC::tuneCard(UInt8 slot) {
+	tunePending = false;
+	if (cardCacheEntry != NULL && cardCacheEntry->tuned) {
+		tuning = cardCacheEntry->tuning;
+		publishTuning();
+		return;
 	}
+	tuneDefaults();
+	tunePending = USE_AUTOTUNE;
+}
 
-	cnt = pass = 0;
-	while ((this->PCIRegP[0]->NormalIntStatus & XferComplete) !=
-	       					XferComplete) {
-		cnt++;
-		if (this->PCIRegP[0]->NormalIntStatus & 0x8000) {
-			IOLog("VoodooSDHCI 3 Returning error:  0x%x\n",
-		      		*(volatile UInt32 *)
-		      		&(this->PCIRegP[0]->NormalIntStatus));
-			ret = kIOReturnError;
-			goto out;
-		}
-
-		if (cnt > 100000) {
-			cnt = 0;
-			pass++;
-			IOLog("VoodooSDHCI:  Stuck in while loop 3: pass = %d"
-		      		" status = 0x%x\n", pass,
-		      		this->PCIRegP[0]->NormalIntStatus);
-			if (pass > 10) {
-				ret = kIOReturnError;
-				goto out;
-			}
+/*
+ * cardCacheFind:  Look the card up by the CID just read.  Sets
+ *		   cardCacheEntry, or clears it for a card not seen before.
+ *	UInt8 slot:  slot the card is in
+ */
+void VoodooSDHC::cardCacheFind(UInt8 slot) {
+	cardCacheEntry = NULL;
+	auSize = 0;
+	for (int i = 0; i < SD_CARD_CACHE_ENTRIES; i++) {
+		if (cardCache[i].version == SD_CARD_CACHE_VERSION &&
+		    memcmp(&cardCache[i].cid, SDCIDReg + slot, sizeof(SDCIDReg_t)) == 0) {
+			cardCacheEntry = &cardCache[i];
+			auSize = cardCacheEntry->auSize;
+			return;
 		}
 	}
-	this->PCIRegP[0]->NormalIntStatus =
-				BuffWriteReady | XferComplete | CmdComplete;	
-	ret = kIOReturnSuccess;
-
-out:
-	return ret;
 }
 
 /*
- * writeBlockSingle_pio:  Read a single block from the card using PIO not DMA
- *			  mode.  The host controller must be locked when this
- *			  function is called.
- *		IOMemoryDescriptor *buffer:  Buffer operation class.  Defines
- *				read/write, address of operation, etc.
- *		UInt32 block:  Block offset to read/write
- *		UInt32 offset:  Offset from beginning of transfer - where in
- *				final buffer we should begin placing data
+ * cardCacheCheck:  Drop the card's entry if the capacity just read does
+ *		    not match it; the CID alone is not trusted.
+ *	UInt8 slot:  slot the card is in
  */
-IOReturn VoodooSDHC::writeBlockSingle_pio(IOMemoryDescriptor *buffer,
-			UInt32 block, UInt32 offset) {
-	UInt8 buff[512];	// Temporary storage for data block
-	int cnt, pass;
-	UInt32 *pBuff;
-	IOReturn ret;
+void VoodooSDHC::cardCacheCheck(UInt8 slot) {
+	if (cardCacheEntry != NULL && cardCacheEntry->maxBlock != maxBlock) {
+		IOLog("VoodooSDHCI: card does not match its cache entry, probing\n");
+		cardCacheEntry->version = 0;
+		cardCacheEntry = NULL;
+		auSize = 0;
+	}
+}
 
-	pBuff = (UInt32*)buff;
+/*
+ * cardCacheStore:  Record what cardInit found out about the card, keeping
+ *		    any characterized settings already cached for it.
+ *	UInt8 slot:  slot the card is in
+ */
+void VoodooSDHC::cardCacheStore(UInt8 slot) {
+	if (cardCacheEntry == NULL) {
+		cardCacheEntry = &cardCache[cardCacheNext];
+		cardCacheNext = (cardCacheNext + 1) % SD_CARD_CACHE_ENTRIES;
+		bzero(cardCacheEntry, sizeof(*cardCacheEntry));
+		cardCacheEntry->cid = SDCIDReg[slot];
+		cardCacheEntry->version = SD_CARD_CACHE_VERSION;
+	}
+	cardCacheEntry->maxBlock = maxBlock;
+	cardCacheEntry->auSize = auSize;
+	cardCacheEntry->timing = isMMC ? mmcTiming : kMMCTimingLegacy;
+	cardCacheEntry->cmdqDepth = cmdqDepth;
+	publishCardCache();
+}
 
-	buffer->readBytes(offset * 512, buff, 1 * 512);
+/*
+ * cardCacheValid:  Check a card cache handed in through CardCache before
+ *		    it replaces the driver's.  Every entry in use must hold
+ *		    settings characterize could have picked: read and write
+ *		    command sizes of 1 to 2048 blocks, an SDMA boundary that
+ *		    is a power of two from 4K to SDMA_BUFFER_SIZE, a write
+ *		    alignment and pre-erase threshold of at most 2048 blocks
+ *		    (0 meaning none), and a known timing and queue depth.
+ *		    One bad entry rejects the whole cache.
+ *	const SDCardCacheEntry_t *entries:  SD_CARD_CACHE_ENTRIES entries
+ */
+bool VoodooSDHC::cardCacheValid(const SDCardCacheEntry_t *entries) {
+	for (int i = 0; i < SD_CARD_CACHE_ENTRIES; i++) {
+		const SDCardCacheEntry_t *e = &entries[i];
+		const SDTuning_t *t = &e->tuning;
+
+		if (e->version != SD_CARD_CACHE_VERSION)
+			continue;
+		if (e->timing > kMMCTimingHS400 || e->cmdqDepth > CMDQ_MAX_DEPTH ||
+		    e->tuned > 1 || e->auSize > 65536)
+			return false;
+		if (! e->tuned)
+			continue;
+		if (t->readBlocks == 0 || t->readBlocks > TUNE_BLOCKS ||
+		    t->writeBlocks == 0 || t->writeBlocks > TUNE_BLOCKS ||
+		    t->writeAlign > TUNE_BLOCKS || t->preEraseBlocks > TUNE_BLOCKS ||
+		    t->sdmaBoundary < 4096 || t->sdmaBoundary > SDMA_BUFFER_SIZE ||
+		    (t->sdmaBoundary & (t->sdmaBoundary - 1)) != 0)
+			return false;
+	}
+	return true;
+}
 
-#ifndef NO_RESET_WAR
-	// Reset card before every operation.  The Linux driver does this
-	// for this host controller.  Not sure why.
-	Reset(0, CMD_RESET);
-	Reset(0, DAT_RESET);
-#endif
+/*
+ * publishCardCache:  Publish the card cache in the CardCache property.
+ */
+void VoodooSDHC::publishCardCache(void) {
+	OSData *data;
 
-	this->PCIRegP[0]->TransferMode = 0;
-	this->PCIRegP[0]->NormalIntStatusEn = -1;
-	this->PCIRegP[0]->ErrorIntStatusEn = -1;
-	this->PCIRegP[0]->NormalIntStatus = 
-				BuffWriteReady | XferComplete | CmdComplete;
-	this->PCIRegP[0]->TimeoutControl = 0xe;
+	if ((data = OSData::withBytes(cardCache, sizeof(cardCache))) == NULL)
+		return;
+	setProperty(kVoodooSDHCCardCacheKey, data);
+	data->release();
+}
 
-	SDCommand(0, SD_WRITE_BLOCK, SDCR24, isHighCapacity ? block : block * 512);
+/*
+ * timeTransfer:  Time one characterization transfer of TUNE_BLOCKS blocks
+ *		  with the current settings.  A write first reads the same
+ *		  blocks, untimed, and writes them back unchanged.  Returns
+ *		  the elapsed time in ns, or 0 on error.
+ *	IOMemoryDescriptor *buffer:  TUNE_BLOCKS blocks of scratch memory
+ *	UInt32 block:  First block of the transfer
+ *	bool read:  true to time a read, false to time a write
+ */
+UInt64 VoodooSDHC::timeTransfer(IOMemoryDescriptor *buffer, UInt32 block, bool read) {
+	UInt64 start;
+
+	if (! read && transferBlocks(buffer, block, TUNE_BLOCKS, true) != kIOReturnSuccess)
+		return 0;
+	start = traceClock();
+	if (transferBlocks(buffer, block, TUNE_BLOCKS, read) != kIOReturnSuccess)
+		return 0;
+	return traceClock() - start + 1;
+}
 
-	cnt = pass = 0;
-	while ((this->PCIRegP[0]->NormalIntStatus & BuffWriteReady) !=
-							BuffWriteReady) {
-		cnt++;
+/*
+ * characterize:  Measure the card and keep the fastest settings: the read
+ *		  command size, then the SDMA boundary at that size, then
+ *		  the write command size and the largest write alignment
+ *		  that beats writes straddling it by more than 1/8.  Runs
+ *		  on a scratch area in the middle of the card.  The host
+ *		  controller must be locked when this function is called.
+ *	UInt8 slot:  slot the card is in
+ */
+void VoodooSDHC::characterize(UInt8 slot) {
+	static const UInt32 sizes[] = { 8, 32, 128, 512, 2048 };
+	static const UInt32 bounds[] = { 32768, 16384, 8192, 4096 };
+	static const UInt32 aligns[] = { 256, 64, 16 };
+	const unsigned nsizes = sizeof(sizes) / sizeof(sizes[0]);
+	IOBufferMemoryDescriptor *buffer;
+	UInt64 t[8], straddle;
+	UInt32 region;
+	unsigned i;
+
+	// The queue engine ignores these settings, and small cards have no room
+	if (cqeDepth > 0 || maxBlock < 4 * TUNE_BLOCKS)
+		return;
+	if ((buffer = IOBufferMemoryDescriptor::withCapacity(TUNE_BLOCKS * 512, kIODirectionInOut)) == NULL)
+		return;
+	region = (maxBlock / 2) & ~(TUNE_BLOCKS - 1);
+	tuneDefaults();
+
+	for (i = 0; i < nsizes; i++) {
+		tuning.readBlocks = sizes[i];
+		if ((t[i] = timeTransfer(buffer, region, true)) == 0)
+			goto fail;
+	}
+	tuning.readBlocks = sizes[pickBest(t, nsizes)];
 
-		if (this->PCIRegP[0]->NormalIntStatus & 0x8000) {
-			IOLog("VoodooSDHCI: 2 Returning error:  0x%x\n",
-				*(volatile UInt32 *)
-					&(this->PCIRegP[0]->NormalIntStatus));
-			ret = kIOReturnError;
-			goto out;
+	if (engine == kSDEngineSDMA) {
+		for (i = 0; i < sizeof(bounds) / sizeof(bounds[0]); i++) {
+			tuning.sdmaBoundary = bounds[i];
+			if ((t[i] = timeTransfer(buffer, region, true)) == 0)
+				goto fail;
 		}
-
-		if (cnt > 100000) {
-			cnt = 0;
-			pass++;
-			IOLog("VoodooSDHCI:  Stuck in while loop 2: pass = %d"
-				" status = 0x%x\n", pass,
-				this->PCIRegP[0]->NormalIntStatus);
-			if (pass > 10) {
-				ret = kIOReturnError;
-				goto out;
-			}
-		}				
+		tuning.sdmaBoundary = bounds[pickBest(t, i)];
 	}
 
-	for (int j = 0; j < 128; j++) {
-		this->PCIRegP[0]->BufferDataPort = *pBuff;
-		pBuff++;			
+#ifndef READONLY_DRIVER
+	for (i = 0; i < nsizes; i++) {
+		tuning.writeBlocks = sizes[i];
+		if ((t[i] = timeTransfer(buffer, region, false)) == 0)
+			goto fail;
 	}
-
-	cnt = pass = 0;
-	while ((this->PCIRegP[0]->NormalIntStatus & XferComplete) !=
-							XferComplete) {
-		cnt++;
-
-		if (this->PCIRegP[0]->NormalIntStatus & 0x8000) {
-			IOLog("VoodooSDHCI 3 Returning error:  0x%x\n",
-				*(volatile UInt32 *)
-					&(this->PCIRegP[0]->NormalIntStatus));
-			ret = kIOReturnError;
-			goto out;
+	tuning.writeBlocks = sizes[pickBest(t, nsizes)];
+
+	// Smallest write the pre-erase hint speeds up
+	if (! isMMC) {
+		UInt32 save = tuning.writeBlocks;
+
+		for (i = 0; i < nsizes; i++) {
+			tuning.writeBlocks = sizes[i];
+			tuning.preEraseBlocks = 0;
+			t[0] = timeTransfer(buffer, region, false);
+			tuning.preEraseBlocks = 1;
+			t[1] = timeTransfer(buffer, region, false);
+			if (t[0] == 0 || t[1] == 0)
+				goto fail;
+			if (t[1] + t[1] / TUNE_TOLERANCE < t[0])
+				break;
 		}
+		tuning.preEraseBlocks = i < nsizes ? sizes[i] : 0;
+		tuning.writeBlocks = save;
+	}
 
-		if (cnt > 100000) {
-			cnt = 0;
-			pass++;
-			IOLog("VoodooSDHCI:  stuck in while loop #3: pass = %d"
-				" status = 0x%x\n", pass,
-				this->PCIRegP[0]->NormalIntStatus);
-			if (pass > 10) {
-				ret = kIOReturnError;
-				goto out;
-			}
+	for (i = 0; i < sizeof(aligns) / sizeof(aligns[0]); i++) {
+		UInt32 save = tuning.writeBlocks;
+
+		tuning.writeBlocks = aligns[i];
+		t[0] = timeTransfer(buffer, region, false);
+		straddle = timeTransfer(buffer, region + aligns[i] / 2, false);
+		tuning.writeBlocks = save;
+		if (t[0] == 0 || straddle == 0)
+			goto fail;
+		if (t[0] + t[0] / 8 < straddle) {
+			tuning.writeAlign = aligns[i];
+			break;
 		}
 	}
-	this->PCIRegP[0]->NormalIntStatus =
-			BuffWriteReady | XferComplete | CmdComplete;	
-	ret = kIOReturnSuccess;
+#endif
 
-out:
-	return ret;
+	IOLog("VoodooSDHCI: tuned card: read %d blocks, write %d blocks, write alignment %d, SDMA boundary %d, pre-erase %d\n",
+		(int)tuning.readBlocks, (int)tuning.writeBlocks, (int)tuning.writeAlign,
+		(int)tuning.sdmaBoundary, (int)tuning.preEraseBlocks);
+	if (cardCacheEntry != NULL) {
+		cardCacheEntry->tuning = tuning;
+		cardCacheEntry->tuned = true;
+		publishCardCache();
+	}
+	buffer->release();
+	publishTuning();
+	return;
+fail:
+	IOLog("VoodooSDHCI: card characterization failed, using defaults\n");
+	tuneDefaults();
+	buffer->release();
+}
+
+/*
+ * publishTuning:  Publish the settings in use in the Tuning property.
+ */
+void VoodooSDHC::publishTuning(void) {
+	const struct { const char *key; UInt32 value; } values[] = {
+		{ "ReadBlocks", tuning.readBlocks },
+		{ "WriteBlocks", tuning.writeBlocks },
+		{ "WriteAlignment", tuning.writeAlign },
+		{ "SDMABoundary", tuning.sdmaBoundary },
+		{ "PreEraseBlocks", tuning.preEraseBlocks }
+	};
+	OSDictionary *dict;
+	OSNumber *num;
+
+	if ((dict = OSDictionary::withCapacity(5)) == NULL)
+		return;
+	for (unsigned i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+		if ((num = OSNumber::withNumber(values[i].value, 32)) != NULL) {
+			dict->setObject(values[i].key, num);
+			num->release();
+		}
+	}
+	setProperty(kVoodooSDHCTuningKey, dict);
+	dict->release();
 }
 
 /*
@@ -1490,256 +4762,71 @@ IOReturn VoodooSDHC::doAsyncReadWrite(IOMemoryDescriptor *buffer,
 									  UInt64 block, UInt64 nblks,
 									  IOStorageAttributes *attributes,
 									  IOStorageCompletion *completion) {
-	UInt8 buff[512];	// Temporary storage for data block
-	int ret = 0;
-	int locked;
-	UInt64 blk, n;
-	
-	// All access to the card must be done while this lock is held
-	lock.lock();
-	locked = 1;
-	
-	if (cardPresence != kCardIsPresent || ! isCardPresent(0)) {
-		ret = kIOReturnNoMedia;
-		goto out;
-	}
-#ifdef __DEBUG__
-	IOLog("VoodooSDHCI: in doAsyncReadWrite function :: block == %d, nblks == %d, ", block, nblks);
-#endif
-	if (buffer->getDirection() == kIODirectionIn) {
-		/* Read from Card */
-#ifdef __DEBUG__
-		IOLog("READING FROM CARD!\n");
-#endif
-		blk = block;
-		n = nblks;
-		while (n) {
-			if (USE_SDMA) {
-				int i;
-				for (i = 0; i < SDMA_RETRY_COUNT; i++)
-					if ((ret = sdma_access(buffer, block, nblks, true)) != kIOReturnTimeout)
-						break;
-				if (i != 0)
-					IOLog("VoodooSDHCI: retry succeeded\n");
-				n = 0;
-			} else if ((nblks > 1) && USE_MULTIBLOCK) {
-				int b = MIN(2048 /* should fit in sdma buff */, n);
-				
-				ret = readBlockMulti_pio(buffer, blk, b,
-										 blk - block);
-				n -= b;
-				blk += b;
-			} else {
-				ret = readBlockSingle_pio(buff, blk);
-				buffer->writeBytes((blk - block) * 512,
-								   buff, 1 * 512);
-				n--;
-				blk++;
-			}
-			if (ret != kIOReturnSuccess) goto out;
-#ifdef __DEBUG__
-			IOLog("VoodooSDHCI:  ret = 0x%x block = %d\n", ret, blk);;
-#endif /* __DEBUG__ */
-		}
-	} else {
-		/* Write to Card */
+	SDRequest_t req;
+	IOReturn ret;
+	UInt64 start = traceClock();
+
 #ifdef __DEBUG__
-		IOLog("WRITING TO CARD!\n");
-#endif
-		
-#ifdef READONLY_DRIVER
-		// When compiled in this mode, the driver fails all write
-		// operations.  Useful for testing to gain confidence in
-		// code without trashing data.  Define must be set at top
-		// of file.
-		ret = kIOReturnError;
-		goto out;
+	IOLog("VoodooSDHCI: in doAsyncReadWrite function :: block == %d, nblks == %d\n", (int)block, (int)nblks);
 #endif
-		blk = block;
-		n = nblks;
-		while (n) {
-			if (USE_SDMA) {
-				int i;
-				for (i = 0; i < SDMA_RETRY_COUNT; i++)
-					if ((ret = sdma_access(buffer, block, nblks, false)) != kIOReturnTimeout)
-						break;
-				if (i != 0)
-					IOLog("VoodooSDHCI: retry succeeded\n");
-				n = 0;
-			} 
-			else if ((nblks > 1) && USE_MULTIBLOCK) {
-				int b = MIN(2048, n);
-				ret = writeBlockMulti_pio(buffer, blk, b,
-										  blk - block);
-				n -= b;
-				blk += b;
-			} else {
-				ret = writeBlockSingle_pio(buffer, blk,
-										   blk - block);
-				n--;
-				blk++;
-			}
-			if (ret != kIOReturnSuccess) goto out;
-		}
-		
-	}
-	
-	locked = 0;
-	lock.unlock();
-	
+	req.buffer = buffer;
+	req.block = block;
+	req.nblks = nblks;
+	req.read = buffer->getDirection() == kIODirectionIn;
+	req.raw = NULL;
+	ret = submitRequest(&req);
+	statIO(0, &req, start);
+	if (ioTraceOn)
+		traceIO(&req, attributes ? attributes->options : 0, start);
+	if (ret != kIOReturnSuccess)
+		return ret;
+
 	if(completion->action) {
 		(completion->action)(completion->target, completion->parameter, kIOReturnSuccess, nblks * 512);
 	} else {
 		IOLog("VoodooSDHCI ERROR!\n");
-		ret = kIOReturnError;
-		goto out;
-	}
-	ret = kIOReturnSuccess;
-	
-out:
-	switch (ret) {
-		case kIOReturnSuccess:
-			break;
-		case kIOReturnNoMedia:
-			/* require remount */
-			cardPresence = kCardRemount;
-			IOLog("VoodooSDHCI: media not present, require remount\n");
-			break;
+		return kIOReturnError;
 	}
-	if (locked)
-		lock.unlock();
-	//	in_read_write = 0;
-	return ret;
+	return kIOReturnSuccess;
 }
 #else /* !__LP64__ */
 IOReturn VoodooSDHC::doAsyncReadWrite(IOMemoryDescriptor *buffer,
 		UInt32 block, UInt32 nblks, IOStorageCompletion completion) {
-	UInt8 buff[512];	// Temporary storage for data block
-	int ret = 0;
-	int locked;
-	UInt32 blk, n;
-	
-	// All access to the card must be done while this lock is held
-	lock.lock();
-	locked = 1;
+	SDRequest_t req;
+	IOReturn ret;
+	UInt64 start = traceClock();
 
-	if (cardPresence != kCardIsPresent || ! isCardPresent(0)) {
-		ret = kIOReturnNoMedia;
-		goto out;
-	}
-#ifdef __DEBUG__
-	IOLog("VoodooSDHCI: in doAsyncReadWrite function :: block == %d, nblks == %d, ", block, nblks);
-#endif
-	if (buffer->getDirection() == kIODirectionIn) {
-		/* Read from Card */
-#ifdef __DEBUG__
-		IOLog("READING FROM CARD!\n");
-#endif
-		blk = block;
-		n = nblks;
-		while (n) {
-			if (USE_SDMA) {
-				int i;
-				for (i = 0; i < SDMA_RETRY_COUNT; i++)
-					if ((ret = sdma_access(buffer, block, nblks, true)) != kIOReturnTimeout)
-						break;
-				if (i != 0)
-					IOLog("VoodooSDHCI: retry succeeded\n");
-				n = 0;
-			} else if ((nblks > 1) && USE_MULTIBLOCK) {
-				int b = MIN(2048 /* should fit in sdma buff */, n);
-				
-				ret = readBlockMulti_pio(buffer, blk, b,
-					blk - block);
-				n -= b;
-				blk += b;
-			} else {
-				ret = readBlockSingle_pio(buff, blk);
-				buffer->writeBytes((blk - block) * 512,
-								buff, 1 * 512);
-				n--;
-				blk++;
-			}
-			if (ret != kIOReturnSuccess) goto out;
-#ifdef __DEBUG__
-			IOLog("VoodooSDHCI:  ret = 0x%x block = %d\n", ret, blk);;
-#endif /* __DEBUG__ */
-		}
-	} else {
-		/* Write to Card */
 #ifdef __DEBUG__
-		IOLog("WRITING TO CARD!\n");
-#endif
-		
-#ifdef READONLY_DRIVER
-		// When compiled in this mode, the driver fails all write
-		// operations.  Useful for testing to gain confidence in
-		// code without trashing data.  Define must be set at top
-		// of file.
-		ret = kIOReturnError;
-		goto out;
+	IOLog("VoodooSDHCI: in doAsyncReadWrite function :: block == %d, nblks == %d\n", block, nblks);
 #endif
-		blk = block;
-		n = nblks;
-		while (n) {
-			if (USE_SDMA) {
-				int i;
-				for (i = 0; i < SDMA_RETRY_COUNT; i++)
-					if ((ret = sdma_access(buffer, block, nblks, false)) != kIOReturnTimeout)
-						break;
-				if (i != 0)
-					IOLog("VoodooSDHCI: retry succeeded\n");
-				n = 0;
-			} 
-			else if ((nblks > 1) && USE_MULTIBLOCK) {
-				int b = MIN(2048, n);
-				ret = writeBlockMulti_pio(buffer, blk, b,
-						blk - block);
-				n -= b;
-				blk += b;
-			} else {
-				ret = writeBlockSingle_pio(buffer, blk,
-						blk - block);
-				n--;
-				blk++;
-			}
-			if (ret != kIOReturnSuccess) goto out;
-		}
-
-	}
-	
-	locked = 0;
-	lock.unlock();
+	req.buffer = buffer;
+	req.block = block;
+	req.nblks = nblks;
+	req.read = buffer->getDirection() == kIODirectionIn;
+	req.raw = NULL;
+	ret = submitRequest(&req);
+	statIO(0, &req, start);
+	if (ioTraceOn)
+		traceIO(&req, 0, start);
+	if (ret != kIOReturnSuccess)
+		return ret;
 
 	if(completion.action) {
 		(*completion.action)(completion.target, completion.parameter, kIOReturnSuccess, nblks * 512);
 	} else {
 		IOLog("VoodooSDHCI ERROR!\n");
-		ret = kIOReturnError;
-		goto out;
-	}
-	ret = kIOReturnSuccess;
-	
-out:
-	switch (ret) {
-	case kIOReturnSuccess:
-		break;
-	case kIOReturnNoMedia:
-		/* require remount */
-		cardPresence = kCardRemount;
-		IOLog("VoodooSDHCI: media not present, require remount\n");
-		break;
+		return kIOReturnError;
 	}
-	if (locked)
-		lock.unlock();
-//	in_read_write = 0;
-	return ret;
+	return kIOReturnSuccess;
 }
 #endif /* !__LP64__ */
 
 
 void VoodooSDHC::handleInterrupt()
 {
+#if USE_CMD_TRACE
+	traceCmd(0, kSDTraceInterrupt, lastCommand[0], 0, 0, 0, 0);
+#endif
 	IOLockLock(sdmaCond);
 	IOLockWakeup(sdmaCond, sdmaCond, true);
 	IOLockUnlock(sdmaCond);
@@ -1754,6 +4841,7 @@ void VoodooSDHC::handleTimer()
 			kIOMessageMediaStateHasChanged,
 			(void*)(mediaPresent ? kIOMediaStateOnline: kIOMediaStateOffline),
 			0);
+	publishStats();
 	timerSrc->setTimeoutMS(1000);
 }
 
@@ -17,9 +17,213 @@
 #include <IOKit/storage/IOBlockStorageDriver.h>
 #include <IOKit/storage/IOBlockStorageDevice.h>
 #include <IOKit/IOBufferMemoryDescriptor.h>
+#include <IOKit/IODMACommand.h>
+#include <IOKit/pci/IOPCIDevice.h>
 #include <libkern/locks.h>
 #include "SD_DataTypes.h"
 
+struct SDRawCommand_t;
+
+/*
+ * A block I/O request waiting for the card.  Requests are queued by the
+ * submitting thread and may be carried out by whichever thread holds the
+ * card lock, so that several outstanding requests can be issued together.
+ * A raw command from the user client sets raw; its data moves through
+ * buffer and the card's response is returned in response.
+ */
+struct SDRequest_t {
+	IOMemoryDescriptor	*buffer;
+	UInt64			block;
+	UInt64			nblks;
+	bool			read;
+	bool			done;
+	IOReturn		status;
+	const SDRawCommand_t	*raw;
+	UInt32			response[4];
+	SDRequest_t		*next;
+};
+
+/*
+ * One I/O as seen at the doAsyncReadWrite entry, for trace capture.  The
+ * trace is published as an array of these in the IOTrace property.
+ */
+struct SDIOTraceRecord_t {
+	UInt64			start;		// submission time, ns since boot
+	UInt64			block;
+	UInt32			nblks;
+	UInt32			latency;	// ns from submission to completion
+	IOReturn		status;
+	UInt16			options;	// IOStorageAttributes options
+	UInt8			read;
+	UInt8			reserved;
+};
+
+#define kVoodooSDHCTraceCaptureKey	"IOTraceCapture"	// bool, turns capture on/off
+#define kVoodooSDHCTraceDumpKey		"IOTraceDump"		// any value, publishes IOTrace
+#define kVoodooSDHCTraceKey			"IOTrace"
+
+/*
+ * One host event for the per-slot command trace: a command being issued,
+ * a waited-for status arriving (or an error instead) or an interrupt.
+ */
+struct SDCmdTraceRecord_t {
+	UInt64			time;		// ns since boot
+	UInt32			arg;		// command argument, or awaited status bits
+	UInt32			response;	// Response[0] at command completion
+	UInt16			normal;		// NormalIntStatus
+	UInt16			error;		// ErrorIntStatus at an error
+	UInt8			event;		// kSDTrace*
+	UInt8			opcode;		// command, or last command issued
+	UInt16			reserved;
+};
+
+enum {
+	kSDTraceCommand,
+	kSDTraceStatus,
+	kSDTraceError,
+	kSDTraceInterrupt
+};
+
+#define kVoodooSDHCCmdTraceDumpKey	"CommandTraceDump"	// any value, publishes CommandTrace
+#define kVoodooSDHCCmdTraceKey		"CommandTrace"
+
+/*
+ * Always-on per-slot statistics.  Everything is updated with atomic adds,
+ * without the card lock, and published as the Statistics property.  Each
+ * histogram bucket n counts latencies in [2^(n-1), 2^n) microseconds.
+ */
+enum {
+	kSDStatRead,
+	kSDStatWrite,
+	kSDStatDMAWait,		// SDMA boundary interrupt to interrupt
+	kSDStatBusyWait,	// waiting for Transfer Complete / card busy
+	kSDStatReinit,
+	kSDStatRegWait,	// polling a host register past the first few reads
+	kSDStatCount
+};
+
+#define SD_STAT_BUCKETS	32
+
+struct SDStats_t {
+	volatile SInt32	hist[kSDStatCount][SD_STAT_BUCKETS];
+	volatile SInt64	ops[2];		// reads, writes
+	volatile SInt64	bytes[2];
+	volatile SInt32	errors;
+	volatile SInt32	retries;
+	volatile SInt32	timeouts;
+	volatile SInt32	reinits;
+	volatile SInt32	stalls;		// register waits that ran into their deadline
+	volatile SInt64	resumedBlocks;	// blocks retries did not have to move again
+};
+
+#define kVoodooSDHCStatsKey		"Statistics"
+
+/*
+ * Per-slot copy of the control registers only the driver writes, so that
+ * changing a bit is one MMIO write instead of a read and a write.  Bits the
+ * host sets by itself (internal clock stable, tuning results, a refused
+ * mode switch) are read from the register, and shadowLoad brings the copy
+ * back in line after a full reset or a tuning run.
+ */
+struct SDShadow_t {
+	UInt8	hostControl;
+	UInt8	powerControl;
+	UInt16	clockControl;
+	UInt16	hostControl2;
+};
+
+/*
+ * MMC bus timings, in the order cardInit can step through them.
+ */
+enum {
+	kMMCTimingLegacy,
+	kMMCTimingHS,
+	kMMCTimingDDR52,
+	kMMCTimingHS200,
+	kMMCTimingHS400
+};
+
+/*
+ * Controller and card quirks.  Most turn a fast path off where it is known
+ * to be broken; kSDQuirkHighSpeed turns one on where it is known to work.
+ * The host's quirks come from its PCI ID and version, the card's from its
+ * CID, and the card runs with both.
+ */
+enum {
+	kSDQuirkBrokenDMA		= 0x0001,	// PIO only
+	kSDQuirkBrokenADMA		= 0x0002,	// no ADMA2/ADMA3, hence no CQHCI either
+	kSDQuirkBrokenMultiBlock	= 0x0004,	// single block commands only
+	kSDQuirkBrokenACMD12		= 0x0008,	// stop multi-block transfers with CMD12
+	kSDQuirkResetPerCommand		= 0x0010,	// CMD and DAT reset before each transfer
+	kSDQuirkHighSpeed		= 0x0020,	// SD high speed (50MHz) works
+	kSDQuirkBrokenCMD23		= 0x0040	// no pre-defined multi-block transfers
+};
+
+#define kVoodooSDHCQuirksKey	"Quirks"
+
+/*
+ * Block transfer engines, slowest first.  The fastest one the controller
+ * and its quirks allow is picked when the card is initialized; a request
+ * that hits a DMA error moves down to the next one.
+ */
+enum {
+	kSDEnginePIO,
+	kSDEngineSDMA,
+	kSDEngineADMA32,
+	kSDEngineADMA64,
+	kSDEngineCount
+};
+
+#define kVoodooSDHCEngineKey	"TransferEngine"
+#define kVoodooSDHCBounceCopyKey	"BounceCopy"	// "movnti" or "bcopy"
+
+/*
+ * Bus settings error recovery has given up, until a run of clean transfers
+ * wins them back.
+ */
+enum {
+	kSDDegradeSlow		= 0x01,	// SD default speed, or one MMC timing lower
+	kSDDegradeNarrow	= 0x02	// 1 bit bus
+};
+
+#define kVoodooSDHCDegradeKey	"Degraded"
+
+/*
+ * Transfer settings for the card in the slot, picked by characterizing
+ * it at first insert.  A block count of 0 means no limit beyond what the
+ * host allows.
+ */
+struct SDTuning_t {
+	UInt32		readBlocks;	// blocks per read command
+	UInt32		writeBlocks;	// blocks per write command and write request
+	UInt32		writeAlign;	// write commands end on multiples of this, 0 if none
+	UInt32		sdmaBoundary;	// SDMA buffer boundary in bytes
+	UInt32		preEraseBlocks;	// SD: ACMD23 before writes this long, 0 for never
+};
+
+/*
+ * What was learned about a card, keyed by its CID, so that a returning
+ * card is brought up without probing for it again.  The capacity is a
+ * second identity check.  The whole cache is published in the CardCache
+ * property; writing the same data back into CardCache (e.g. from a boot
+ * script) restores it, so it can outlive the driver.
+ */
+struct SDCardCacheEntry_t {
+	SDCIDReg_t	cid;
+	UInt32		maxBlock;
+	SDTuning_t	tuning;
+	UInt32		auSize;		// SD allocation unit in KB, 0 if unknown
+	UInt8		version;	// SD_CARD_CACHE_VERSION if the entry is in use
+	UInt8		timing;		// MMC: kMMCTiming* reached
+	UInt8		cmdqDepth;	// SD command queue depth, 0 if none
+	UInt8		tuned;		// tuning holds characterized settings
+};
+
+#define SD_CARD_CACHE_ENTRIES	8
+#define SD_CARD_CACHE_VERSION	2
+#define kVoodooSDHCTuningKey	"Tuning"
+#define kVoodooSDHCCardCacheKey	"CardCache"
+
 class VoodooSDHC : public IOBlockStorageDevice
 {
 	
@@ -37,6 +241,8 @@ public:
 	virtual void 	stop 	( IOService * provider );
 
 private:
+	friend class VoodooSDHCUserClient;	// raw commands go through submitRequest
+
 	// This lock protects block I/O access to the card reader
 	class Lock {
 		IOLock	*mutex_;
@@ -78,6 +284,13 @@ private:
 	IOBufferMemoryDescriptor *sdmaBuffDesc;
 	UInt32			physSdmaBuff;
 	void			*virtSdmaBuff;
+	IOBufferMemoryDescriptor *admaDescDesc;	// ADMA2 descriptor table, one page
+	UInt32			physAdmaDesc;
+	UInt8			*virtAdmaDesc;
+	IODMACommand		*admaCmd[2];	// ADMA2 segment generators, 32 and 64 bit
+	IOBufferMemoryDescriptor *taskBuffDesc;	// descriptor page + per-task bounce buffers
+	UInt32			physTaskBuff;
+	UInt8			*virtTaskBuff;
 	IOWorkLoop		*workLoop;
 	IOFilterInterruptEventSource *interruptSrc;
 	IOTimerEventSource	*timerSrc;
@@ -95,6 +308,55 @@ private:
 		kCardRemount
 	} cardPresence;
 	bool			isHighCapacity;
+	bool			isMMC;		// MMC/eMMC card rather than SD
+	UInt8			mmcCardType;	// EXT_CSD_CARD_TYPE
+	UInt8			mmcTiming;	// current kMMCTiming*
+	bool			mmcTuned;	// HS200 tuning succeeded
+	bool			mmcBusDDR;	// card's EXT_CSD bus width is a DDR encoding
+	UInt8			cmdqDepth;	// SD command queue depth, 0 if not in use
+	struct			CQHCIRegMap_t *CQHCIRegP;	// NULL if the host has no CQHCI
+	UInt8			cqeDepth;	// eMMC command queue depth, 0 if not in use
+	UInt8			hostSpec[6];	// SDHCI_SPEC_* per slot
+	bool			hostV4;		// Host Version 4 mode enabled
+	bool			hostADMA3;	// ADMA3 integrated descriptors usable
+	bool			cmd23;		// card takes CMD23 SET_BLOCK_COUNT
+	bool			stopNeeded;	// current transfer must be ended with CMD12
+	UInt32			xferDone;	// blocks a failed transfer got through
+	IOMemoryMap		*clientMap;	// client buffer mapped once per request for PIO
+	UInt8			degrade;	// kSDDegrade* in effect
+	UInt8			slowFrom;	// MMC timing kSDDegradeSlow gave up
+	UInt8			narrowFrom;	// HostControl bus width kSDDegradeNarrow gave up
+	UInt32			cleanRun;	// transfers since the last error
+	
+	SDIOTraceRecord_t	*ioTrace;	// capture ring, NULL until first enabled
+	volatile SInt64		ioTraceNext;
+	bool			ioTraceOn;
+	SDCmdTraceRecord_t	*cmdTrace[6];	// per slot command/event ring
+	volatile SInt64		cmdTraceNext[6];
+	UInt8			lastCommand[6];
+	SDStats_t		stats[6];
+	SDShadow_t		shadow[6];
+	UInt8			slotCount;
+	UInt32			hostQuirks;	// kSDQuirk* for the controller
+	UInt32			quirks;		// kSDQuirk* for the controller and card in use
+	UInt8			engine;		// kSDEngine* for block transfers
+	typedef IOReturn (VoodooSDHC::*SDEngineAccess)(IOMemoryDescriptor *buffer, UInt32 block,
+							UInt32 nblks, bool read, UInt32 base);
+	static const struct SDEngine_t {
+		const char	*name;
+		SDEngineAccess	access;
+	} engines[kSDEngineCount];
+	SDTuning_t		tuning;		// settings for the card in slot 0
+	SDCardCacheEntry_t	cardCache[SD_CARD_CACHE_ENTRIES];
+	SDCardCacheEntry_t	*cardCacheEntry;	// entry for the card in slot 0, NULL if new
+	UInt8			cardCacheNext;
+	UInt32			auSize;		// SD allocation unit in KB, 0 if unknown
+	bool			tunePending;	// characterize before the next I/O
+	SInt64			statsPublished;	// ops count at the last publish
+	
+	IOLock			*reqQueueLock;	// protects reqHead / reqTail
+	SDRequest_t		*reqHead;
+	SDRequest_t		*reqTail;
 	
 	bool			setup(IOService *provider);
 	void			dumpRegs(UInt8 slot);
@@ -102,12 +364,56 @@ private:
 	bool			isCardWP(UInt8 slot);
 	bool			cardInit( UInt8 slot );
 	void			LEDControl(UInt8 slot, bool state);
-	void			Reset( UInt8 slot, UInt8 type );
-	bool			SDCommand( UInt8 slot, UInt8 command, UInt16 response, UInt32 arg);
+	void			shadowLoad(UInt8 slot);
+	void			setHostControl(UInt8 slot, UInt8 clear, UInt8 set);
+	void			setHostControl2(UInt8 slot, UInt16 clear, UInt16 set);
+	void			setPowerControl(UInt8 slot, UInt8 value);
+	void			setClockControl(UInt8 slot, UInt16 value);
+	bool			Reset( UInt8 slot, UInt8 type );
+	bool			SDCommand( UInt8 slot, UInt8 command, UInt16 response, UInt32 arg,
+							bool data = false);
+	UInt8			commandFlags(UInt8 command);
+	bool			stopTransmission(UInt8 slot);
+	void			hostQuirksInit(IOService *provider, UInt8 slot);
+	void			cardQuirksInit(UInt8 slot);
+	UInt8			bestEngine(void);
+	UInt16			multiBlockMode(bool read, bool dma);
+	UInt16			transferEnd(UInt32 nblks, bool arg2);
+	bool			readSCR(UInt8 slot);
+	void			preErase(UInt32 nblks);
+	UInt32			partialBlocks(bool read, UInt32 nblks, UInt32 copied);
+	bool			recover(UInt8 slot, int attempt);
+	bool			busSlowDown(UInt8 slot);
+	bool			busNarrow(UInt8 slot);
+	void			busStepUp(UInt8 slot);
+	IOReturn		dataCommand_pio(UInt8 slot, UInt8 command, UInt16 response, UInt32 arg,
+							UInt32 *buff, UInt16 len, bool read);
 	bool			calcClock(UInt8 slot, UInt32 clockspeed);
+	void			hostV4Init(UInt8 slot);
+	void			setDMAAddress(UInt8 slot, UInt32 addr);
+	void			setBlockCount(UInt8 slot, UInt32 nblks);
+	UInt32			maxBlockCount(void);
+	bool			allocTaskBuffers(void);
 	bool			powerSD(UInt8 slot);
 	void			parseCID(UInt8 slot);
 	void			parseCSD(UInt8 slot);
+	bool			cmdqInit(UInt8 slot);
+	bool			mmcInit(UInt8 slot);
+	bool			mmcSwitch(UInt8 slot, UInt8 index, UInt8 value);
+	bool			mmcReadExtCSD(UInt8 slot, UInt8 *ext);
+	bool			mmcSetBusWidth(UInt8 slot, const UInt8 *ext);
+	UInt8			mmcBestTiming(UInt8 slot);
+	bool			mmcSetTiming(UInt8 slot, UInt8 timing);
+	void			mmcSetHostTiming(UInt8 slot, UInt8 timing);
+	bool			mmcSelectHS200(UInt8 slot, const UInt8 *ext);
+	bool			mmcSelectHS400(UInt8 slot);
+	bool			executeTuning(UInt8 slot, UInt8 command, UInt16 blkSize);
+	void			cqhciProbe(UInt8 slot);
+	bool			cqhciInit(UInt8 slot, const UInt8 *ext);
+	void			cqhciDisable(UInt8 slot);
+	bool			cqhciPause(UInt8 slot, bool data);
+	void			cqhciResume(UInt8 slot, bool data);
+	void			cqhciRecover(UInt8 slot);
 	
 //	IOReturn		requestIdle(void); /* 10.6.0 */
 //	IOReturn		doDiscard(UInt64 block, UInt64 nblks); /* 10.6.0 */
@@ -144,15 +450,62 @@ private:
 	IOReturn		reportMaxWriteTransfer(UInt64 blockSize, UInt64 *max);
 	IOReturn		reportMaxReadTransfer (UInt64 blockSize, UInt64 *max);
 #endif
-	IOReturn		sdma_access(IOMemoryDescriptor *buffer, UInt32 block, UInt32 nblks, bool read);
+	IOReturn		setProperties(OSObject *properties);
+	void			traceIO(const SDRequest_t *req, UInt32 options, UInt64 start);
+	void			publishIOTrace(void);
+	void			traceCmd(UInt8 slot, UInt8 event, UInt8 opcode, UInt32 arg, UInt16 normal,
+					 UInt32 response, UInt16 error);
+	void			publishCmdTrace(void);
+	void			statTime(UInt8 slot, UInt8 type, UInt64 start);
+	void			statIO(UInt8 slot, const SDRequest_t *req, UInt64 start);
+	void			publishStats(void);
+	void			tuneDefaults(void);
+	void			tuneCard(UInt8 slot);
+	void			cardCacheFind(UInt8 slot);
+	bool			cardCacheValid(const SDCardCacheEntry_t *entries);
+	void			cardCacheCheck(UInt8 slot);
+	void			cardCacheStore(UInt8 slot);
+	void			publishCardCache(void);
+	void			characterize(UInt8 slot);
+	UInt64			timeTransfer(IOMemoryDescriptor *buffer, UInt32 block, bool read);
+	void			publishTuning(void);
+	IOReturn		submitRequest(SDRequest_t *req);
+	void			processRequests(SDRequest_t *batch);
+	IOReturn		transferBlocks(IOMemoryDescriptor *buffer, UInt32 block, UInt32 nblks, bool read);
+	IOReturn		cmdq_access(SDRequest_t **reqs, UInt32 count);
+	IOReturn		cqhci_access(SDRequest_t **reqs, UInt32 count);
+	IOReturn		adma3_access(SDRequest_t **reqs, UInt32 count);
+	IOReturn		rawCommand(SDRequest_t *req);
+	IOReturn		pio_access(IOMemoryDescriptor *buffer, UInt32 block, UInt32 nblks, bool read,
+							UInt32 base);
+	IOReturn		adma32_access(IOMemoryDescriptor *buffer, UInt32 block, UInt32 nblks, bool read,
+							UInt32 base);
+	IOReturn		adma64_access(IOMemoryDescriptor *buffer, UInt32 block, UInt32 nblks, bool read,
+							UInt32 base);
+	IOReturn		adma2_transfer(IOMemoryDescriptor *buffer, UInt32 block, UInt32 nblks, bool read,
+							UInt32 base, bool wide);
+	IOReturn		sdma_access(IOMemoryDescriptor *buffer, UInt32 block, UInt32 nblks, bool read,
+							UInt32 base = 0);
+	IOReturn		sdma_transfer(IOMemoryDescriptor *buffer, UInt8 command, UInt32 arg,
+							UInt32 nblks, bool read, UInt32 base = 0);
+	IOMemoryMap		*mapClient(IOMemoryDescriptor *buffer);
+	void			unmapClient(IOMemoryDescriptor *buffer, IOMemoryMap *map);
+	IOMemoryMap		*bounceMap(IOMemoryDescriptor *buffer, IOByteCount len);
+	void			bounceIn(IOMemoryDescriptor *buffer, IOMemoryMap *map, IOByteCount offset,
+							void *bounce, IOByteCount len);
+	void			bounceOut(IOMemoryDescriptor *buffer, IOMemoryMap *map, IOByteCount offset,
+							const void *bounce, IOByteCount len);
 	IOReturn		readBlockMulti_pio(IOMemoryDescriptor *buffer, UInt32 block, UInt32 nblks,
-							UInt32 offset);
+							UInt32 offset, UInt8 *mapped);
 	IOReturn		readBlockSingle_pio(UInt8 *buff, UInt32 block);
 	IOReturn		writeBlockMulti_pio(IOMemoryDescriptor *buffer, UInt32 block, UInt32 nblks,
-							UInt32 offset);
+							UInt32 offset, UInt8 *mapped);
 	IOReturn		writeBlockSingle_pio(IOMemoryDescriptor *buffer, UInt32 block,
-							UInt32 offset);
-	bool			waitIntStatus(UInt32 maskBits);
+							UInt32 offset, UInt8 *mapped);
+	bool			waitIntStatus(UInt8 slot, UInt32 maskBits);
+	template <typename T>
+	bool			waitReg(UInt8 slot, const volatile T *reg, T mask, bool set, UInt32 timeoutUS,
+						const char *what);
 	void			handleInterrupt();
 	void			handleTimer();
 	
@@ -0,0 +1,159 @@
+#include "License.h"
+
+#include "VoodooSDHC.h"
+#include "VoodooSDHCUserClient.h"
+
+#define	super IOUserClient
+
+OSDefineMetaClassAndStructors ( VoodooSDHCUserClient, IOUserClient );
+
+const IOExternalMethodDispatch VoodooSDHCUserClient::methods[kVoodooSDHCRawMethodCount] = {
+	{ &VoodooSDHCUserClient::sSubmit, 0, 0, 1, 0 }		// kVoodooSDHCRawSubmit
+};
+
+/*
+ * initWithTask:  Raw commands can destroy the card's contents, so only
+ *		  administrators get a connection.
+ */
+bool VoodooSDHCUserClient::initWithTask(task_t owningTask, void *securityID, UInt32 type,
+					OSDictionary *properties)
+{
+	if (clientHasPrivilege(securityID, kIOClientPrivilegeAdministrator) != kIOReturnSuccess)
+		return false;
+	if (! super::initWithTask(owningTask, securityID, type, properties))
+		return false;
+	driver = NULL;
+	ringMem = NULL;
+	submitLock = NULL;
+	return true;
+}
+
+/*
+ * start:  Attach to the driver and allocate the ring memory shared with
+ *	   the client.
+ *	IOService *provider:  The VoodooSDHC instance
+ */
+bool VoodooSDHCUserClient::start(IOService *provider)
+{
+	if ((driver = OSDynamicCast(VoodooSDHC, provider)) == NULL)
+		return false;
+	if (! super::start(provider))
+		return false;
+	ringMem = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task,
+		kIODirectionInOut | kIOMemoryKernelUserShared,
+		SD_RAW_DATA_OFFSET + SD_RAW_DATA_SIZE, PAGE_SIZE);
+	if (ringMem == NULL)
+		return false;
+	bzero(ringMem->getBytesNoCopy(), sizeof(SDRawRing_t));
+	if ((submitLock = IOLockAlloc()) == NULL)
+		return false;
+	return true;
+}
+
+void VoodooSDHCUserClient::free(void)
+{
+	if (ringMem != NULL) {
+		ringMem->release();
+		ringMem = NULL;
+	}
+	if (submitLock != NULL) {
+		IOLockFree(submitLock);
+		submitLock = NULL;
+	}
+	super::free();
+}
+
+IOReturn VoodooSDHCUserClient::clientClose(void)
+{
+	terminate();
+	return kIOReturnSuccess;
+}
+
+/*
+ * clientMemoryForType:  Hand out the ring memory.
+ */
+IOReturn VoodooSDHCUserClient::clientMemoryForType(UInt32 type, IOOptionBits *options,
+						IOMemoryDescriptor **memory)
+{
+	if (type != kVoodooSDHCRawRingMemory || ringMem == NULL)
+		return kIOReturnBadArgument;
+	ringMem->retain();
+	*options = 0;
+	*memory = ringMem;
+	return kIOReturnSuccess;
+}
+
+IOReturn VoodooSDHCUserClient::externalMethod(uint32_t selector, IOExternalMethodArguments *args,
+					IOExternalMethodDispatch *dispatch, OSObject *target,
+					void *reference)
+{
+	if (selector >= kVoodooSDHCRawMethodCount)
+		return kIOReturnUnsupported;
+	dispatch = (IOExternalMethodDispatch *)&methods[selector];
+	target = this;
+	reference = NULL;
+	return super::externalMethod(selector, args, dispatch, target, reference);
+}
+
+IOReturn VoodooSDHCUserClient::sSubmit(OSObject *target, void *reference,
+					IOExternalMethodArguments *args)
+{
+	return static_cast<VoodooSDHCUserClient *>(target)->submit(&args->scalarOutput[0]);
+}
+
+/*
+ * submit:  Run every submitted entry, in order, as long as there is room
+ *	    for its completion.  Each entry is copied out of the shared ring
+ *	    before it is checked, since the client can change the ring at any
+ *	    time.  Returns success unless the ring indexes are corrupt.
+ *	UInt64 *completed:  Number of entries completed
+ */
+IOReturn VoodooSDHCUserClient::submit(UInt64 *completed)
+{
+	SDRawRing_t *ring = (SDRawRing_t *)ringMem->getBytesNoCopy();
+	SDRawCommand_t cmd;
+	SDRawCompletion_t *comp;
+	SDRequest_t req;
+	UInt32 head, tail, n = 0;
+	UInt64 bytes;
+	IOReturn status;
+
+	IOLockLock(submitLock);
+	head = ring->sqHead;
+	tail = ring->sqTail;
+	if (tail - head > SD_RAW_RING_ENTRIES) {
+		IOLockUnlock(submitLock);
+		return kIOReturnBadArgument;
+	}
+	while (head != tail && ring->cqTail - ring->cqHead < SD_RAW_RING_ENTRIES) {
+		cmd = ring->sq[head % SD_RAW_RING_ENTRIES];
+		bzero(&req, sizeof(req));
+		bytes = (UInt64)cmd.blockSize * cmd.blockCount;
+		if (cmd.blockCount != 0 &&
+		    (cmd.blockSize == 0 || cmd.blockSize > SD_RAW_MAX_BLKSZ || (cmd.blockSize & 3) ||
+		     (cmd.blockCount > 1 && (cmd.blockSize != 512 || (cmd.dataOffset & 511))) ||
+		     (UInt64)cmd.dataOffset + bytes > SD_RAW_DATA_SIZE)) {
+			status = kIOReturnBadArgument;
+		} else {
+			req.raw = &cmd;
+			req.buffer = ringMem;
+			req.nblks = cmd.blockCount;
+			req.read = (cmd.flags & kSDRawRead) != 0;
+			status = driver->submitRequest(&req);
+		}
+
+		comp = &ring->cq[ring->cqTail % SD_RAW_RING_ENTRIES];
+		comp->userData = cmd.userData;
+		comp->status = status;
+		for (int i = 0; i < 4; i++)
+			comp->response[i] = req.response[i];
+		comp->reserved = 0;
+		OSSynchronizeIO();
+		ring->cqTail++;
+		ring->sqHead = ++head;
+		n++;
+	}
+	IOLockUnlock(submitLock);
+	*completed = n;
+	return kIOReturnSuccess;
+}
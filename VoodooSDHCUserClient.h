@@ -0,0 +1,92 @@
+#ifndef _VoodooSDHCUserClient_H_
+#define _VoodooSDHCUserClient_H_
+#include "License.h"
+
+/*
+ * Raw command interface.  User space maps the ring memory
+ * (kVoodooSDHCRawRingMemory), fills submission entries, advances sqTail
+ * and calls kVoodooSDHCRawSubmit.  The driver runs the entries in order
+ * through the same request queue as block I/O, posts one completion per
+ * entry and advances sqHead and cqTail.  User space advances cqHead as it
+ * consumes completions.  The shared layout is usable from user space.
+ */
+enum {
+	kVoodooSDHCRawSubmit,		// out: number of entries completed
+	kVoodooSDHCRawMethodCount
+};
+
+enum {
+	kVoodooSDHCRawRingMemory
+};
+
+#define SD_RAW_RING_ENTRIES	64			/* power of 2 */
+#define SD_RAW_DATA_OFFSET	0x2000		/* data area, from the start of the ring memory */
+#define SD_RAW_DATA_SIZE	(256 * 1024)
+#define SD_RAW_MAX_BLKSZ	2048
+
+//SDRawCommand_t flags
+#define kSDRawRead		0x1		// data moves from the card
+
+struct SDRawCommand_t {
+	UInt8			opcode;
+	UInt8			flags;
+	UInt16			response;	// R0..R7 from SD_Commands.h
+	UInt32			arg;
+	UInt32			dataOffset;	// into the data area
+	UInt16			blockSize;	// 512 for more than one block
+	UInt16			reserved0;
+	UInt32			blockCount;	// 0 for commands without data
+	UInt32			reserved1;
+	UInt64			userData;	// copied to the completion
+};
+
+struct SDRawCompletion_t {
+	UInt64			userData;
+	SInt32			status;		// IOReturn
+	UInt32			response[4];
+	UInt32			reserved;
+};
+
+struct SDRawRing_t {
+	volatile UInt32		sqHead;		// written by the driver
+	volatile UInt32		sqTail;		// written by user space
+	volatile UInt32		cqHead;		// written by user space
+	volatile UInt32		cqTail;		// written by the driver
+	UInt32			reserved[12];
+	SDRawCommand_t		sq[SD_RAW_RING_ENTRIES];
+	SDRawCompletion_t	cq[SD_RAW_RING_ENTRIES];
+};
+
+#ifdef KERNEL
+#include <IOKit/IOUserClient.h>
+#include <IOKit/IOBufferMemoryDescriptor.h>
+
+class VoodooSDHC;
+
+class VoodooSDHCUserClient : public IOUserClient
+{
+	OSDeclareDefaultStructors ( VoodooSDHCUserClient )
+
+	VoodooSDHC			*driver;
+	IOBufferMemoryDescriptor	*ringMem;
+	IOLock				*submitLock;	// one batch at a time per client
+
+	static const IOExternalMethodDispatch methods[kVoodooSDHCRawMethodCount];
+	static IOReturn	sSubmit(OSObject *target, void *reference, IOExternalMethodArguments *args);
+
+public:
+	virtual bool		initWithTask(task_t owningTask, void *securityID, UInt32 type,
+							OSDictionary *properties);
+	virtual bool		start(IOService *provider);
+	virtual void		free(void);
+	virtual IOReturn	clientClose(void);
+	virtual IOReturn	clientMemoryForType(UInt32 type, IOOptionBits *options,
+							IOMemoryDescriptor **memory);
+	virtual IOReturn	externalMethod(uint32_t selector, IOExternalMethodArguments *args,
+							IOExternalMethodDispatch *dispatch, OSObject *target,
+							void *reference);
+	IOReturn		submit(UInt64 *completed);
+};
+#endif /* KERNEL */
+
+#endif /* _VoodooSDHCUserClient_H_ */
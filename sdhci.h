@@ -3,6 +3,7 @@
 
 /*Controller registers*/
 #define SDHCI_DMA_ADDRESS	0x00
+#define SDHCI_32BIT_BLK_CNT	0x00	/* Host Version 4 mode */
 
 #define SDHCI_BLOCK_SIZE	0x04
 #define  SDHCI_MAKE_BLKSZ(dma, blksz) (((dma & 0x7) << 12) | (blksz & 0xFFF))
@@ -15,6 +16,7 @@
 #define  SDHCI_TRNS_DMA		0x01
 #define  SDHCI_TRNS_BLK_CNT_EN	0x02
 #define  SDHCI_TRNS_ACMD12	0x04
+#define  SDHCI_TRNS_AUTO_CMD23	0x08
 #define  SDHCI_TRNS_READ	0x10
 #define  SDHCI_TRNS_MULTI	0x20
 
@@ -49,11 +51,13 @@
 #define  SDHCI_CTRL_LED		0x01
 #define  SDHCI_CTRL_4BITBUS	0x02
 #define  SDHCI_CTRL_HISPD	0x04
+#define  SDHCI_CTRL_8BITBUS	0x20
 #define  SDHCI_CTRL_DMA_MASK	0x18
 #define   SDHCI_CTRL_SDMA	0x00
 #define   SDHCI_CTRL_ADMA1	0x08
 #define   SDHCI_CTRL_ADMA32	0x10
 #define   SDHCI_CTRL_ADMA64	0x18
+#define   SDHCI_CTRL_ADMA3	0x18	/* Host Version 4 mode */
 
 #define SDHCI_POWER_CONTROL	0x29
 #define  SDHCI_POWER_ON		0x01
@@ -89,6 +93,7 @@
 #define  SDHCI_INT_CARD_INSERT	0x00000040
 #define  SDHCI_INT_CARD_REMOVE	0x00000080
 #define  SDHCI_INT_CARD_INT	0x00000100
+#define  SDHCI_INT_CQE		0x00004000
 #define  SDHCI_INT_ERROR	0x00008000
 #define  SDHCI_INT_TIMEOUT	0x00010000
 #define  SDHCI_INT_CRC		0x00020000
@@ -113,7 +118,19 @@
 
 #define SDHCI_ACMD12_ERR	0x3C
 
-/* 3E-3F reserved */
+#define SDHCI_HOST_CONTROL2	0x3E
+#define  SDHCI_CTRL_UHS_MASK	0x0007
+#define   SDHCI_CTRL_UHS_SDR12	0x0000
+#define   SDHCI_CTRL_UHS_SDR25	0x0001
+#define   SDHCI_CTRL_UHS_SDR50	0x0002
+#define   SDHCI_CTRL_UHS_SDR104	0x0003
+#define   SDHCI_CTRL_UHS_DDR50	0x0004
+#define   SDHCI_CTRL_HS400	0x0005 /* Non-standard, most hosts that do HS400 */
+#define  SDHCI_CTRL_VDD_180	0x0008
+#define  SDHCI_CTRL_EXEC_TUNING	0x0040
+#define  SDHCI_CTRL_TUNED_CLK	0x0080
+#define  SDHCI_CTRL_V4_MODE	0x1000
+#define  SDHCI_CTRL_64BIT_ADDR	0x2000
 
 #define SDHCI_CAPABILITIES	0x40
 #define  SDHCI_TIMEOUT_CLK_MASK	0x0000003F
@@ -131,8 +148,13 @@
 #define  SDHCI_CAN_VDD_300	0x02000000
 #define  SDHCI_CAN_VDD_180	0x04000000
 #define  SDHCI_CAN_64BIT	0x10000000
+#define  SDHCI_CAN_DO_8BIT	0x00040000
 
-/* 44-47 reserved for more caps */
+#define SDHCI_CAPABILITIES_1	0x44
+#define  SDHCI_SUPPORT_SDR50	0x00000001
+#define  SDHCI_SUPPORT_SDR104	0x00000002
+#define  SDHCI_SUPPORT_DDR50	0x00000004
+#define  SDHCI_CAN_DO_ADMA3	0x08000000
 
 #define SDHCI_MAX_CURRENT	0x48
 
@@ -147,7 +169,13 @@
 
 #define SDHCI_ADMA_ADDRESS	0x58
 
-/* 60-FB reserved */
+#define SDHCI_PRESET_VALUE	0x60
+
+/* 70-77 reserved */
+
+#define SDHCI_ADMA3_ADDRESS	0x78
+
+/* 80-FB reserved */
 
 #define SDHCI_SLOT_INT_STATUS	0xFC
 
@@ -158,6 +186,10 @@
 #define  SDHCI_SPEC_VER_SHIFT	0
 #define   SDHCI_SPEC_100	0
 #define   SDHCI_SPEC_200	1
+#define   SDHCI_SPEC_300	2
+#define   SDHCI_SPEC_400	3
+#define   SDHCI_SPEC_410	4
+#define   SDHCI_SPEC_420	5
 
 #ifdef LINUX_STRUCTURE
 struct sdhci_ops;